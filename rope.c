@@ -10,36 +10,759 @@
 #endif
 
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "rope.h"
 
-// The number of bytes the rope head structure takes up
-static const size_t ROPE_SIZE = sizeof(rope) + sizeof(rope_node) * ROPE_MAX_HEIGHT;
+#if ROPE_PARALLEL
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if ROPE_NODE_CACHE
+#include <pthread.h>
+#endif
+
+#if ROPE_USDT
+#include <sys/sdt.h>
+#endif
+
+#if ROPE_FILE_IO
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#define MIN(x,y) ((x) > (y) ? (y) : (x))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+#if ROPE_CONCURRENT
+// Stores which concurrent readers may observe. Everything the writer did before a PUBLISH is
+// visible to a reader which loads the new value with LOAD_ACQUIRE.
+#define PUBLISH(dest, val) __atomic_store_n(&(dest), (val), __ATOMIC_RELEASE)
+// Stores to sizes and flags which readers load with LOAD_RELAXED. Readers check the sequence
+// number afterwards, so these don't need any ordering, but they still have to be atomic.
+#define STORE_RELAXED(dest, val) __atomic_store_n(&(dest), (val), __ATOMIC_RELAXED)
+#define LOAD_ACQUIRE(src) __atomic_load_n(&(src), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(src) __atomic_load_n(&(src), __ATOMIC_RELAXED)
+
+// Memory the writer has unlinked, waiting until no reader can still be looking at it.
+typedef struct rope_retired_t {
+  void *ptr;
+  uint64_t epoch;
+  struct rope_retired_t *next;
+} rope_retired;
+
+struct rope_reader_t {
+  rope *r;
+  int slot;
+};
+#else
+#define PUBLISH(dest, val) ((dest) = (val))
+#define STORE_RELAXED(dest, val) ((dest) = (val))
+#endif
+
+#if ROPE_PREFETCH && (defined(__GNUC__) || defined(__clang__))
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)0)
+#endif
+
+// Count n of an event in the rope's stats, and fire the probe with the same name.
+#if ROPE_STATS
+#define COUNT_STAT(r, event, n) ((r)->stats.event += (n))
+#else
+#define COUNT_STAT(r, event, n) ((void)(n))
+#endif
+#if ROPE_USDT
+#define FIRE_PROBE(event, n) DTRACE_PROBE1(librope, event, n)
+#else
+#define FIRE_PROBE(event, n)
+#endif
+#define TRACE(r, event, n) do { COUNT_STAT(r, event, n); FIRE_PROBE(event, n); } while (0)
+
+#if ROPE_CONFIG
+#define NODE_STR_SIZE(r) ((size_t)(r)->config.node_str_size)
+#define NODE_MAX_SIZE(r) ((size_t)(r)->config.node_max_size)
+#define BIAS(r) ((r)->config.bias)
+#else
+#define NODE_STR_SIZE(r) ((size_t)ROPE_NODE_STR_SIZE)
+#define NODE_MAX_SIZE(r) ((size_t)ROPE_NODE_MAX_SIZE)
+#define BIAS(r) ROPE_BIAS
+#endif
+
+// The number of bytes the rope head structure takes up. The head node's buffer comes after its
+// nexts list.
+static size_t rope_size(size_t node_str_size) {
+  return sizeof(rope) + sizeof(rope_skip_node) * ROPE_MAX_HEIGHT + node_str_size;
+}
+
+// Figure out how many bytes to allocate for a node with the specified height and capacity.
+static size_t node_size(uint8_t height, size_t capacity) {
+  return sizeof(rope_node) + height * sizeof(rope_skip_node) + capacity;
+}
+
+#if ROPE_ARENA
+// Arena blocks are multiples of this, so they stay aligned.
+#define ARENA_GRANULARITY 16
+// Free blocks up to this size are kept in lists by size. Bigger ones (which are rare) share a list.
+#define ARENA_MAX_CLASS_SIZE 2048
+#define ARENA_NUM_CLASSES (ARENA_MAX_CLASS_SIZE / ARENA_GRANULARITY)
+// Chunks start this big, and double in size up to ARENA_MAX_CHUNK_SIZE as the rope grows.
+#define ARENA_MIN_CHUNK_SIZE (16 * 1024)
+#define ARENA_MAX_CHUNK_SIZE (1024 * 1024)
+
+typedef struct arena_chunk_t {
+  struct arena_chunk_t *next;
+  // Pads the header out so blocks in the chunk are aligned.
+  size_t unused;
+} arena_chunk;
+
+typedef struct arena_block_t {
+  struct arena_block_t *next;
+  // Only set in the list of big blocks.
+  size_t size;
+} arena_block;
+
+typedef struct rope_arena_t {
+  arena_chunk *chunks;
+  // The unused end of the newest chunk.
+  uint8_t *pos, *end;
+  size_t next_chunk_size;
+
+  arena_block *free[ARENA_NUM_CLASSES];
+  arena_block *big;
+} rope_arena;
+
+#define USES_ARENA(r) ((r)->arena != NULL)
+
+static inline size_t arena_round(size_t size) {
+  return (MAX(size, 1) + ARENA_GRANULARITY - 1) & ~(size_t)(ARENA_GRANULARITY - 1);
+}
+
+static rope_arena *new_arena(rope *r) {
+  rope_arena *a = (rope_arena *)r->alloc(sizeof(rope_arena));
+  memset(a, 0, sizeof(rope_arena));
+  a->next_chunk_size = ARENA_MIN_CHUNK_SIZE;
+  return a;
+}
+
+// Put a block of (rounded) size bytes on the arena's free lists.
+static void arena_free(rope_arena *a, void *ptr, size_t size) {
+  size = arena_round(size);
+  arena_block *b = (arena_block *)ptr;
+  if (size <= ARENA_MAX_CLASS_SIZE) {
+    b->next = a->free[size / ARENA_GRANULARITY - 1];
+    a->free[size / ARENA_GRANULARITY - 1] = b;
+  } else {
+    b->size = size;
+    b->next = a->big;
+    a->big = b;
+  }
+}
+
+static void *arena_alloc(rope *r, size_t size) {
+  rope_arena *a = r->arena;
+  size = arena_round(size);
+  if (size <= ARENA_MAX_CLASS_SIZE) {
+    arena_block *b = a->free[size / ARENA_GRANULARITY - 1];
+    if (b) {
+      a->free[size / ARENA_GRANULARITY - 1] = b->next;
+      return b;
+    }
+  } else {
+    // First fit, taking the block from the end of the free block it comes out of.
+    for (arena_block **b = &a->big; *b; b = &(*b)->next) {
+      if ((*b)->size < size) continue;
+      size_t left = (*b)->size - size;
+      uint8_t *block = (uint8_t *)*b;
+      if (left == 0) {
+        *b = (*b)->next;
+      } else {
+        arena_block *rest = *b;
+        *b = rest->next;
+        arena_free(a, rest, left);
+      }
+      return block + left;
+    }
+  }
+
+  // The arena starts with no chunk, so pos and end are both NULL and can't be offset.
+  if (size > (size_t)(a->end - a->pos)) {
+    // Whatever is left of the newest chunk is kept for later.
+    if (a->end > a->pos) arena_free(a, a->pos, a->end - a->pos);
+
+    size_t chunk_size = MAX(a->next_chunk_size, size + sizeof(arena_chunk));
+    arena_chunk *chunk = (arena_chunk *)r->alloc(chunk_size);
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    a->pos = (uint8_t *)(chunk + 1);
+    a->end = (uint8_t *)chunk + chunk_size;
+    a->next_chunk_size = MIN(a->next_chunk_size * 2, ARENA_MAX_CHUNK_SIZE);
+  }
+  void *block = a->pos;
+  a->pos += size;
+  return block;
+}
+
+static void free_arena(rope *r, rope_arena *a) {
+  for (arena_chunk *c = a->chunks, *next; c != NULL; c = next) {
+    next = c->next;
+    r->free(c);
+  }
+  r->free(a);
+}
+#else
+#define USES_ARENA(r) false
+#define arena_alloc(r, size) NULL
+#define arena_free(a, ptr, size) ((void)0)
+#endif
+
+// Allocate and return a new node. The new node will be full of junk, except
+// for its height, capacity and str, which points to its own buffer.
+static rope_node *alloc_node(rope *r, uint8_t height, size_t capacity) {
+  size_t size = node_size(height, capacity);
+  rope_node *node = (rope_node *)(USES_ARENA(r) ? arena_alloc(r, size) : r->alloc(size));
+#if ROPE_ARENA
+  node->alloc_size = (uint32_t)size;
+#endif
+  node->str = (uint8_t *)&node->nexts[height];
+  node->capacity = (uint32_t)capacity;
+  node->height = height;
+  node->flags = 0;
+#if ROPE_ANCHORS
+  node->anchors = NULL;
+#endif
+  TRACE(r, nodes_allocated, 1);
+  return node;
+}
+
+// Free memory which has been unlinked from the rope. Concurrent readers might still be using it,
+// so with ROPE_CONCURRENT it is retired instead and freed by reclaim() once they're done.
+static void release(rope *r, void *ptr) {
+#if ROPE_CONCURRENT
+  rope_retired *item = (rope_retired *)r->alloc(sizeof(rope_retired));
+  item->ptr = ptr;
+  item->epoch = r->epoch;
+  item->next = r->retired;
+  r->retired = item;
+#else
+  r->free(ptr);
+#endif
+}
+
+static void free_node(rope *r, rope_node *n) {
+  if (USES_ARENA(r)) {
+    if (n->flags & ROPE_NODE_GROWN) arena_free(r->arena, n->str, n->capacity);
+    if (n != &r->head) arena_free(r->arena, n, n->alloc_size);
+  } else {
+    if (n->flags & ROPE_NODE_GROWN) release(r, n->str);
+    if (n != &r->head) release(r, n);
+  }
+  if (n != &r->head) TRACE(r, nodes_freed, 1);
+}
+
+static inline bool is_external(const rope_node *n) {
+  return n->flags & ROPE_NODE_EXTERNAL;
+}
+
+// Move the node's contents to a separately allocated buffer with room for at least size bytes.
+// Nodes can't be reallocated in place because we don't know all the pointers to them.
+static void grow_node(rope *r, rope_node *n, size_t size) {
+  assert(!is_external(n));
+  assert(size <= NODE_MAX_SIZE(r));
+  size_t capacity = MIN(MAX(size, 2 * (size_t)n->capacity), NODE_MAX_SIZE(r));
+
+  uint8_t *str;
+  if (USES_ARENA(r)) {
+    str = (uint8_t *)arena_alloc(r, capacity);
+    memcpy(str, n->str, n->num_bytes);
+    if (n->flags & ROPE_NODE_GROWN) arena_free(r->arena, n->str, n->capacity);
+  } else if ((n->flags & ROPE_NODE_GROWN) && !ROPE_CONCURRENT) {
+    str = (uint8_t *)r->realloc(n->str, capacity);
+  } else {
+    // Concurrent readers might still be reading the old buffer, so it can't be realloc'ed.
+    str = (uint8_t *)r->alloc(capacity);
+    memcpy(str, n->str, n->num_bytes);
+    if (n->flags & ROPE_NODE_GROWN) release(r, n->str);
+  }
+  // Readers load capacity before str, so they never see a capacity bigger than the buffer.
+  PUBLISH(n->str, str);
+  STORE_RELAXED(n->flags, n->flags | ROPE_NODE_GROWN);
+  PUBLISH(n->capacity, (uint32_t)capacity);
+  TRACE(r, nodes_grown, 1);
+}
+
+#if ROPE_COMPRESS
+// Compressed nodes use a small LZ77 codec, in the style of LZ4. A block is a run of sequences,
+// each some literal bytes followed by a match - a copy of earlier output. A sequence starts with
+// a token whose high 4 bits are the number of literals and low 4 bits are the match length minus
+// PACK_MIN_MATCH. 15 means the length carries on in the following bytes, which are added to it up
+// to and including the first one which isn't 255. Then come the literals, then the match's offset
+// back from the end of the output (2 bytes, little endian), then the rest of its length. The last
+// sequence has no match. Blocks don't record their unpacked size - nodes know it already.
+#define PACK_MIN_MATCH 4
+#define PACK_HASH_BITS 10
+#define PACK_MAX_OFFSET 0xffff
+
+static inline bool is_compressed(const rope_node *n) {
+  return n->flags & ROPE_NODE_COMPRESSED;
+}
+
+// The most bytes a sequence's length field can take up past its token.
+static inline size_t length_bytes(size_t len) {
+  return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+static uint8_t *put_length(uint8_t *out, size_t len) {
+  for (len -= 15; len >= 255; len -= 255) *out++ = 255;
+  *out++ = (uint8_t)len;
+  return out;
+}
+
+static size_t get_length(const uint8_t **in) {
+  size_t len = 15;
+  uint8_t b;
+  do {
+    b = *(*in)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+// Append a sequence of num_lits literals, followed by a match of match_len bytes offset back (or
+// no match if match_len is 0). Returns the new end of the output, or NULL if it would go past end.
+static uint8_t *put_sequence(uint8_t *out, uint8_t *end, const uint8_t *lits, size_t num_lits,
+    size_t offset, size_t match_len) {
+  size_t match_code = match_len ? match_len - PACK_MIN_MATCH : 0;
+  size_t size = 1 + length_bytes(num_lits) + num_lits
+      + (match_len ? 2 + length_bytes(match_code) : 0);
+  if (size > (size_t)(end - out)) return NULL;
+
+  *out++ = (uint8_t)((MIN(num_lits, 15) << 4) | MIN(match_code, 15));
+  if (num_lits >= 15) out = put_length(out, num_lits);
+  memcpy(out, lits, num_lits);
+  out += num_lits;
+  if (match_len) {
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    if (match_code >= 15) out = put_length(out, match_code);
+  }
+  return out;
+}
+
+// Compress len bytes from src into dest. Returns the compressed size, or 0 if it won't fit in max
+// bytes.
+static size_t pack_block(const uint8_t *src, size_t len, uint8_t *dest, size_t max) {
+  // The last position each hash of PACK_MIN_MATCH bytes was seen at, plus 1 (0 is none).
+  uint32_t seen[1 << PACK_HASH_BITS];
+  memset(seen, 0, sizeof(seen));
+  uint8_t *out = dest, *end = dest + max;
+  size_t pos = 0, lits = 0;
+  while (pos + PACK_MIN_MATCH <= len) {
+    uint32_t bytes;
+    memcpy(&bytes, &src[pos], PACK_MIN_MATCH);
+    uint32_t hash = (bytes * 2654435761u) >> (32 - PACK_HASH_BITS);
+    size_t prev = seen[hash];
+    seen[hash] = (uint32_t)(pos + 1);
+    if (prev == 0 || pos + 1 - prev > PACK_MAX_OFFSET
+        || memcmp(&src[prev - 1], &src[pos], PACK_MIN_MATCH) != 0) {
+      pos++;
+      continue;
+    }
+
+    size_t match = prev - 1, match_len = PACK_MIN_MATCH;
+    while (pos + match_len < len && src[match + match_len] == src[pos + match_len]) match_len++;
+    out = put_sequence(out, end, &src[lits], pos - lits, pos - match, match_len);
+    if (out == NULL) return 0;
+    pos += match_len;
+    lits = pos;
+  }
+  out = put_sequence(out, end, &src[lits], len - lits, 0, 0);
+  return out ? out - dest : 0;
+}
+
+// Decompress a block made by pack_block, which unpacks to len bytes, into dest.
+static void unpack_block(const uint8_t *src, uint8_t *dest, size_t len) {
+  uint8_t *out = dest, *end = dest + len;
+  while (true) {
+    uint8_t token = *src++;
+    size_t num_lits = token >> 4;
+    if (num_lits == 15) num_lits = get_length(&src);
+    memcpy(out, src, num_lits);
+    out += num_lits;
+    src += num_lits;
+    if (out == end) break;
+
+    size_t offset = src[0] | (size_t)src[1] << 8;
+    src += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15) match_len = get_length(&src);
+    match_len += PACK_MIN_MATCH;
+    // Matches can overlap the bytes they produce. Those are copied a byte at a time.
+    const uint8_t *match = out - offset;
+    if (offset >= match_len) {
+      memcpy(out, match, match_len);
+    } else {
+      for (size_t i = 0; i < match_len; i++) out[i] = match[i];
+    }
+    out += match_len;
+  }
+  assert(out == end);
+}
+
+// Compressed nodes' text lives in a buffer of its own, from the arena if the rope has one.
+static uint8_t *alloc_buffer(rope *r, size_t size) {
+  return (uint8_t *)(USES_ARENA(r) ? arena_alloc(r, size) : r->alloc(size));
+}
+
+static void free_buffer(rope *r, uint8_t *buffer, size_t size) {
+  if (USES_ARENA(r)) {
+    arena_free(r->arena, buffer, size);
+  } else {
+    r->free(buffer);
+  }
+}
+
+// Make a compressed copy of n, with the given height.
+static rope_node *copy_compressed(rope *r, const rope_node *n, uint8_t height) {
+  rope_node *n2 = alloc_node(r, height, 0);
+  n2->str = alloc_buffer(r, n->capacity);
+  memcpy(n2->str, n->str, n->capacity);
+  n2->capacity = n->capacity;
+  n2->num_bytes = n->num_bytes;
+  n2->flags = ROPE_NODE_COMPRESSED | ROPE_NODE_GROWN;
+  return n2;
+}
+
+// Decompress a node in place. Its links don't change.
+static void thaw_node(rope *r, rope_node *n) {
+  assert(is_compressed(n));
+  size_t capacity = MAX(n->num_bytes, NODE_STR_SIZE(r));
+  uint8_t *str = alloc_buffer(r, capacity);
+  unpack_block(n->str, str, n->num_bytes);
+  free_buffer(r, n->str, n->capacity);
+  n->str = str;
+  n->capacity = (uint32_t)capacity;
+  n->flags &= ~ROPE_NODE_COMPRESSED;
+  r->num_compressed--;
+  TRACE(r, nodes_thawed, 1);
+}
+
+// Make sure n's text can be read and edited.
+static inline void thaw(rope *r, rope_node *n) {
+  if (is_compressed(n)) thaw_node(r, n);
+}
+
+// Make sure all of the rope's text can be read.
+static inline void thaw_rope(rope *r) {
+  if (r->num_compressed) rope_decompress(r);
+}
+
+// Copy n's text to dest, decompressing it straight there if it's compressed.
+static inline void copy_node_text(uint8_t *dest, const rope_node *n) {
+  if (is_compressed(n)) {
+    unpack_block(n->str, dest, n->num_bytes);
+  } else {
+    memcpy(dest, n->str, n->num_bytes);
+  }
+}
+
+// Somewhere to decompress a node's text to read it, without thawing the node. Ropes configured
+// with bigger nodes than ROPE_NODE_MAX_SIZE get a buffer from their allocator.
+typedef struct {
+  uint8_t local[ROPE_NODE_MAX_SIZE];
+  uint8_t *buf;
+} unpack_buffer;
+
+static void init_unpack_buffer(const rope *r, unpack_buffer *u) {
+  u->buf = r->num_compressed && NODE_MAX_SIZE(r) > ROPE_NODE_MAX_SIZE
+      ? (uint8_t *)r->alloc(NODE_MAX_SIZE(r)) : u->local;
+}
+
+static void free_unpack_buffer(const rope *r, unpack_buffer *u) {
+  if (u->buf != u->local) r->free(u->buf);
+}
+
+// n's text, decompressed into u if it's compressed. Only valid until u is used again.
+static inline const uint8_t *node_text(const rope_node *n, unpack_buffer *u) {
+  if (!is_compressed(n)) return n->str;
+  unpack_block(n->str, u->buf, n->num_bytes);
+  return u->buf;
+}
+#else
+static inline bool is_compressed(const rope_node *n) { return false; }
+static inline void thaw(rope *r, rope_node *n) {}
+static inline void thaw_rope(rope *r) {}
+static inline void copy_node_text(uint8_t *dest, const rope_node *n) {
+  memcpy(dest, n->str, n->num_bytes);
+}
+typedef struct { char unused; } unpack_buffer;
+static inline void init_unpack_buffer(const rope *r, unpack_buffer *u) {}
+static inline void free_unpack_buffer(const rope *r, unpack_buffer *u) {}
+static inline const uint8_t *node_text(const rope_node *n, unpack_buffer *u) { return n->str; }
+#endif
+
+// Set up the rope's head node to use the buffer at the end of the rope structure.
+static void init_head(rope *r) {
+  r->head.str = (uint8_t *)&r->head.nexts[ROPE_MAX_HEIGHT];
+  r->head.capacity = (uint32_t)NODE_STR_SIZE(r);
+  r->head.flags = 0;
+#if ROPE_ANCHORS
+  r->head.anchors = NULL;
+#endif
+}
+
+#if ROPE_ANCHORS
+struct rope_anchor_t {
+  rope_node *node;
+  // Characters from the start of node. Only anchors in the head can have offset 0 - an anchor at
+  // the start of any other node is kept at the end of the node before it instead, so text inserted
+  // at a node boundary never lands on the wrong side of it.
+  size_t offset;
+  ROPE_ANCHOR_BIAS bias;
+  // The node's list of anchors.
+  struct rope_anchor_t *prev, *next;
+};
+
+static void link_anchor(rope_anchor *a, rope_node *n, size_t offset) {
+  a->node = n;
+  a->offset = offset;
+  a->prev = NULL;
+  a->next = n->anchors;
+  if (n->anchors) n->anchors->prev = a;
+  n->anchors = a;
+}
+
+static void unlink_anchor(rope_anchor *a) {
+  if (a->prev) a->prev->next = a->next;
+  else a->node->anchors = a->next;
+  if (a->next) a->next->prev = a->prev;
+}
+
+static inline void set_prev(rope_node *n, int height, rope_node *prev) {
+  if (n) n->nexts[height].prev = prev;
+}
+
+// num_chars were inserted at offset in n.
+static void anchors_inserted(rope_node *n, size_t offset, size_t num_chars) {
+  for (rope_anchor *a = n->anchors; a != NULL; a = a->next) {
+    if (a->offset > offset || (a->offset == offset && a->bias == ROPE_ANCHOR_RIGHT)) {
+      a->offset += num_chars;
+    }
+  }
+}
+
+// The characters after offset in n were moved to the start of dest.
+static void anchors_moved(rope_node *n, size_t offset, rope_node *dest) {
+  for (rope_anchor *a = n->anchors, *next; a != NULL; a = next) {
+    next = a->next;
+    if (a->offset > offset) {
+      unlink_anchor(a);
+      link_anchor(a, dest, a->offset - offset);
+    }
+  }
+}
+
+// Text inserted at offset in n was put in other nodes, ending at dest_offset in dest. Right
+// anchors at offset belong after it.
+static void right_anchors_moved(rope_node *n, size_t offset, rope_node *dest, size_t dest_offset) {
+  for (rope_anchor *a = n->anchors, *next; a != NULL; a = next) {
+    next = a->next;
+    if (a->offset == offset && a->bias == ROPE_ANCHOR_RIGHT) {
+      unlink_anchor(a);
+      link_anchor(a, dest, dest_offset);
+    }
+  }
+}
+
+// num_chars were removed from offset in n. Anchors in the removed text (or just after it) collapse
+// to the deletion position, which is dest_offset in dest.
+static void anchors_removed(rope_node *n, size_t offset, size_t num_chars,
+    rope_node *dest, size_t dest_offset) {
+  for (rope_anchor *a = n->anchors, *next; a != NULL; a = next) {
+    next = a->next;
+    if (a->offset <= offset) continue;
+    if (a->offset > offset + num_chars) {
+      a->offset -= num_chars;
+    } else if (n == dest) {
+      a->offset = dest_offset;
+    } else {
+      unlink_anchor(a);
+      link_anchor(a, dest, dest_offset);
+    }
+  }
+}
+
+static void free_anchors(rope *r, rope_node *n) {
+  for (rope_anchor *a = n->anchors, *next; a != NULL; a = next) {
+    next = a->next;
+    r->free(a);
+  }
+}
+#else
+static inline void set_prev(rope_node *n, int height, rope_node *prev) {}
+static inline void anchors_inserted(rope_node *n, size_t offset, size_t num_chars) {}
+static inline void anchors_moved(rope_node *n, size_t offset, rope_node *dest) {}
+static inline void right_anchors_moved(rope_node *n, size_t offset, rope_node *dest,
+    size_t dest_offset) {}
+static inline void anchors_removed(rope_node *n, size_t offset, size_t num_chars,
+    rope_node *dest, size_t dest_offset) {}
+static inline void free_anchors(rope *r, rope_node *n) {}
+#endif
+
+#if ROPE_CONCURRENT
+static void init_concurrent(rope *r) {
+  r->seq = 0;
+  // Reader slots use epoch 0 to mean inactive.
+  r->epoch = 1;
+  memset(r->reader_epochs, 0, sizeof(r->reader_epochs));
+  memset(r->reader_used, 0, sizeof(r->reader_used));
+  r->retired = NULL;
+}
+
+// Mutations are bracketed by begin_write / end_write. The sequence number is odd while the rope is
+// being modified, and readers retry if it changes under them.
+static void begin_write(rope *r) {
+  __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Advance the epoch if every active reader has seen the current one, then free everything retired
+// at least two epochs ago. No reader can still hold a pointer to those.
+static void reclaim(rope *r) {
+  if (r->retired == NULL) return;
+
+  uint64_t epoch = r->epoch;
+  bool can_advance = true;
+  for (int i = 0; i < ROPE_MAX_READERS; i++) {
+    uint64_t e = __atomic_load_n(&r->reader_epochs[i], __ATOMIC_SEQ_CST);
+    if (e && e != epoch) {
+      can_advance = false;
+      break;
+    }
+  }
+  if (can_advance) {
+    __atomic_store_n(&r->epoch, ++epoch, __ATOMIC_SEQ_CST);
+  }
+
+  // The retired list is sorted newest first.
+  rope_retired **p = &r->retired;
+  while (*p && (*p)->epoch + 2 > epoch) p = &(*p)->next;
+  rope_retired *item = *p;
+  *p = NULL;
+  while (item) {
+    rope_retired *next = item->next;
+    r->free(item->ptr);
+    r->free(item);
+    item = next;
+  }
+}
+
+static void end_write(rope *r) {
+  __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELEASE);
+  reclaim(r);
+}
+#else
+#define begin_write(r)
+#define end_write(r)
+#endif
 
 // Create a new rope with no contents
-rope *rope_new2(void *(*alloc)(size_t bytes),
-                void *(*realloc)(void *ptr, size_t newsize),
-                void (*free)(void *ptr)) {
-  rope *r = (rope *)alloc(ROPE_SIZE);
+static rope *new_rope(void *(*alloc)(size_t bytes),
+                      void *(*realloc)(void *ptr, size_t newsize),
+                      void (*free)(void *ptr),
+                      size_t node_str_size) {
+  rope *r = (rope *)alloc(rope_size(node_str_size));
   r->num_chars = r->num_bytes = 0;
 
   r->alloc = alloc;
   r->realloc = realloc;
   r->free = free;
 
+#if ROPE_ARENA
+  r->arena = NULL;
+#endif
+#if ROPE_CONFIG
+  r->config.node_str_size = (uint32_t)node_str_size;
+  r->config.node_max_size = ROPE_NODE_MAX_SIZE;
+  r->config.bias = ROPE_BIAS;
+#endif
+  init_head(r);
+#if ROPE_CONCURRENT
+  init_concurrent(r);
+#endif
+#if ROPE_STATS
+  memset(&r->stats, 0, sizeof(rope_stats));
+#endif
+#if ROPE_COMPRESS
+  r->num_compressed = 0;
+#endif
+  r->tail = NULL;
+  r->tail_valid = 0;
   r->head.height = 1;
   r->head.num_bytes = 0;
   r->head.nexts[0].node = NULL;
   r->head.nexts[0].skip_size = 0;
 #if ROPE_WCHAR
   r->head.nexts[0].wchar_size = 0;
+#endif
+#if ROPE_HASH
+  r->head.nexts[0].hash = 0;
+  r->head.nexts[0].hash_pow = 1;
 #endif
   return r;
 }
 
+rope *rope_new2(void *(*alloc)(size_t bytes),
+                void *(*realloc)(void *ptr, size_t newsize),
+                void (*free)(void *ptr)) {
+  return new_rope(alloc, realloc, free, ROPE_NODE_STR_SIZE);
+}
+
 rope *rope_new() {
   return rope_new2(malloc, realloc, free);
 }
 
+#if ROPE_ARENA
+rope *rope_new_arena2(void *(*alloc)(size_t bytes),
+                      void *(*realloc)(void *ptr, size_t newsize),
+                      void (*free)(void *ptr)) {
+  rope *r = rope_new2(alloc, realloc, free);
+  r->arena = new_arena(r);
+  return r;
+}
+
+rope *rope_new_arena() {
+  return rope_new_arena2(malloc, realloc, free);
+}
+#endif
+
+#if ROPE_CONFIG
+rope *rope_new_with_config2(const rope_config *config,
+                            void *(*alloc)(size_t bytes),
+                            void *(*realloc)(void *ptr, size_t newsize),
+                            void (*free)(void *ptr)) {
+  rope_config c = *config;
+  if (c.node_str_size == 0) c.node_str_size = ROPE_NODE_STR_SIZE;
+  if (c.node_max_size == 0) c.node_max_size = MAX(ROPE_NODE_MAX_SIZE, c.node_str_size);
+  if (c.bias == 0) c.bias = ROPE_BIAS;
+  // Nodes have to fit any utf8 character.
+  if (c.node_str_size < 4 || c.node_str_size > c.node_max_size || c.bias >= 100) return NULL;
+
+  rope *r = new_rope(alloc, realloc, free, c.node_str_size);
+  r->config = c;
+  return r;
+}
+
+rope *rope_new_with_config(const rope_config *config) {
+  return rope_new_with_config2(config, malloc, realloc, free);
+}
+#endif
+
 // Create a new rope containing the specified string
 rope *rope_new_with_utf8(const uint8_t *str) {
   rope *r = rope_new();
@@ -53,11 +776,42 @@ rope *rope_new_with_utf8(const uint8_t *str) {
   }
 }
 
+// Create a new rope referencing the specified external string
+rope *rope_new_with_external(const uint8_t *str, size_t len) {
+  rope *r = rope_new();
+  ROPE_RESULT result = rope_insert_external(r, 0, str, len);
+
+  if (result != ROPE_OK) {
+    rope_free(r);
+    return NULL;
+  } else {
+    return r;
+  }
+}
+
 rope *rope_copy(const rope *other) {
-  rope *r = (rope *)other->alloc(ROPE_SIZE);
+  rope *r = (rope *)other->alloc(rope_size(NODE_STR_SIZE(other)));
 
   // Just copy most of the head's data. Note this won't copy the nexts list in head.
   *r = *other;
+  init_head(r);
+#if ROPE_ARENA
+  if (other->arena) r->arena = new_arena(r);
+#endif
+#if ROPE_CONCURRENT
+  init_concurrent(r);
+#endif
+#if ROPE_STATS
+  memset(&r->stats, 0, sizeof(rope_stats));
+#endif
+  r->tail = NULL;
+  r->tail_valid = 0;
+  r->head.num_bytes = 0;
+  if (other->head.num_bytes > r->head.capacity) {
+    grow_node(r, &r->head, other->head.num_bytes);
+  }
+  memcpy(r->head.str, other->head.str, other->head.num_bytes);
+  r->head.num_bytes = other->head.num_bytes;
 
   rope_node *nodes[ROPE_MAX_HEIGHT];
 
@@ -70,16 +824,27 @@ rope *rope_copy(const rope *other) {
   for (rope_node *n = other->head.nexts[0].node; n != NULL; n = n->nexts[0].node) {
     // I wonder if it would be faster if we took this opportunity to rebalance the node list..?
     size_t h = n->height;
-    rope_node *n2 = (rope_node *)r->alloc(sizeof(rope_node) + h * sizeof(rope_skip_node));
-
-    // Would it be faster to just *n2 = *n; ?
+    rope_node *n2;
+    if (is_external(n)) {
+      // External spans are shared between the copies.
+      n2 = alloc_node(r, h, 0);
+      n2->str = n->str;
+      n2->flags = ROPE_NODE_EXTERNAL;
+#if ROPE_COMPRESS
+    } else if (is_compressed(n)) {
+      n2 = copy_compressed(r, n, h);
+#endif
+    } else {
+      // Grown nodes are copied back into a single allocation.
+      n2 = alloc_node(r, h, MAX(n->num_bytes, NODE_STR_SIZE(r)));
+      memcpy(n2->str, n->str, n->num_bytes);
+    }
     n2->num_bytes = n->num_bytes;
-    n2->height = h;
-    memcpy(n2->str, n->str, n->num_bytes);
     memcpy(n2->nexts, n->nexts, h * sizeof(rope_skip_node));
 
     for (int i = 0; i < h; i++) {
       nodes[i]->nexts[i].node = n2;
+      set_prev(n2, i, nodes[i]);
       nodes[i] = n2;
     }
   }
@@ -91,11 +856,40 @@ rope *rope_copy(const rope *other) {
 void rope_free(rope *r) {
   assert(r);
   rope_node *next;
+  if (r->tail) r->free(r->tail);
+
+#if ROPE_ARENA
+  if (r->arena) {
+    // The nodes all live in the arena's chunks.
+#if ROPE_ANCHORS
+    for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
+      free_anchors(r, n);
+    }
+#endif
+    free_arena(r, r->arena);
+  } else
+#endif
+  {
+    for (rope_node *n = r->head.nexts[0].node; n != NULL; n = next) {
+      next = n->nexts[0].node;
+      free_anchors(r, n);
+      free_node(r, n);
+    }
+    free_anchors(r, &r->head);
+    free_node(r, &r->head);
+  }
 
-  for (rope_node *n = r->head.nexts[0].node; n != NULL; n = next) {
-    next = n->nexts[0].node;
-    r->free(n);
+#if ROPE_CONCURRENT
+  // Nobody can be reading a rope which is being freed.
+  for (rope_retired *item = r->retired, *next; item != NULL; item = next) {
+    next = item->next;
+    r->free(item->ptr);
+    r->free(item);
   }
+#endif
+#if ROPE_STATS
+  rope_reset_stats(r);
+#endif
 
   r->free(r);
 }
@@ -122,7 +916,7 @@ size_t rope_write_cstr(rope *r, uint8_t *dest) {
   if (num_bytes) {
     uint8_t *p = dest;
     for (rope_node* restrict n = &r->head; n != NULL; n = n->nexts[0].node) {
-      memcpy(p, n->str, n->num_bytes);
+      copy_node_text(p, n);
       p += n->num_bytes;
     }
 
@@ -146,16 +940,13 @@ size_t rope_wchar_count(rope *r) {
 }
 #endif
 
-#define MIN(x,y) ((x) > (y) ? (y) : (x))
-#define MAX(x,y) ((x) > (y) ? (x) : (y))
-
 #ifdef _WIN32
 inline static long random() {
   return rand();
 }
 #endif
 
-static uint8_t random_height() {
+static uint8_t random_height(const rope *r) {
   // This function is horribly inefficient. I'm throwing away heaps of entropy, and
   // the mod could be replaced by some clever shifting.
   //
@@ -166,27 +957,13 @@ static uint8_t random_height() {
 
   // The root node's height is the height of the largest node + 1, so the largest
   // node can only have ROPE_MAX_HEIGHT - 1.
-  while(height < (ROPE_MAX_HEIGHT - 1) && (random() % 100) < ROPE_BIAS) {
+  while(height < (ROPE_MAX_HEIGHT - 1) && (random() % 100) < BIAS(r)) {
     height++;
   }
 
   return height;
 }
 
-// Figure out how many bytes to allocate for a node with the specified height.
-static size_t node_size(uint8_t height) {
-  return sizeof(rope_node) + height * sizeof(rope_skip_node);
-}
-
-// Allocate and return a new node. The new node will be full of junk, except
-// for its height.
-// This function should be replaced at some point with an object pool based version.
-static rope_node *alloc_node(rope *r, uint8_t height) {
-  rope_node *node = (rope_node *)r->alloc(node_size(height));
-  node->height = height;
-  return node;
-}
-
 // Find out how many bytes the unicode character which starts with the specified byte
 // will occupy in memory.
 // Returns the number of bytes, or SIZE_MAX if the byte is invalid.
@@ -235,6 +1012,79 @@ static size_t count_utf8_in_wchars(const uint8_t *str, size_t num_wchars) {
   }
   return chars;
 }
+
+#define IS_HIGH_SURROGATE(c) (((c) & 0xfc00) == 0xd800)
+#define IS_LOW_SURROGATE(c) (((c) & 0xfc00) == 0xdc00)
+
+// How many bytes will the character starting with the utf16 code unit c take up in utf8?
+static inline size_t utf16_codepoint_size(uint16_t c) {
+  return c < 0x80 ? 1 : c < 0x800 ? 2 : IS_HIGH_SURROGATE(c) ? 4 : 3;
+}
+
+// Checks that len code units of utf16 are ok (no NULs or unpaired surrogates). Returns the number
+// of bytes they take up as utf8 if they are, otherwise SIZE_MAX.
+static size_t utf8_size_of_utf16(const uint16_t *str, size_t len) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < len; i++) {
+    uint16_t c = str[i];
+    if (c == 0 || IS_LOW_SURROGATE(c)) return SIZE_MAX;
+    if (IS_HIGH_SURROGATE(c)) {
+      if (i + 1 == len || !IS_LOW_SURROGATE(str[i + 1])) return SIZE_MAX;
+      i++;
+    }
+    bytes += utf16_codepoint_size(c);
+  }
+  return bytes;
+}
+
+// Find how much of the utf16 at str fits in max_bytes of utf8, stopping after num_bytes. Returns
+// the number of code units, and sets *bytes_out and *chars_out.
+static size_t utf16_prefix(const uint16_t *str, size_t num_bytes, size_t max_bytes,
+    size_t *bytes_out, size_t *chars_out) {
+  size_t units = 0, bytes = 0, chars = 0;
+  while (bytes < num_bytes) {
+    size_t cs = utf16_codepoint_size(str[units]);
+    if (bytes + cs > max_bytes) break;
+    bytes += cs;
+    units += cs == 4 ? 2 : 1;
+    chars++;
+  }
+  *bytes_out = bytes;
+  *chars_out = chars;
+  return units;
+}
+
+// Transcode (already checked) utf16 into utf8 at dest until num_bytes have been written. Returns
+// the number of code units read. If num_chars_out isn't NULL, its set to the number of characters.
+static size_t utf16_to_utf8(const uint16_t *str, size_t num_bytes, uint8_t *dest,
+    size_t *num_chars_out) {
+  const uint16_t *p = str;
+  uint8_t *d = dest, *end = &dest[num_bytes];
+  size_t chars = 0;
+  while (d < end) {
+    uint32_t c = *p++;
+    if (c < 0x80) {
+      *d++ = (uint8_t)c;
+    } else if (c < 0x800) {
+      *d++ = (uint8_t)(0xc0 | (c >> 6));
+      *d++ = (uint8_t)(0x80 | (c & 0x3f));
+    } else if (IS_HIGH_SURROGATE(c)) {
+      c = 0x10000 + ((c - 0xd800) << 10) + (*p++ - 0xdc00);
+      *d++ = (uint8_t)(0xf0 | (c >> 18));
+      *d++ = (uint8_t)(0x80 | ((c >> 12) & 0x3f));
+      *d++ = (uint8_t)(0x80 | ((c >> 6) & 0x3f));
+      *d++ = (uint8_t)(0x80 | (c & 0x3f));
+    } else {
+      *d++ = (uint8_t)(0xe0 | (c >> 12));
+      *d++ = (uint8_t)(0x80 | ((c >> 6) & 0x3f));
+      *d++ = (uint8_t)(0x80 | (c & 0x3f));
+    }
+    chars++;
+  }
+  assert(d == end);
+  if (num_chars_out) *num_chars_out = chars;
+  return p - str;
+}
 #endif
 
 // Count the number of characters in a string.
@@ -272,11 +1122,38 @@ static ssize_t bytelen_and_check_utf8(const uint8_t *str) {
   return p - str;
 }
 
-typedef struct {
-  // This stores the previous node at each height, and the number of characters from the start of
-  // the previous node to the current iterator position.
-  rope_skip_node s[ROPE_MAX_HEIGHT];
-} rope_iter;
+// Checks that the len bytes at str are valid utf8 (with no embedded NULs).
+// Returns the number of characters in the string if it is ok, otherwise
+// returns SIZE_MAX.
+static size_t count_and_check_utf8(const uint8_t *str, size_t len) {
+  const uint8_t *p = str, *end = str + len;
+  size_t num_chars = 0;
+  while (p < end) {
+    size_t size = codepoint_size(*p);
+    if (size == SIZE_MAX || size > (size_t)(end - p)) return SIZE_MAX;
+    p++; size--;
+    while (size > 0) {
+      if ((*p & 0xc0) != 0x80)
+        return SIZE_MAX;
+      p++; size--;
+    }
+    num_chars++;
+  }
+  return num_chars;
+}
+
+typedef struct {
+  // This stores the previous node at each height, and the number of characters from the start of
+  // the previous node to the current iterator position.
+  rope_skip_node s[ROPE_MAX_HEIGHT];
+} rope_iter;
+
+// Start loading node n's link at height, which a search is about to compare against. Searches
+// call this for both the node to their right and the one to the right of the level below, so
+// whichever way they go the next link is on its way.
+static inline void prefetch_link(const rope_node *n, int height) {
+  if (n) PREFETCH(&n->nexts[height]);
+}
 
 // Internal function for navigating to a particular character offset in the rope.
 // The function returns the list of nodes which point past the position, as well as
@@ -289,18 +1166,26 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter) {
 
   // Offset stores how many characters we still need to skip in the current node.
   size_t offset = char_pos;
-  size_t skip;
+  size_t skip, steps = 0;
 #if ROPE_WCHAR
   size_t wchar_pos = 0; // Current wchar pos from the start of the rope.
 #endif
 
   while (true) {
+    prefetch_link(e->nexts[height].node, height);
+    if (height) {
+      prefetch_link(e->nexts[height - 1].node, height - 1);
+    } else {
+      // The position is in this node or one of the next few, whose text the caller reads next.
+      PREFETCH(e->str);
+    }
     skip = e->nexts[height].skip_size;
     if (offset > skip) {
       // Go right.
       assert(e == &r->head || e->num_bytes);
 
       offset -= skip;
+      steps++;
 #if ROPE_WCHAR
       wchar_pos += e->nexts[height].wchar_size;
 #endif
@@ -321,9 +1206,13 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter) {
     }
   }
 
+  // At a node boundary the position is at the end of e, whose text isn't needed, so it stays
+  // compressed. Inserts which append to it thaw it themselves.
+  bool at_end = offset == e->nexts[0].skip_size;
+  if (!at_end) thaw(r, e);
 #if ROPE_WCHAR
   // For some reason, this is _REALLY SLOW_. Like, 5.5Mops/s -> 4Mops/s from this block of code.
-  wchar_pos += count_wchars_in_utf8(e->str, offset);
+  wchar_pos += at_end ? e->nexts[0].wchar_size : count_wchars_in_utf8(e->str, offset);
 
   // The iterator has the wchar pos from the start of the whole string.
   for (int i = 0; i < r->head.height; i++) {
@@ -331,7 +1220,9 @@ static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter) {
   }
 #endif
 
-  assert(offset <= ROPE_NODE_STR_SIZE);
+  TRACE(r, descents, 1);
+  TRACE(r, descent_steps, steps);
+  assert(offset <= e->num_bytes);
   assert(iter->s[0].node == e);
   return e;
 }
@@ -346,14 +1237,21 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
 
   // Offset stores how many wchar characters we still need to skip in the current node.
   size_t offset = wchar_pos;
-  size_t skip;
+  size_t skip, steps = 0;
   size_t char_pos = 0; // Current char pos from the start of the rope.
 
   while (true) {
+    prefetch_link(e->nexts[height].node, height);
+    if (height) {
+      prefetch_link(e->nexts[height - 1].node, height - 1);
+    } else {
+      PREFETCH(e->str);
+    }
     skip = e->nexts[height].wchar_size;
     if (offset > skip) {
       // Go right.
       offset -= skip;
+      steps++;
       char_pos += e->nexts[height].skip_size;
       e = e->nexts[height].node;
     } else {
@@ -370,7 +1268,15 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
     }
   }
 
-  char_pos += count_utf8_in_wchars(e->str, offset);
+  if (offset == e->nexts[0].wchar_size) {
+    // At a node boundary, leave e compressed like iter_at_char_pos does.
+    char_pos += e->nexts[0].skip_size;
+  } else {
+    thaw(r, e);
+    char_pos += count_utf8_in_wchars(e->str, offset);
+  }
+  TRACE(r, descents, 1);
+  TRACE(r, descent_steps, steps);
 
   // The iterator has character positions from the start of the rope to the start of the node.
   for (int i = 0; i < r->head.height; i++) {
@@ -381,44 +1287,238 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
 }
 #endif
 
+// Read the character at *str, as its utf8 bytes packed into an integer, and advance *str past it.
+// Packed characters compare equal exactly when the characters do.
+static inline uint32_t read_char(const uint8_t **str) {
+  const uint8_t *p = *str;
+  size_t size = codepoint_size(*p);
+  uint32_t c = *p++;
+  while (--size) {
+    c = (c << 8) | *p++;
+  }
+  *str = p;
+  return c;
+}
+
+#if ROPE_HASH
+// Content hashes are polynomials in HASH_BASE with one coefficient per character, mod 2^61 - 1.
+// The hash of A followed by B is hash(A) * HASH_BASE^chars(B) + hash(B), so each skip list link
+// stores its HASH_BASE^skip_size along with its hash.
+#define HASH_MOD (((uint64_t)1 << 61) - 1)
+#define HASH_BASE ((uint64_t)0x1d8e4e27c47d124f % HASH_MOD)
+
+// a * b mod 2^61 - 1, for a and b below 2^61. The top bits of the product wrap around to the
+// bottom, because 2^61 = 1.
+#ifdef __SIZEOF_INT128__
+static inline uint64_t hash_mul(uint64_t a, uint64_t b) {
+  unsigned __int128 x = (unsigned __int128)a * b;
+  uint64_t result = (uint64_t)(x & HASH_MOD) + (uint64_t)(x >> 61);
+  return result >= HASH_MOD ? result - HASH_MOD : result;
+}
+#else
+// Without 128 bit integers (MSVC, 32 bit targets) the product is put together from 32 bit halves.
+static inline uint64_t hash_mul(uint64_t a, uint64_t b) {
+  uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+  uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+  uint64_t mid = a_hi * b_lo + a_lo * b_hi; // Below 2^62.
+  uint64_t lo = a_lo * b_lo + (mid << 32);
+  uint64_t hi = a_hi * b_hi + (mid >> 32) + (lo < (mid << 32));
+  uint64_t result = (lo & HASH_MOD) + ((hi << 3) | (lo >> 61));
+  return result >= HASH_MOD ? result - HASH_MOD : result;
+}
+#endif
+
+static inline uint64_t hash_add(uint64_t a, uint64_t b) {
+  uint64_t result = a + b;
+  return result >= HASH_MOD ? result - HASH_MOD : result;
+}
+
+static uint64_t hash_pow(size_t n) {
+  uint64_t result = 1, base = HASH_BASE;
+  for (; n; n >>= 1) {
+    if (n & 1) result = hash_mul(result, base);
+    base = hash_mul(base, base);
+  }
+  return result;
+}
+
+// Hash the first num_chars characters of str, and set *pow_out to HASH_BASE ^ num_chars. Each
+// character's coefficient is read_char of it.
+static uint64_t hash_utf8(const uint8_t *str, size_t num_chars, uint64_t *pow_out) {
+  // Characters are added four at a time to shorten the chain of dependent multiplies.
+  uint64_t base2 = hash_mul(HASH_BASE, HASH_BASE);
+  uint64_t base3 = hash_mul(base2, HASH_BASE);
+  uint64_t base4 = hash_mul(base3, HASH_BASE);
+  uint64_t hash = 0;
+  size_t i = 0;
+  for (; i + 4 <= num_chars; i += 4) {
+    uint64_t c0 = read_char(&str), c1 = read_char(&str);
+    uint64_t c2 = read_char(&str), c3 = read_char(&str);
+    uint64_t high = hash_add(hash_mul(hash, base4), hash_mul(c0, base3));
+    uint64_t low = hash_add(hash_mul(c1, base2), hash_add(hash_mul(c2, HASH_BASE), c3));
+    hash = hash_add(high, low);
+  }
+  for (; i < num_chars; i++) {
+    hash = hash_add(hash_mul(hash, HASH_BASE), read_char(&str));
+  }
+  *pow_out = hash_pow(num_chars);
+  return hash;
+}
+
+// Note that n's contents have changed, so update_hashes needs to rehash it. HASH_BASE ^ k is never
+// 0, so a hash_pow of 0 marks the node as stale.
+static inline void mark_changed(rope_node *n) {
+  n->nexts[0].hash_pow = 0;
+}
+
+// Characters were added to the end of n, starting at str. Its hash can be extended with them
+// rather than rehashing the whole node, unless its already stale.
+static inline void hash_appended(rope_node *n, const uint8_t *str, size_t num_chars) {
+  rope_skip_node *link = &n->nexts[0];
+  if (link->hash_pow == 0) return;
+  uint64_t pow;
+  uint64_t hash = hash_utf8(str, num_chars, &pow);
+  link->hash = hash_add(hash_mul(link->hash, pow), hash);
+  link->hash_pow = hash_mul(link->hash_pow, pow);
+}
+
+// Recompute a link's hash from the links one level down.
+static void rehash_link(rope_node *n, int height) {
+  rope_skip_node *link = &n->nexts[height];
+  uint64_t hash = 0, pow = 1;
+  for (rope_node *e = n; e != link->node; e = e->nexts[height - 1].node) {
+    rope_skip_node *sub = &e->nexts[height - 1];
+    hash = hash_add(hash_mul(hash, sub->hash_pow), sub->hash);
+    pow = hash_mul(pow, sub->hash_pow);
+  }
+  link->hash = hash;
+  link->hash_pow = pow;
+}
+
+// Where an edit is about to happen: the node preceding the edit position at each level of the
+// skip list and the position that node starts at. None of these nodes are removed by the edit.
+typedef struct {
+  size_t pos;
+  uint8_t height;
+  rope_node *nodes[ROPE_MAX_HEIGHT];
+  size_t starts[ROPE_MAX_HEIGHT];
+} hash_path;
+
+static void save_hash_path(rope *r, rope_iter *iter, size_t pos, hash_path *path) {
+  path->pos = pos;
+  path->height = r->head.height;
+  for (int i = 0; i < r->head.height; i++) {
+    path->nodes[i] = iter->s[i].node;
+    path->starts[i] = pos - iter->s[i].skip_size;
+  }
+}
+
+// Bring the hashes up to date after an edit which left num_chars characters at the saved
+// position. Every link touching [pos, pos + num_chars] is rehashed from the bottom up, along with
+// the contents of nodes marked as changed.
+static void update_hashes(rope *r, hash_path *path, size_t num_chars) {
+  size_t end = path->pos + num_chars;
+  for (int i = 0; i < r->head.height; i++) {
+    // Levels added by the edit start at the head.
+    rope_node *n = i < path->height ? path->nodes[i] : &r->head;
+    size_t start = i < path->height ? path->starts[i] : 0;
+    while (n != NULL && start <= end) {
+      if (i == 0) {
+        if (n->nexts[0].hash_pow == 0) {
+          // Only nodes whose text was edited are marked, and editing it thawed them.
+          assert(!is_compressed(n));
+          n->nexts[0].hash = hash_utf8(n->str, n->nexts[0].skip_size, &n->nexts[0].hash_pow);
+        }
+      } else {
+        rehash_link(n, i);
+      }
+      start += n->nexts[i].skip_size;
+      n = n->nexts[i].node;
+    }
+  }
+}
+
+uint64_t rope_hash(const rope *r) {
+  assert(r);
+  return r->head.nexts[r->head.height - 1].hash;
+}
+
+// The hash of the first pos characters in the rope.
+static uint64_t prefix_hash(rope *r, size_t pos) {
+  rope_node *e = &r->head;
+  int height = r->head.height - 1;
+  uint64_t hash = 0;
+  while (true) {
+    rope_skip_node *link = &e->nexts[height];
+    if (pos > link->skip_size) {
+      hash = hash_add(hash_mul(hash, link->hash_pow), link->hash);
+      pos -= link->skip_size;
+      e = link->node;
+    } else if (height == 0) {
+      break;
+    } else {
+      height--;
+    }
+  }
+
+  if (pos && pos == e->nexts[0].skip_size) {
+    // Use the hash of the whole node rather than decompressing it.
+    return hash_add(hash_mul(hash, e->nexts[0].hash_pow), e->nexts[0].hash);
+  }
+  if (pos) thaw(r, e);
+  uint64_t pow;
+  uint64_t node_hash = hash_utf8(e->str, pos, &pow);
+  return hash_add(hash_mul(hash, pow), node_hash);
+}
+
+uint64_t rope_range_hash(rope *r, size_t pos, size_t num) {
+  assert(r);
+  pos = MIN(pos, r->num_chars);
+  num = MIN(num, r->num_chars - pos);
+  uint64_t before = hash_mul(prefix_hash(r, pos), hash_pow(num));
+  return hash_add(prefix_hash(r, pos + num), HASH_MOD - before);
+}
+#else
+typedef struct { char unused; } hash_path;
+static inline void mark_changed(rope_node *n) {}
+static inline void hash_appended(rope_node *n, const uint8_t *str, size_t num_chars) {}
+static inline void save_hash_path(rope *r, rope_iter *iter, size_t pos, hash_path *path) {}
+static inline void update_hashes(rope *r, hash_path *path, size_t num_chars) {}
+#endif
+
 #if ROPE_WCHAR
 static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars, size_t num_wchars) {
   for (int i = 0; i < r->head.height; i++) {
-    iter->s[i].node->nexts[i].skip_size += num_chars;
-    iter->s[i].node->nexts[i].wchar_size += num_wchars;
+    rope_skip_node *link = &iter->s[i].node->nexts[i];
+    STORE_RELAXED(link->skip_size, link->skip_size + num_chars);
+    link->wchar_size += num_wchars;
   }
 }
 #else
 static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars) {
   for (int i = 0; i < r->head.height; i++) {
-    iter->s[i].node->nexts[i].skip_size += num_chars;
+    rope_skip_node *link = &iter->s[i].node->nexts[i];
+    STORE_RELAXED(link->skip_size, link->skip_size + num_chars);
   }
 }
 #endif
 
 
-// Internal method of rope_insert.
-// This function creates a new node in the rope at the specified position and fills it with the
-// passed string.
-static void insert_at(rope *r, rope_iter *iter,
-    const uint8_t *str, size_t num_bytes, size_t num_chars) {
-#if ROPE_WCHAR
-  size_t num_wchars = count_wchars_in_utf8(str, num_chars);
-#endif
-
+// Link new_node, which holds num_chars characters (and num_wchars wchars, with ROPE_WCHAR) into the
+// rope at the iterator's position, and move the iterator to the end of it.
+static void link_node(rope *r, rope_iter *iter, rope_node *new_node, size_t num_chars,
+    size_t num_wchars) {
   // This describes how many levels of the iter are filled in.
   uint8_t max_height = r->head.height;
-  uint8_t new_height = random_height();
-  rope_node *new_node = alloc_node(r, new_height);
-  new_node->num_bytes = num_bytes;
-  memcpy(new_node->str, str, num_bytes);
+  uint8_t new_height = new_node->height;
+  mark_changed(new_node);
 
   assert(new_height < ROPE_MAX_HEIGHT);
 
   // Max height (the rope's head's height) must be 1+ the height of the largest node.
   while (max_height <= new_height) {
-    r->head.height++;
     r->head.nexts[max_height] = r->head.nexts[max_height - 1];
+    PUBLISH(r->head.height, r->head.height + 1);
 
     // This is the position (offset from the start) of the rope.
     iter->s[max_height] = iter->s[max_height - 1];
@@ -431,10 +1531,12 @@ static void insert_at(rope *r, rope_iter *iter,
     rope_skip_node *prev_skip = &iter->s[i].node->nexts[i];
     new_node->nexts[i].node = prev_skip->node;
     new_node->nexts[i].skip_size = num_chars + prev_skip->skip_size - iter->s[i].skip_size;
+    set_prev(new_node, i, iter->s[i].node);
+    set_prev(prev_skip->node, i, new_node);
 
 
-    prev_skip->node = new_node;
-    prev_skip->skip_size = iter->s[i].skip_size;
+    PUBLISH(prev_skip->node, new_node);
+    STORE_RELAXED(prev_skip->skip_size, iter->s[i].skip_size);
 
     // & move the iterator to the end of the newly inserted node.
     iter->s[i].node = new_node;
@@ -447,48 +1549,109 @@ static void insert_at(rope *r, rope_iter *iter,
   }
 
   for (; i < max_height; i++) {
-    iter->s[i].node->nexts[i].skip_size += num_chars;
+    rope_skip_node *link = &iter->s[i].node->nexts[i];
+    STORE_RELAXED(link->skip_size, link->skip_size + num_chars);
     iter->s[i].skip_size += num_chars;
 #if ROPE_WCHAR
-    iter->s[i].node->nexts[i].wchar_size += num_wchars;
+    link->wchar_size += num_wchars;
     iter->s[i].wchar_size += num_wchars;
 #endif
   }
 
-  r->num_chars += num_chars;
-  r->num_bytes += num_bytes;
+  STORE_RELAXED(r->num_chars, r->num_chars + num_chars);
+  STORE_RELAXED(r->num_bytes, r->num_bytes + new_node->num_bytes);
 }
 
-// Insert the given utf8 string into the rope at the specified position.
-static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, const uint8_t *str) {
+// Internal method of rope_insert.
+// This function creates a new node in the rope at the specified position and fills it with the
+// passed string. External nodes reference str directly instead of copying it. If u16 is set, the
+// node is filled by transcoding it instead (and str is ignored). Returns the new node.
+static rope_node *insert_at(rope *r, rope_iter *iter, const uint8_t *str, const uint16_t *u16,
+    size_t num_bytes, size_t num_chars, bool external) {
+#if ROPE_WCHAR
+  // The wchar count of utf16 falls out of transcoding it.
+  size_t num_wchars = u16 ? 0 : count_wchars_in_utf8(str, num_chars);
+#endif
+
+  uint8_t new_height = random_height(r);
+  rope_node *new_node;
+  if (external) {
+    new_node = alloc_node(r, new_height, 0);
+    new_node->str = (uint8_t *)str;
+    new_node->flags = ROPE_NODE_EXTERNAL;
+  } else {
+    // Leave the usual amount of room for edits in small nodes. Big ones are allocated to size.
+    new_node = alloc_node(r, new_height, MAX(num_bytes, NODE_STR_SIZE(r)));
+#if ROPE_WCHAR
+    if (u16) {
+      num_wchars = utf16_to_utf8(u16, num_bytes, new_node->str, NULL);
+    } else {
+      memcpy(new_node->str, str, num_bytes);
+    }
+#else
+    memcpy(new_node->str, str, num_bytes);
+#endif
+  }
+  new_node->num_bytes = (uint32_t)num_bytes;
+#if ROPE_WCHAR
+  link_node(r, iter, new_node, num_chars, num_wchars);
+#else
+  link_node(r, iter, new_node, num_chars, 0);
+#endif
+  return new_node;
+}
+
+// Can num bytes be inserted at byte offset pos in the node (growing it if need be)?
+static bool node_has_room(const rope *r, const rope_node *e, size_t pos, size_t num) {
+  if (is_external(e) || is_compressed(e)) return false;
+
+  size_t size = e->num_bytes + num;
+  if (size <= e->capacity) return true;
+
+  // Nodes only grow past NODE_STR_SIZE when they're appended to. Big nodes make edits in their
+  // middle slow, so hot editing regions should stay small.
+  return size <= (pos == e->num_bytes ? NODE_MAX_SIZE(r) : NODE_STR_SIZE(r));
+}
+
+// Insert num_inserted_bytes of (already validated) utf8 into the rope at the iterator's position.
+// If external is set, the new nodes reference str instead of copying it. If u16 is set, it holds
+// (already validated) utf16 which takes up num_inserted_bytes as utf8, and its transcoded straight
+// into the rope's nodes.
+static void insert_bytes_at_iter(rope *r, rope_node *e, rope_iter *iter,
+    const uint8_t *str, const uint16_t *u16, size_t num_inserted_bytes, bool external) {
+  if (num_inserted_bytes == 0) return;
+  // rope_append saves the tail again afterwards.
+  r->tail_valid = 0;
+
   // iter.offset contains how far (in characters) into the current element to skip.
   // Figure out how much that is in bytes.
   size_t offset_bytes = 0;
   // The insertion offset into the destination node.
   size_t offset = iter->s[0].skip_size;
-  if (offset) {
-    assert(offset <= e->nexts[0].skip_size);
+  if (offset == e->nexts[0].skip_size) {
+    // Searches leave the node before a boundary compressed, and the text may be appended to it.
+    if (!external) thaw(r, e);
+    offset_bytes = e->num_bytes;
+  } else if (offset) {
+    assert(offset < e->nexts[0].skip_size);
     offset_bytes = count_bytes_in_utf8(e->str, offset);
   }
 
-  // We might be able to insert the new data into the current node, depending on
-  // how big it is. We'll count the bytes, and also check that its valid utf8.
-  ssize_t num_inserted_bytes = bytelen_and_check_utf8(str);
-  if (num_inserted_bytes == -1) return ROPE_INVALID_UTF8;
-
-  // Can we insert into the current node?
-  bool insert_here = e->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE;
+  // Can we insert into the current node? External data is never copied in, and
+  // external nodes are read-only.
+  bool insert_here = !external && node_has_room(r, e, offset_bytes, num_inserted_bytes);
 
   // Can we insert into the subsequent node?
   rope_node *next = NULL;
-  if (!insert_here && offset_bytes == e->num_bytes) {
+  if (!insert_here && !external && offset_bytes == e->num_bytes) {
     next = e->nexts[0].node;
     // We can insert into the subsequent node if:
     // - We can't insert into the current node
     // - There _is_ a next node to insert into
     // - The insert would be at the start of the next node
     // - There's room in the next node
-    if (next && next->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE) {
+    if (next && node_has_room(r, next, 0, num_inserted_bytes)) {
+      right_anchors_moved(e, offset, next, 0);
       offset = offset_bytes = 0;
       for (int i = 0; i < next->height; i++) {
         iter->s[i].node = next;
@@ -501,24 +1664,48 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
   }
 
   if (insert_here) {
+    if (e->num_bytes + num_inserted_bytes > e->capacity) {
+      grow_node(r, e, e->num_bytes + num_inserted_bytes);
+    }
+
     // First move the current bytes later on in the string.
     if (offset_bytes < e->num_bytes) {
       memmove(&e->str[offset_bytes + num_inserted_bytes],
               &e->str[offset_bytes],
               e->num_bytes - offset_bytes);
+      TRACE(r, bytes_moved, e->num_bytes - offset_bytes);
     }
 
     // Then copy in the string bytes
+    size_t num_inserted_chars;
+#if ROPE_WCHAR
+    size_t num_inserted_wchars;
+    if (u16) {
+      num_inserted_wchars = utf16_to_utf8(u16, num_inserted_bytes, &e->str[offset_bytes],
+          &num_inserted_chars);
+    } else {
+      memcpy(&e->str[offset_bytes], str, num_inserted_bytes);
+      num_inserted_chars = strlen_utf8(str);
+      num_inserted_wchars = count_wchars_in_utf8(str, num_inserted_chars);
+    }
+#else
     memcpy(&e->str[offset_bytes], str, num_inserted_bytes);
-    e->num_bytes += num_inserted_bytes;
+    num_inserted_chars = strlen_utf8(str);
+#endif
+    if (offset_bytes == e->num_bytes) {
+      hash_appended(e, &e->str[offset_bytes], num_inserted_chars);
+    } else {
+      mark_changed(e);
+    }
+    STORE_RELAXED(e->num_bytes, e->num_bytes + num_inserted_bytes);
 
-    r->num_bytes += num_inserted_bytes;
-    size_t num_inserted_chars = strlen_utf8(str);
-    r->num_chars += num_inserted_chars;
+    STORE_RELAXED(r->num_bytes, r->num_bytes + num_inserted_bytes);
+    STORE_RELAXED(r->num_chars, r->num_chars + num_inserted_chars);
+    anchors_inserted(e, offset, num_inserted_chars);
+    TRACE(r, inserts_in_place, 1);
 
     // .... aaaand update all the offset amounts.
 #if ROPE_WCHAR
-    size_t num_inserted_wchars = count_wchars_in_utf8(str, num_inserted_chars);
     update_offset_list(r, iter, num_inserted_chars, num_inserted_wchars);
 #else
     update_offset_list(r, iter, num_inserted_chars);
@@ -526,6 +1713,7 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 
   } else {
     // There isn't room. We'll need to add at least one new node to the rope.
+    TRACE(r, inserts_split, 1);
 
     // If we're not at the end of the current node, we'll need to remove
     // the end of the current node's data and reinsert it later.
@@ -533,7 +1721,8 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
     if (num_end_bytes) {
       // We'll pretend like the character have been deleted from the node, while leaving
       // the bytes themselves there (for later).
-      e->num_bytes = offset_bytes;
+      STORE_RELAXED(e->num_bytes, offset_bytes);
+      mark_changed(e);
       num_end_chars = e->nexts[0].skip_size - offset;
 #if ROPE_WCHAR
       size_t num_end_wchars = count_wchars_in_utf8(&e->str[offset_bytes], num_end_chars);
@@ -542,21 +1731,37 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
       update_offset_list(r, iter, -num_end_chars);
 #endif
 
-      r->num_chars -= num_end_chars;
-      r->num_bytes -= num_end_bytes;
+      STORE_RELAXED(r->num_chars, r->num_chars - num_end_chars);
+      STORE_RELAXED(r->num_bytes, r->num_bytes - num_end_bytes);
     }
 
     // Now we insert new nodes containing the new character data. The data must be broken into
-    // pieces of with a maximum size of ROPE_NODE_STR_SIZE. Node boundaries must not occur in the
-    // middle of a utf8 codepoint.
+    // pieces of with a maximum size of NODE_MAX_SIZE (or ROPE_EXTERNAL_SPAN_SIZE for
+    // external spans). Node boundaries must not occur in the middle of a utf8 codepoint.
+    size_t max_node_bytes = external ? ROPE_EXTERNAL_SPAN_SIZE : NODE_MAX_SIZE(r);
     size_t str_offset = 0;
+    rope_node *last = NULL;
+#if ROPE_WCHAR
+    const uint16_t *u16_pos = u16;
+#endif
     while (str_offset < num_inserted_bytes) {
       size_t new_node_bytes = 0;
       size_t new_node_chars = 0;
 
+#if ROPE_WCHAR
+      if (u16) {
+        size_t units = utf16_prefix(u16_pos, num_inserted_bytes - str_offset, max_node_bytes,
+            &new_node_bytes, &new_node_chars);
+        last = insert_at(r, iter, NULL, u16_pos, new_node_bytes, new_node_chars, false);
+        u16_pos += units;
+        str_offset += new_node_bytes;
+        continue;
+      }
+#endif
+
       while (str_offset + new_node_bytes < num_inserted_bytes) {
         size_t cs = codepoint_size(str[str_offset + new_node_bytes]);
-        if (cs + new_node_bytes > ROPE_NODE_STR_SIZE) {
+        if (cs + new_node_bytes > max_node_bytes) {
           break;
         } else {
           new_node_bytes += cs;
@@ -564,15 +1769,28 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
         }
       }
 
-      insert_at(r, iter, &str[str_offset], new_node_bytes, new_node_chars);
+      last = insert_at(r, iter, &str[str_offset], NULL, new_node_bytes, new_node_chars, external);
       str_offset += new_node_bytes;
     }
 
     if (num_end_bytes) {
-      insert_at(r, iter, &e->str[offset_bytes], num_end_bytes, num_end_chars);
+      // The tail of an external node stays external.
+      rope_node *tail = insert_at(r, iter, &e->str[offset_bytes], NULL, num_end_bytes,
+          num_end_chars, is_external(e));
+      anchors_moved(e, offset, tail);
     }
+    right_anchors_moved(e, offset, last, last->nexts[0].skip_size);
   }
+}
+
+// Insert the given utf8 string into the rope at the specified position.
+static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, const uint8_t *str) {
+  // We might be able to insert the new data into the current node, depending on
+  // how big it is. We'll count the bytes, and also check that its valid utf8.
+  ssize_t num_inserted_bytes = bytelen_and_check_utf8(str);
+  if (num_inserted_bytes == -1) return ROPE_INVALID_UTF8;
 
+  insert_bytes_at_iter(r, e, iter, str, NULL, num_inserted_bytes, false);
   return ROPE_OK;
 }
 
@@ -584,11 +1802,17 @@ ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str) {
 #endif
   pos = MIN(pos, r->num_chars);
 
+  begin_write(r);
   rope_iter iter;
   // First we need to search for the node where we'll insert the string.
   rope_node *e = iter_at_char_pos(r, pos, &iter);
 
+  hash_path path;
+  save_hash_path(r, &iter, pos, &path);
+  size_t num_chars = r->num_chars;
   ROPE_RESULT result = rope_insert_at_iter(r, e, &iter, str);
+  update_hashes(r, &path, r->num_chars - num_chars);
+  end_write(r);
 
 #ifdef DEBUG
   _rope_check(r);
@@ -597,152 +1821,2214 @@ ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str) {
   return result;
 }
 
+// Fill in iter for the end of the rope, using the saved tail if its still valid. Returns the last
+// node.
+static rope_node *iter_at_end(rope *r, rope_iter *iter) {
+  if (!r->tail_valid) return iter_at_char_pos(r, r->num_chars, iter);
+
+  // Each of the last nodes links to the end of the rope.
+  for (int i = 0; i < r->head.height; i++) {
+    rope_node *n = r->tail[i];
+    iter->s[i].node = n;
+    iter->s[i].skip_size = n->nexts[i].skip_size;
 #if ROPE_WCHAR
-// Insert the given utf8 string into the rope at the specified position.
-size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *str) {
+    iter->s[i].wchar_size = n->nexts[i].wchar_size;
+#endif
+  }
+  return r->tail[0];
+}
+
+// Remember the nodes iter points at, which are the last nodes in the rope.
+static void save_tail(rope *r, const rope_iter *iter) {
+  if (r->tail == NULL) {
+    r->tail = (rope_node **)r->alloc(ROPE_MAX_HEIGHT * sizeof(rope_node *));
+  }
+  for (int i = 0; i < r->head.height; i++) {
+    r->tail[i] = iter->s[i].node;
+  }
+  r->tail_valid = 1;
+}
+
+ROPE_RESULT rope_append(rope *r, const uint8_t *str) {
   assert(r);
   assert(str);
 #ifdef DEBUG
   _rope_check(r);
 #endif
-  wchar_pos = MIN(wchar_pos, rope_wchar_count(r));
+  ssize_t num_bytes = bytelen_and_check_utf8(str);
+  if (num_bytes == -1) return ROPE_INVALID_UTF8;
 
+  begin_write(r);
   rope_iter iter;
-  // First we need to search for the node where we'll insert the string.
-  rope_node *e = iter_at_wchar_pos(r, wchar_pos, &iter);
-  size_t pos = iter.s[r->head.height - 1].skip_size;
-  rope_insert_at_iter(r, e, &iter, str);
+  rope_node *e = iter_at_end(r, &iter);
+  hash_path path;
+  save_hash_path(r, &iter, r->num_chars, &path);
+  size_t num_chars = r->num_chars;
+  // Inserting at the end leaves iter at the new end of the rope.
+  insert_bytes_at_iter(r, e, &iter, str, NULL, num_bytes, false);
+  update_hashes(r, &path, r->num_chars - num_chars);
+  save_tail(r, &iter);
+  end_write(r);
 
 #ifdef DEBUG
   _rope_check(r);
 #endif
-  return pos;
+  return ROPE_OK;
 }
 
-#endif
+#if ROPE_FILE_IO
+// The most nodes rope_read_fd reads into with each readv call. It starts with one, and doubles the
+// batch each time a read fills all of them.
+#define READ_BATCH 64
+// The most bytes a character can still need when a node ends partway through it.
+#define MAX_MISSING_BYTES 5
 
-// Delete num characters at position pos. Deleting past the end of the string
-// has no effect.
-static void rope_del_at_iter(rope *r, rope_node *e, rope_iter *iter, size_t length) {
-  r->num_chars -= length;
-  size_t offset = iter->s[0].skip_size;
-  while (length) {
-    if (offset == e->nexts[0].skip_size) {
-      // End of the current node. Skip to the start of the next one.
-      e = iter->s[0].node->nexts[0].node;
-      offset = 0;
+// Nodes being read into. Each is only filled up to fill_size, which leaves room for the rest of a
+// character split between it and the next node.
+typedef struct {
+  rope *r;
+  size_t fill_size;
+  // The nodes which have been read into, in order, followed by empty ones ready for the next read.
+  // Only the last of the num_filled nodes can be partly filled.
+  rope_node *nodes[READ_BATCH];
+  size_t num_filled;
+  // How many nodes the next read can use.
+  size_t batch;
+} fd_reader;
+
+// If str ends partway through a character, how many more bytes the character needs.
+static size_t missing_char_bytes(const uint8_t *str, size_t len) {
+  for (size_t i = 1; i <= MIN(len, MAX_MISSING_BYTES); i++) {
+    uint8_t b = str[len - i];
+    if ((b & 0xc0) != 0x80) {
+      size_t size = codepoint_size(b);
+      // Invalid bytes are caught when the node is checked.
+      return size != SIZE_MAX && size > i ? size - i : 0;
     }
+  }
+  return 0;
+}
 
-    size_t num_chars = e->nexts[0].skip_size;
-    size_t removed = MIN(length, num_chars - offset);
-#if ROPE_WCHAR
-    size_t removed_wchars;
-#endif
+// Move the end of a character split between n and next into n, so n can be linked into the rope.
+// Returns false if next doesn't have all of it yet.
+static bool take_split_char(rope_node *n, rope_node *next) {
+  size_t missing = missing_char_bytes(n->str, n->num_bytes);
+  if (missing > next->num_bytes) return false;
+  memcpy(&n->str[n->num_bytes], next->str, missing);
+  memmove(next->str, &next->str[missing], next->num_bytes - missing);
+  n->num_bytes += missing;
+  next->num_bytes -= missing;
+  return true;
+}
 
-    int i;
-    if (removed < num_chars || e == &r->head) {
-      // Just trim this node down to size.
-      size_t leading_bytes = count_bytes_in_utf8(e->str, offset);
-      size_t removed_bytes = count_bytes_in_utf8(&e->str[leading_bytes], removed);
-      size_t trailing_bytes = e->num_bytes - leading_bytes - removed_bytes;
-#if ROPE_WCHAR
-      removed_wchars = count_wchars_in_utf8(&e->str[leading_bytes], removed);
-#endif
-      if (trailing_bytes) {
-        memmove(&e->str[leading_bytes], &e->str[leading_bytes + removed_bytes], trailing_bytes);
-      }
-      e->num_bytes -= removed_bytes;
-      r->num_bytes -= removed_bytes;
+// Nodes are read into at NODE_MAX_SIZE. Copy a short one into a node sized the way insert_at would
+// allocate it, so it doesn't keep the rest of that room once it's linked.
+static rope_node *shrink_read_node(rope *r, rope_node *n) {
+  size_t capacity = MAX(n->num_bytes, NODE_STR_SIZE(r));
+  if (capacity >= n->capacity) return n;
+  rope_node *copy = alloc_node(r, n->height, capacity);
+  memcpy(copy->str, n->str, n->num_bytes);
+  copy->num_bytes = n->num_bytes;
+  free_node(r, n);
+  return copy;
+}
 
-      for (i = 0; i < e->height; i++) {
-        e->nexts[i].skip_size -= removed;
-#if ROPE_WCHAR
-        e->nexts[i].wchar_size -= removed_wchars;
-#endif
-      }
-    } else {
-      // Remove the node from the list
-#if ROPE_WCHAR
-      removed_wchars = e->nexts[0].wchar_size;
-#endif
-      for (i = 0; i < e->height; i++) {
-        iter->s[i].node->nexts[i].node = e->nexts[i].node;
-        iter->s[i].node->nexts[i].skip_size += e->nexts[i].skip_size - removed;
-#if ROPE_WCHAR
-        iter->s[i].node->nexts[i].wchar_size += e->nexts[i].wchar_size - removed_wchars;
-#endif
-      }
+// Check the first num filled nodes and link them onto the end of the rope. Returns false if one
+// isn't valid utf8, in which case it and the nodes after it aren't linked.
+static bool link_read_nodes(fd_reader *f, size_t num) {
+  if (num == 0) return true;
+  rope *r = f->r;
+  bool ok = true;
 
-      r->num_bytes -= e->num_bytes;
-      // TODO: Recycle e.
-      rope_node *next = e->nexts[0].node;
-      r->free(e);
-      e = next;
+  begin_write(r);
+  rope_iter iter;
+  rope_node *end = iter_at_end(r, &iter);
+  size_t end_offset = iter.s[0].skip_size;
+  hash_path path;
+  save_hash_path(r, &iter, r->num_chars, &path);
+  size_t num_chars = r->num_chars;
+
+  size_t linked = 0;
+  for (; linked < num; linked++) {
+    rope_node *n = f->nodes[linked];
+    size_t chars = count_and_check_utf8(n->str, n->num_bytes);
+    if (chars == SIZE_MAX) {
+      ok = false;
+      break;
     }
-
-    for (; i < r->head.height; i++) {
-      iter->s[i].node->nexts[i].skip_size -= removed;
 #if ROPE_WCHAR
-      iter->s[i].node->nexts[i].wchar_size -= removed_wchars;
+    link_node(r, &iter, n, chars, count_wchars_in_utf8(n->str, chars));
+#else
+    link_node(r, &iter, n, chars, 0);
 #endif
-    }
-
-    length -= removed;
   }
+
+  if (linked) right_anchors_moved(end, end_offset, iter.s[0].node, iter.s[0].skip_size);
+  update_hashes(r, &path, r->num_chars - num_chars);
+  save_tail(r, &iter);
+  end_write(r);
+
+  // The linked nodes belong to the rope now.
+  memmove(f->nodes, &f->nodes[linked], (READ_BATCH - linked) * sizeof(rope_node *));
+  memset(&f->nodes[READ_BATCH - linked], 0, linked * sizeof(rope_node *));
+  f->num_filled -= linked;
+  return ok;
 }
 
-void rope_del(rope *r, size_t pos, size_t length) {
+ROPE_RESULT rope_read_fd(rope *r, int fd) {
+  assert(r);
 #ifdef DEBUG
   _rope_check(r);
 #endif
+  if (NODE_MAX_SIZE(r) < 2 * MAX_MISSING_BYTES) {
+    errno = EINVAL;
+    return ROPE_IO_ERROR;
+  }
 
-  assert(r);
-  pos = MIN(pos, r->num_chars);
-  length = MIN(length, r->num_chars - pos);
+  fd_reader f;
+  f.r = r;
+  f.fill_size = NODE_MAX_SIZE(r) - MAX_MISSING_BYTES;
+  memset(f.nodes, 0, sizeof(f.nodes));
+  f.num_filled = 0;
+  f.batch = 1;
 
-  rope_iter iter;
+  size_t start_chars = r->num_chars;
+  ROPE_RESULT result = ROPE_OK;
+  struct iovec iov[READ_BATCH];
+  while (true) {
+    // Read into the rest of the last filled node, then the empty ones after it.
+    size_t first = f.num_filled;
+    if (first && f.nodes[first - 1]->num_bytes < f.fill_size) first--;
+    size_t room = 0;
+    for (size_t i = first; i < f.batch; i++) {
+      if (f.nodes[i] == NULL) {
+        f.nodes[i] = alloc_node(r, random_height(r), NODE_MAX_SIZE(r));
+        f.nodes[i]->num_bytes = 0;
+      }
+      iov[i - first].iov_base = &f.nodes[i]->str[f.nodes[i]->num_bytes];
+      iov[i - first].iov_len = f.fill_size - f.nodes[i]->num_bytes;
+      room += iov[i - first].iov_len;
+    }
 
-  // Search for the node where we'll insert the string.
-  rope_node *e = iter_at_char_pos(r, pos, &iter);
+    ssize_t bytes = readv(fd, iov, (int)(f.batch - first));
+    if (bytes < 0 && errno == EINTR) continue;
+    if (bytes < 0) {
+      result = ROPE_IO_ERROR;
+      break;
+    }
+    bool eof = bytes == 0;
+    // Small files only ever allocate a node or two.
+    if ((size_t)bytes == room) f.batch = MIN(f.batch * 2, READ_BATCH);
+    for (size_t i = first; bytes > 0; i++) {
+      size_t num = MIN((size_t)bytes, f.fill_size - f.nodes[i]->num_bytes);
+      f.nodes[i]->num_bytes += num;
+      bytes -= num;
+      f.num_filled = i + 1;
+    }
 
-  rope_del_at_iter(r, e, &iter, length);
+    // Every filled node but the last is full, and can be linked once it has the whole of its last
+    // character. At the end of the file, the last one can be linked too.
+    size_t ready = 0;
+    while (ready + 1 < f.num_filled && take_split_char(f.nodes[ready], f.nodes[ready + 1])) {
+      ready++;
+    }
+    if (eof && ready + 1 == f.num_filled && f.nodes[ready]->num_bytes) {
+      f.nodes[ready] = shrink_read_node(r, f.nodes[ready]);
+      ready++;
+    }
+    if (!link_read_nodes(&f, ready)) {
+      result = ROPE_INVALID_UTF8;
+      break;
+    }
+    if (eof) {
+      // Anything left over is a character the file cut off.
+      if (f.num_filled && f.nodes[0]->num_bytes) result = ROPE_INVALID_UTF8;
+      break;
+    }
+  }
+
+  int err = errno;
+  for (size_t i = 0; i < READ_BATCH; i++) {
+    if (f.nodes[i]) free_node(r, f.nodes[i]);
+  }
+  if (result != ROPE_OK) {
+    // Take out what was read. readv's errno is kept for the caller.
+    rope_del(r, start_chars, r->num_chars - start_chars);
+    errno = err;
+  }
 
 #ifdef DEBUG
   _rope_check(r);
 #endif
+  return result;
 }
 
-#if ROPE_WCHAR
-size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *char_len_out) {
-#ifdef DEBUG
-  _rope_check(r);
-#endif
+rope *rope_load_file(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  rope *r = rope_new();
+  ROPE_RESULT result = rope_read_fd(r, fd);
+  int err = result == ROPE_IO_ERROR ? errno : EILSEQ;
+  close(fd);
+  if (result != ROPE_OK) {
+    rope_free(r);
+    errno = err;
+    return NULL;
+  }
+  return r;
+}
 
+size_t rope_to_iovec(rope *r, size_t pos, size_t num, struct iovec *iov, size_t max,
+    size_t *chars_out) {
   assert(r);
-  size_t wchar_total = rope_wchar_count(r);
-  wchar_pos = MIN(wchar_pos, wchar_total);
+  assert(iov || max == 0);
+  pos = MIN(pos, r->num_chars);
+  num = MIN(num, r->num_chars - pos);
+  rope_iter iter;
+  rope_node *n = iter_at_char_pos(r, pos, &iter);
+  size_t offset = iter.s[0].skip_size; // Characters to skip in n.
+  size_t filled = 0, left = num;
+  while (left && filled < max) {
+    size_t skip = n->nexts[0].skip_size;
+    if (offset == skip) {
+      n = n->nexts[0].node;
+      offset = 0;
+      continue;
+    }
+
+    thaw(r, n);
+    size_t start = count_bytes_in_utf8(n->str, offset);
+    size_t chars = MIN(left, skip - offset);
+    size_t bytes = chars == skip - offset
+        ? n->num_bytes - start
+        : count_bytes_in_utf8(&n->str[start], chars);
+    iov[filled].iov_base = &n->str[start];
+    iov[filled].iov_len = bytes;
+    filled++;
+    left -= chars;
+    n = n->nexts[0].node;
+    offset = 0;
+  }
+  if (chars_out) *chars_out = num - left;
+  return filled;
+}
+
+// How many nodes rope_write_fd hands to each writev call. Linux takes up to 1024.
+#define WRITE_BATCH 1024
+
+ROPE_RESULT rope_write_fd(rope *r, int fd) {
+  assert(r);
+  struct iovec iov[WRITE_BATCH];
+  int max = WRITE_BATCH;
+#ifdef IOV_MAX
+  if (max > IOV_MAX) max = IOV_MAX;
+#endif
+  size_t pos = 0;
+  while (pos < r->num_chars) {
+    size_t chars;
+    size_t num = rope_to_iovec(r, pos, r->num_chars - pos, iov, max, &chars);
+    pos += chars;
+
+    // writev can stop partway through, so pick up from wherever it got to.
+    struct iovec *next = iov;
+    while (num) {
+      ssize_t bytes = writev(fd, next, (int)num);
+      if (bytes < 0 && errno == EINTR) continue;
+      if (bytes < 0) return ROPE_IO_ERROR;
+      while (num && (size_t)bytes >= next->iov_len) {
+        bytes -= next->iov_len;
+        next++;
+        num--;
+      }
+      if (num) {
+        next->iov_base = (uint8_t *)next->iov_base + bytes;
+        next->iov_len -= bytes;
+      }
+    }
+  }
+  return ROPE_OK;
+}
+#endif
+
+ROPE_RESULT rope_insert_external(rope *r, size_t pos, const uint8_t *str, size_t len) {
+  assert(r);
+  assert(str || len == 0);
+  if (count_and_check_utf8(str, len) == SIZE_MAX) return ROPE_INVALID_UTF8;
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  pos = MIN(pos, r->num_chars);
+
+  begin_write(r);
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(r, pos, &iter);
+  hash_path path;
+  save_hash_path(r, &iter, pos, &path);
+  size_t num_chars = r->num_chars;
+  insert_bytes_at_iter(r, e, &iter, str, NULL, len, true);
+  update_hashes(r, &path, r->num_chars - num_chars);
+  end_write(r);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  return ROPE_OK;
+}
+
+#if ROPE_WCHAR
+// Insert the given utf8 string into the rope at the specified position.
+size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *str) {
+  assert(r);
+  assert(str);
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  wchar_pos = MIN(wchar_pos, rope_wchar_count(r));
+
+  begin_write(r);
+  rope_iter iter;
+  // First we need to search for the node where we'll insert the string.
+  rope_node *e = iter_at_wchar_pos(r, wchar_pos, &iter);
+  size_t pos = iter.s[r->head.height - 1].skip_size;
+  hash_path path;
+  save_hash_path(r, &iter, pos, &path);
+  size_t num_chars = r->num_chars;
+  rope_insert_at_iter(r, e, &iter, str);
+  update_hashes(r, &path, r->num_chars - num_chars);
+  end_write(r);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  return pos;
+}
+
+ROPE_RESULT rope_insert_utf16(rope *r, size_t wchar_pos, const uint16_t *str, size_t len) {
+  assert(r);
+  assert(str || len == 0);
+  size_t num_bytes = utf8_size_of_utf16(str, len);
+  if (num_bytes == SIZE_MAX) return ROPE_INVALID_UTF8;
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  wchar_pos = MIN(wchar_pos, rope_wchar_count(r));
+
+  begin_write(r);
+  rope_iter iter;
+  rope_node *e = iter_at_wchar_pos(r, wchar_pos, &iter);
+  size_t pos = iter.s[r->head.height - 1].skip_size;
+  hash_path path;
+  save_hash_path(r, &iter, pos, &path);
+  size_t num_chars = r->num_chars;
+  insert_bytes_at_iter(r, e, &iter, NULL, str, num_bytes, false);
+  update_hashes(r, &path, r->num_chars - num_chars);
+  end_write(r);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  return ROPE_OK;
+}
+
+#endif
+
+// Delete num characters at position pos. Deleting past the end of the string
+// has no effect.
+static void rope_del_at_iter(rope *r, rope_node *e, rope_iter *iter, size_t length) {
+  r->tail_valid = 0;
+  STORE_RELAXED(r->num_chars, r->num_chars - length);
+  size_t offset = iter->s[0].skip_size;
+  // Anchors in the deleted text end up at the deletion position.
+  rope_node *anchor_node = e;
+  size_t anchor_offset = offset;
+  // Set if we need to split an external node (see below).
+  const uint8_t *split_str = NULL;
+  size_t split_bytes = 0, split_chars = 0;
+  while (length) {
+    if (offset == e->nexts[0].skip_size) {
+      // End of the current node. Skip to the start of the next one.
+      e = iter->s[0].node->nexts[0].node;
+      offset = 0;
+    }
+
+    size_t num_chars = e->nexts[0].skip_size;
+    size_t removed = MIN(length, num_chars - offset);
+#if ROPE_WCHAR
+    size_t removed_wchars;
+#endif
+
+    int i;
+    if (removed < num_chars || e == &r->head) {
+      // Just trim this node down to size.
+      thaw(r, e);
+      size_t leading_bytes = count_bytes_in_utf8(e->str, offset);
+      size_t removed_bytes = count_bytes_in_utf8(&e->str[leading_bytes], removed);
+      size_t trailing_bytes = e->num_bytes - leading_bytes - removed_bytes;
+#if ROPE_WCHAR
+      removed_wchars = count_wchars_in_utf8(&e->str[leading_bytes], removed);
+#endif
+      // External spans can't be edited in place. Trimming the start just moves
+      // the span, and trimming the middle splits it in two (below).
+      // Shrink num_bytes before moving an external span forward so readers stay inside it.
+      STORE_RELAXED(e->num_bytes, e->num_bytes - removed_bytes);
+      mark_changed(e);
+      if (trailing_bytes) {
+        if (!is_external(e)) {
+          memmove(&e->str[leading_bytes], &e->str[leading_bytes + removed_bytes], trailing_bytes);
+          TRACE(r, bytes_moved, trailing_bytes);
+        } else if (leading_bytes == 0) {
+          PUBLISH(e->str, e->str + removed_bytes);
+        } else {
+          split_str = &e->str[leading_bytes + removed_bytes];
+          split_bytes = trailing_bytes;
+          split_chars = num_chars - offset - removed;
+        }
+      }
+      STORE_RELAXED(r->num_bytes, r->num_bytes - removed_bytes);
+      anchors_removed(e, offset, removed, anchor_node, anchor_offset);
+
+      for (i = 0; i < e->height; i++) {
+        STORE_RELAXED(e->nexts[i].skip_size, e->nexts[i].skip_size - removed);
+#if ROPE_WCHAR
+        e->nexts[i].wchar_size -= removed_wchars;
+#endif
+      }
+
+    } else {
+      // Remove the node from the list
+#if ROPE_WCHAR
+      removed_wchars = e->nexts[0].wchar_size;
+#endif
+      anchors_removed(e, 0, num_chars, anchor_node, anchor_offset);
+      for (i = 0; i < e->height; i++) {
+        rope_skip_node *link = &iter->s[i].node->nexts[i];
+        PUBLISH(link->node, e->nexts[i].node);
+        set_prev(e->nexts[i].node, i, iter->s[i].node);
+        STORE_RELAXED(link->skip_size, link->skip_size + e->nexts[i].skip_size - removed);
+#if ROPE_WCHAR
+        link->wchar_size += e->nexts[i].wchar_size - removed_wchars;
+#endif
+      }
+
+      STORE_RELAXED(r->num_bytes, r->num_bytes - e->num_bytes);
+#if ROPE_COMPRESS
+      if (is_compressed(e)) r->num_compressed--;
+#endif
+      // TODO: Recycle e.
+      rope_node *next = e->nexts[0].node;
+      free_node(r, e);
+      e = next;
+    }
+
+    for (; i < r->head.height; i++) {
+      rope_skip_node *link = &iter->s[i].node->nexts[i];
+      STORE_RELAXED(link->skip_size, link->skip_size - removed);
+#if ROPE_WCHAR
+      link->wchar_size -= removed_wchars;
+#endif
+    }
+
+    length -= removed;
+  }
+
+  if (split_str) {
+    // We deleted from the middle of an external node. This only happens when the whole deletion is
+    // inside the first node, so the iterator still points exactly at the deletion position.
+    // Truncate the node there and reinsert its tail as a new external node.
+    rope_node *split = iter->s[0].node;
+    STORE_RELAXED(split->num_bytes, split->num_bytes - split_bytes);
+    mark_changed(split);
+#if ROPE_WCHAR
+    size_t split_wchars = count_wchars_in_utf8(split_str, split_chars);
+    update_offset_list(r, iter, -split_chars, -split_wchars);
+#else
+    update_offset_list(r, iter, -split_chars);
+#endif
+    STORE_RELAXED(r->num_chars, r->num_chars - split_chars);
+    STORE_RELAXED(r->num_bytes, r->num_bytes - split_bytes);
+
+    rope_node *tail = insert_at(r, iter, split_str, NULL, split_bytes, split_chars, true);
+    anchors_moved(anchor_node, anchor_offset, tail);
+  }
+}
+
+void rope_del(rope *r, size_t pos, size_t length) {
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+
+  assert(r);
+  pos = MIN(pos, r->num_chars);
+  length = MIN(length, r->num_chars - pos);
+
+  begin_write(r);
+  rope_iter iter;
+
+  // Search for the node where we'll insert the string.
+  rope_node *e = iter_at_char_pos(r, pos, &iter);
+
+  hash_path path;
+  save_hash_path(r, &iter, pos, &path);
+  rope_del_at_iter(r, e, &iter, length);
+  update_hashes(r, &path, 0);
+  end_write(r);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+}
+
+#if ROPE_WCHAR
+size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *char_len_out) {
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+
+  assert(r);
+  size_t wchar_total = rope_wchar_count(r);
+  wchar_pos = MIN(wchar_pos, wchar_total);
   wchar_num = MIN(wchar_num, wchar_total - wchar_pos);
 
+  begin_write(r);
+  rope_iter iter;
+
+  // Search for the node where we'll insert the string.
+  rope_node *start = iter_at_wchar_pos(r, wchar_pos, &iter);
+  size_t char_pos = iter.s[r->head.height - 1].skip_size;
+
+  rope_iter end_iter;
+  int h = r->head.height - 1;
+  iter_at_wchar_pos(r, iter.s[h].wchar_size + wchar_num, &end_iter);
+
+  size_t char_length = end_iter.s[h].skip_size - iter.s[h].skip_size;
+  hash_path path;
+  save_hash_path(r, &iter, char_pos, &path);
+  rope_del_at_iter(r, start, &iter, char_length);
+  update_hashes(r, &path, 0);
+  end_write(r);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  if (char_len_out) {
+    *char_len_out = char_length;
+  }
+  return char_pos;
+}
+#endif
+
+// Decode the utf8 character at str.
+static uint32_t decode_utf8(const uint8_t *str) {
+  uint8_t b = str[0];
+  if (b < 0x80) return b;
+  else if (b < 0xe0) return ((b & 0x1f) << 6) | (str[1] & 0x3f);
+  else if (b < 0xf0) return ((b & 0x0f) << 12) | ((str[1] & 0x3f) << 6) | (str[2] & 0x3f);
+  else return ((uint32_t)(b & 0x07) << 18) | ((str[1] & 0x3f) << 12) | ((str[2] & 0x3f) << 6)
+      | (str[3] & 0x3f);
+}
+
+uint32_t rope_char_at(rope *r, size_t pos) {
+  assert(r);
+  if (pos >= r->num_chars) return 0;
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(r, pos, &iter);
+  size_t offset = iter.s[0].skip_size;
+  // The iterator stops at the end of the node before the character.
+  while (offset == e->nexts[0].skip_size) {
+    e = e->nexts[0].node;
+    offset = 0;
+  }
+  thaw(r, e);
+  return decode_utf8(&e->str[count_bytes_in_utf8(e->str, offset)]);
+}
+
+#if ROPE_WCHAR
+size_t rope_char_to_wchar(rope *r, size_t pos) {
+  assert(r);
+  rope_iter iter;
+  iter_at_char_pos(r, MIN(pos, r->num_chars), &iter);
+  return iter.s[r->head.height - 1].wchar_size;
+}
+
+size_t rope_wchar_to_char(rope *r, size_t wchar_pos) {
+  assert(r);
+  rope_iter iter;
+  iter_at_wchar_pos(r, MIN(wchar_pos, rope_wchar_count(r)), &iter);
+  return iter.s[r->head.height - 1].skip_size;
+}
+#endif
+
+// Byte offsets aren't stored in the skip list, so converting them means walking along the bottom
+// of the rope. The batch functions share one walk between all their positions. Sweeps which don't
+// need byte offsets jump to their first position, and back to any earlier one, with a descent.
+typedef struct {
+  rope_node *n;
+  // The position of the start of n in the rope. node_bytes is only kept up to date when counting
+  // bytes.
+  size_t node_chars, node_bytes;
+  // The cursor's position inside n.
+  size_t chars, bytes;
+#if ROPE_WCHAR
+  size_t node_wchars, wchars;
+#endif
+  bool count_bytes;
+} sweep;
+
+// Sweeps which don't count bytes start with no node, and descend to their first position.
+static void sweep_start(rope *r, sweep *s, bool count_bytes) {
+  memset(s, 0, sizeof(sweep));
+  s->n = count_bytes ? &r->head : NULL;
+  s->count_bytes = count_bytes;
+}
+
+static void sweep_next_node(sweep *s) {
+  s->node_chars += s->n->nexts[0].skip_size;
+  s->node_bytes += s->n->num_bytes;
+  s->chars = s->bytes = 0;
+#if ROPE_WCHAR
+  s->node_wchars += s->n->nexts[0].wchar_size;
+  s->wchars = 0;
+#endif
+  s->n = s->n->nexts[0].node;
+}
+
+// Step over the character at the cursor.
+static inline void sweep_step(sweep *s) {
+  uint8_t b = s->n->str[s->bytes];
+  s->bytes += codepoint_size(b);
+  s->chars++;
+#if ROPE_WCHAR
+  s->wchars += 1 + NEEDS_TWO_WCHARS(b);
+#endif
+}
+
+// Move the cursor to the start of n, given the position iter has in it. A position at the end of n
+// is at the start of the next node, which is the one read.
+static void sweep_seek(sweep *s, rope_node *n, const rope_iter *iter, size_t top_chars,
+    size_t top_wchars) {
+  s->n = n;
+  s->node_chars = top_chars - iter->s[0].skip_size;
+  s->chars = s->bytes = 0;
+#if ROPE_WCHAR
+  s->node_wchars = top_wchars - iter->s[0].wchar_size;
+  s->wchars = 0;
+#endif
+  if (iter->s[0].skip_size == n->nexts[0].skip_size && n->nexts[0].node) sweep_next_node(s);
+}
+
+// Each sweep_to function moves the cursor forward to a (clamped) position. If the position is
+// behind it, the cursor goes back to the start of the rope first when counting bytes, and
+// otherwise straight to the position's node.
+static void sweep_to_char(rope *r, sweep *s, size_t pos) {
+  if (s->n == NULL || pos < s->node_chars + s->chars) {
+    if (s->count_bytes) {
+      sweep_start(r, s, true);
+    } else {
+      rope_iter iter;
+      rope_node *n = iter_at_char_pos(r, pos, &iter);
+#if ROPE_WCHAR
+      sweep_seek(s, n, &iter, pos, iter.s[r->head.height - 1].wchar_size);
+#else
+      sweep_seek(s, n, &iter, pos, 0);
+#endif
+    }
+  }
+  while (pos > s->node_chars + s->n->nexts[0].skip_size) sweep_next_node(s);
+  thaw(r, s->n);
+  while (s->node_chars + s->chars < pos) sweep_step(s);
+}
+
+static void sweep_to_byte(rope *r, sweep *s, size_t pos) {
+  assert(s->count_bytes);
+  if (pos < s->node_bytes + s->bytes) sweep_start(r, s, true);
+  while (pos > s->node_bytes + s->n->num_bytes) sweep_next_node(s);
+  thaw(r, s->n);
+  size_t offset = pos - s->node_bytes;
+  while (s->bytes < offset && s->bytes + codepoint_size(s->n->str[s->bytes]) <= offset) {
+    sweep_step(s);
+  }
+}
+
+#if ROPE_WCHAR
+static void sweep_to_wchar(rope *r, sweep *s, size_t pos) {
+  assert(!s->count_bytes);
+  if (s->n == NULL || pos < s->node_wchars + s->wchars) {
+    rope_iter iter;
+    rope_node *n = iter_at_wchar_pos(r, pos, &iter);
+    sweep_seek(s, n, &iter, iter.s[r->head.height - 1].skip_size, pos);
+  }
+  while (pos > s->node_wchars + s->n->nexts[0].wchar_size) sweep_next_node(s);
+  thaw(r, s->n);
+  size_t offset = pos - s->node_wchars;
+  while (s->wchars < offset && s->wchars + 1 + NEEDS_TWO_WCHARS(s->n->str[s->bytes]) <= offset) {
+    sweep_step(s);
+  }
+}
+#endif
+
+void rope_chars_at(rope *r, const size_t *positions, size_t num, uint32_t *chars_out) {
+  assert(r);
+  sweep s;
+  sweep_start(r, &s, false);
+  for (size_t i = 0; i < num; i++) {
+    if (positions[i] >= r->num_chars) {
+      chars_out[i] = 0;
+      continue;
+    }
+    sweep_to_char(r, &s, positions[i]);
+    while (s.bytes == s.n->num_bytes) sweep_next_node(&s);
+    thaw(r, s.n);
+    chars_out[i] = decode_utf8(&s.n->str[s.bytes]);
+  }
+}
+
+void rope_chars_to_bytes(rope *r, const size_t *positions, size_t num, size_t *bytes_out) {
+  assert(r);
+  sweep s;
+  sweep_start(r, &s, true);
+  for (size_t i = 0; i < num; i++) {
+    sweep_to_char(r, &s, MIN(positions[i], r->num_chars));
+    bytes_out[i] = s.node_bytes + s.bytes;
+  }
+}
+
+void rope_bytes_to_chars(rope *r, const size_t *positions, size_t num, size_t *chars_out) {
+  assert(r);
+  sweep s;
+  sweep_start(r, &s, true);
+  for (size_t i = 0; i < num; i++) {
+    sweep_to_byte(r, &s, MIN(positions[i], r->num_bytes));
+    chars_out[i] = s.node_chars + s.chars;
+  }
+}
+
+size_t rope_char_to_byte(rope *r, size_t pos) {
+  rope_chars_to_bytes(r, &pos, 1, &pos);
+  return pos;
+}
+
+size_t rope_byte_to_char(rope *r, size_t byte_pos) {
+  rope_bytes_to_chars(r, &byte_pos, 1, &byte_pos);
+  return byte_pos;
+}
+
+#if ROPE_WCHAR
+void rope_chars_to_wchars(rope *r, const size_t *positions, size_t num, size_t *wchars_out) {
+  assert(r);
+  sweep s;
+  sweep_start(r, &s, false);
+  for (size_t i = 0; i < num; i++) {
+    sweep_to_char(r, &s, MIN(positions[i], r->num_chars));
+    wchars_out[i] = s.node_wchars + s.wchars;
+  }
+}
+
+void rope_wchars_to_chars(rope *r, const size_t *positions, size_t num, size_t *chars_out) {
+  assert(r);
+  sweep s;
+  sweep_start(r, &s, false);
+  size_t num_wchars = rope_wchar_count(r);
+  for (size_t i = 0; i < num; i++) {
+    sweep_to_wchar(r, &s, MIN(positions[i], num_wchars));
+    chars_out[i] = s.node_chars + s.chars;
+  }
+}
+#endif
+
+#if ROPE_ANCHORS
+rope_anchor *rope_anchor_new(rope *r, size_t pos, ROPE_ANCHOR_BIAS bias) {
+  assert(r);
+  rope_anchor *a = (rope_anchor *)r->alloc(sizeof(rope_anchor));
+  a->bias = bias;
+  rope_iter iter;
+  iter_at_char_pos(r, MIN(pos, r->num_chars), &iter);
+  link_anchor(a, iter.s[0].node, iter.s[0].skip_size);
+  return a;
+}
+
+void rope_anchor_set(rope *r, rope_anchor *anchor, size_t pos) {
+  assert(r);
+  assert(anchor);
+  unlink_anchor(anchor);
+  rope_iter iter;
+  iter_at_char_pos(r, MIN(pos, r->num_chars), &iter);
+  link_anchor(anchor, iter.s[0].node, iter.s[0].skip_size);
+}
+
+size_t rope_anchor_pos(rope *r, const rope_anchor *anchor) {
+  assert(r);
+  assert(anchor);
+  // Walk back to the head, jumping along the tallest link into each node.
+  size_t pos = anchor->offset;
+  for (rope_node *n = anchor->node; n != &r->head;) {
+    rope_node *prev = n->nexts[n->height - 1].prev;
+    pos += prev->nexts[n->height - 1].skip_size;
+    n = prev;
+  }
+  return pos;
+}
+
+void rope_anchor_free(rope *r, rope_anchor *anchor) {
+  assert(r);
+  if (anchor == NULL) return;
+  unlink_anchor(anchor);
+  r->free(anchor);
+}
+#endif
+
+// Comparisons walk both ropes' node lists at once, comparing as many bytes at a time as both
+// current nodes allow. memcmp does the vectorizing. Compressed nodes are read without thawing
+// them, so comparing idle ropes leaves them compressed.
+int rope_compare(const rope *a, const rope *b) {
+  assert(a && b);
+  unpack_buffer ua, ub;
+  init_unpack_buffer(a, &ua);
+  init_unpack_buffer(b, &ub);
+  // The head node is never compressed.
+  const rope_node *na = &a->head, *nb = &b->head;
+  const uint8_t *sa = na->str, *sb = nb->str;
+  size_t oa = 0, ob = 0;
+  int result = 0;
+  while (true) {
+    // Move past finished (and empty) nodes.
+    while (na && oa == na->num_bytes) {
+      na = na->nexts[0].node;
+      oa = 0;
+      if (na) sa = node_text(na, &ua);
+    }
+    while (nb && ob == nb->num_bytes) {
+      nb = nb->nexts[0].node;
+      ob = 0;
+      if (nb) sb = node_text(nb, &ub);
+    }
+    if (na == NULL || nb == NULL) {
+      result = (na != NULL) - (nb != NULL);
+      break;
+    }
+
+    size_t num = MIN(na->num_bytes - oa, nb->num_bytes - ob);
+    // Copied ropes share their external spans.
+    if (&sa[oa] != &sb[ob]) {
+      result = memcmp(&sa[oa], &sb[ob], num);
+      if (result) break;
+    }
+    oa += num;
+    ob += num;
+  }
+  free_unpack_buffer(a, &ua);
+  free_unpack_buffer(b, &ub);
+  return result;
+}
+
+int rope_equal(const rope *a, const rope *b) {
+  assert(a && b);
+  if (a->num_bytes != b->num_bytes || a->num_chars != b->num_chars) return 0;
+#if ROPE_HASH
+  if (rope_hash(a) != rope_hash(b)) return 0;
+#endif
+  return rope_compare(a, b) == 0;
+}
+
+int rope_compare_buf(const rope *r, const uint8_t *buf, size_t len) {
+  assert(r);
+  assert(buf || len == 0);
+  unpack_buffer u;
+  init_unpack_buffer(r, &u);
+  int result = 0;
+  for (const rope_node *n = &r->head; n != NULL && result == 0; n = n->nexts[0].node) {
+    size_t num = MIN(n->num_bytes, len);
+    if (num) result = memcmp(node_text(n, &u), buf, num);
+    if (result == 0 && num < n->num_bytes) result = 1;
+    buf += num;
+    len -= num;
+  }
+  free_unpack_buffer(r, &u);
+  if (result == 0 && len) result = -1;
+  return result;
+}
+
+int rope_equal_buf(const rope *r, const uint8_t *buf, size_t len) {
+  assert(r);
+  return r->num_bytes == len && rope_compare_buf(r, buf, len) == 0;
+}
+
+// Diffing. The common prefix is found by comparing the ropes' nodes directly, and the common
+// suffix by comparing blocks of characters read from the ends. Only what's left in the middle is
+// diffed properly, using Myers' algorithm.
+
+// Myers' algorithm is only run on middles with at most this many characters (old + new), and
+// gives up after this many edits. Past that the whole middle is reported as one replacement.
+#define DIFF_MAX_CHARS 100000
+#define DIFF_MAX_DISTANCE 1000
+
+// How many characters at a time to compare looking for the common suffix.
+#define DIFF_SUFFIX_BLOCK 256
+
+enum { DIFF_EQUAL, DIFF_DELETE, DIFF_INSERT };
+
+// Count the characters in num_bytes of utf8.
+static size_t count_chars(const uint8_t *str, size_t num_bytes) {
+  size_t num_chars = 0;
+  for (size_t i = 0; i < num_bytes; i++) {
+    num_chars += (str[i] & 0xc0) != 0x80;
+  }
+  return num_chars;
+}
+
+// Read num characters starting at pos into dest, packed by read_char.
+static void read_chars(rope *r, size_t pos, size_t num, uint32_t *dest) {
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(r, pos, &iter);
+  const uint8_t *p = &e->str[count_bytes_in_utf8(e->str, iter.s[0].skip_size)];
+  while (num) {
+    if (p == &e->str[e->num_bytes]) {
+      e = e->nexts[0].node;
+      p = e->str;
+    } else {
+      *dest++ = read_char(&p);
+      num--;
+    }
+  }
+}
+
+#if ROPE_WCHAR
+static inline size_t char_wchars(uint32_t c) {
+  // 4 byte characters need a surrogate pair.
+  return c >= 0xf0000000 ? 2 : 1;
+}
+#endif
+
+// The number of characters at the start of both ropes which are the same.
+static size_t common_prefix(rope *a, rope *b) {
+  rope_node *na = &a->head, *nb = &b->head;
+  size_t oa = 0, ob = 0, num_chars = 0;
+  while (true) {
+    while (na && oa == na->num_bytes) {
+      num_chars += na->nexts[0].skip_size;
+      na = na->nexts[0].node;
+      oa = 0;
+    }
+    while (nb && ob == nb->num_bytes) {
+      nb = nb->nexts[0].node;
+      ob = 0;
+    }
+    if (na == NULL || nb == NULL) break;
+
+    size_t num = MIN(na->num_bytes - oa, nb->num_bytes - ob);
+    if (memcmp(&na->str[oa], &nb->str[ob], num) != 0) {
+      // Find the first byte which differs, and back up to the start of its character. Both
+      // chunks start on a character boundary.
+      size_t i = 0;
+      while (na->str[oa + i] == nb->str[ob + i]) i++;
+      while (i && (na->str[oa + i] & 0xc0) == 0x80) i--;
+      oa += i;
+      break;
+    }
+    oa += num;
+    ob += num;
+  }
+
+  if (na) num_chars += count_chars(na->str, oa);
+  return num_chars;
+}
+
+// The number of characters (up to max) at the end of both ropes which are the same. The skip list
+// can't be walked backwards, so this reads blocks of characters from the ends.
+static size_t common_suffix(rope *a, rope *b, size_t max) {
+  uint32_t block_a[DIFF_SUFFIX_BLOCK], block_b[DIFF_SUFFIX_BLOCK];
+  size_t suffix = 0;
+  while (suffix < max) {
+    size_t num = MIN(DIFF_SUFFIX_BLOCK, max - suffix);
+    read_chars(a, a->num_chars - suffix - num, num, block_a);
+    read_chars(b, b->num_chars - suffix - num, num, block_b);
+    size_t i = num;
+    while (i && block_a[i - 1] == block_b[i - 1]) i--;
+    suffix += num - i;
+    if (i) break;
+  }
+  return suffix;
+}
+
+// Myers' O(ND) diff of x and y. Fills ops (which needs room for n + m entries) with the DIFF_
+// operations turning x into y and returns how many there are, or SIZE_MAX if that takes more than
+// max_d inserts and deletes.
+static size_t myers_diff(rope *r, const uint32_t *x, int n, const uint32_t *y, int m,
+    int max_d, uint8_t *ops) {
+  max_d = MIN(max_d, n + m);
+  // v[k] is the furthest x reached on diagonal k (x - y = k). trace stores v after each round d,
+  // at trace[d * d], for backtracking. It has room for trace_rounds rounds, and grows as rounds
+  // are added, so close inputs don't pay for max_d.
+  int *v_mem = (int *)r->alloc((2 * max_d + 3) * sizeof(int));
+  int *v = &v_mem[max_d + 1];
+  int trace_rounds = MIN(max_d + 1, 16);
+  int *trace = (int *)r->alloc((size_t)trace_rounds * trace_rounds * sizeof(int));
+  v[1] = 0;
+
+  int d, found = 0;
+  for (d = 0; d <= max_d && !found; d++) {
+    if (d == trace_rounds) {
+      trace_rounds = MIN(max_d + 1, 2 * trace_rounds);
+      trace = (int *)r->realloc(trace, (size_t)trace_rounds * trace_rounds * sizeof(int));
+    }
+    for (int k = -d; k <= d; k += 2) {
+      int px = (k == -d || (k != d && v[k - 1] < v[k + 1])) ? v[k + 1] : v[k - 1] + 1;
+      int py = px - k;
+      while (px < n && py < m && x[px] == y[py]) {
+        px++;
+        py++;
+      }
+      v[k] = px;
+      if (px >= n && py >= m) {
+        found = 1;
+        break;
+      }
+    }
+    memcpy(&trace[d * d], &v[-d], (2 * d + 1) * sizeof(int));
+  }
+
+  size_t num_ops = SIZE_MAX;
+  if (found) {
+    // Walk back from the end, filling ops in from the back.
+    num_ops = 0;
+    int px = n, py = m;
+    for (d--; d > 0; d--) {
+      int *prev = &trace[(d - 1) * (d - 1) + (d - 1)];
+      int k = px - py;
+      int prev_k = (k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1;
+      int prev_x = prev[prev_k], prev_y = prev_x - prev_k;
+      while (px > prev_x && py > prev_y) {
+        ops[n + m - ++num_ops] = DIFF_EQUAL;
+        px--;
+        py--;
+      }
+      ops[n + m - ++num_ops] = px == prev_x ? DIFF_INSERT : DIFF_DELETE;
+      px = prev_x;
+      py = prev_y;
+    }
+    while (px > 0) {
+      ops[n + m - ++num_ops] = DIFF_EQUAL;
+      px--;
+    }
+    memmove(ops, &ops[n + m - num_ops], num_ops);
+  }
+
+  r->free(v_mem);
+  r->free(trace);
+  return num_ops;
+}
+
+size_t rope_diff(rope *a, rope *b, rope_diff_edit **edits_out) {
+  assert(a && b);
+  assert(edits_out);
+  thaw_rope(a);
+  thaw_rope(b);
+  size_t prefix = common_prefix(a, b);
+  size_t suffix = common_suffix(a, b, MIN(a->num_chars, b->num_chars) - prefix);
+  size_t n = a->num_chars - prefix - suffix, m = b->num_chars - prefix - suffix;
+  *edits_out = NULL;
+  if (n == 0 && m == 0) return 0;
+
+  uint32_t *x = NULL, *y = NULL;
+  uint8_t *ops = NULL;
+  size_t num_ops = SIZE_MAX;
+  if (n + m <= DIFF_MAX_CHARS) {
+    x = (uint32_t *)a->alloc((n + m) * sizeof(uint32_t));
+    y = &x[n];
+    read_chars(a, prefix, n, x);
+    read_chars(b, prefix, m, y);
+    ops = (uint8_t *)a->alloc(n + m);
+    num_ops = myers_diff(a, x, (int)n, y, (int)m, DIFF_MAX_DISTANCE, ops);
+  }
+
+  rope_diff_edit *edits;
+  size_t num_edits = 0;
+  if (num_ops == SIZE_MAX) {
+    // Replace the whole middle.
+    edits = (rope_diff_edit *)a->alloc(sizeof(rope_diff_edit));
+    edits[0].pos = prefix;
+    edits[0].del_chars = n;
+    edits[0].ins_chars = m;
+#if ROPE_WCHAR
+    edits[0].wchar_pos = rope_char_to_wchar(a, prefix);
+    edits[0].del_wchars = rope_char_to_wchar(a, prefix + n) - edits[0].wchar_pos;
+    edits[0].ins_wchars = rope_char_to_wchar(b, prefix + m) - edits[0].wchar_pos;
+#endif
+    num_edits = 1;
+  } else {
+    for (size_t i = 0; i < num_ops; i++) {
+      num_edits += ops[i] != DIFF_EQUAL && (i == 0 || ops[i - 1] == DIFF_EQUAL);
+    }
+    edits = (rope_diff_edit *)a->alloc(num_edits * sizeof(rope_diff_edit));
+
+    // Runs of deletes and inserts become edits. Positions are in the new rope's coordinates.
+    size_t pos = prefix, xi = 0, yi = 0;
+#if ROPE_WCHAR
+    size_t wchar_pos = rope_char_to_wchar(a, prefix);
+#endif
+    rope_diff_edit *edit = edits;
+    for (size_t i = 0; i < num_ops;) {
+      if (ops[i] == DIFF_EQUAL) {
+#if ROPE_WCHAR
+        wchar_pos += char_wchars(y[yi]);
+#endif
+        pos++;
+        xi++;
+        yi++;
+        i++;
+        continue;
+      }
+
+      edit->pos = pos;
+      edit->del_chars = edit->ins_chars = 0;
+#if ROPE_WCHAR
+      edit->wchar_pos = wchar_pos;
+      edit->del_wchars = edit->ins_wchars = 0;
+#endif
+      for (; i < num_ops && ops[i] != DIFF_EQUAL; i++) {
+        if (ops[i] == DIFF_DELETE) {
+#if ROPE_WCHAR
+          edit->del_wchars += char_wchars(x[xi]);
+#endif
+          edit->del_chars++;
+          xi++;
+        } else {
+#if ROPE_WCHAR
+          edit->ins_wchars += char_wchars(y[yi]);
+#endif
+          edit->ins_chars++;
+          yi++;
+        }
+      }
+      pos += edit->ins_chars;
+#if ROPE_WCHAR
+      wchar_pos += edit->ins_wchars;
+#endif
+      edit++;
+    }
+    assert(edit == &edits[num_edits]);
+  }
+
+  if (x) a->free(x);
+  if (ops) a->free(ops);
+  *edits_out = edits;
+  return num_edits;
+}
+
+// Transcode num_bytes of utf8 into utf16 at dest. Returns the number of code units written.
+static size_t utf8_to_utf16(const uint8_t *str, size_t num_bytes, uint16_t *dest) {
+  const uint8_t *p = str, *end = &str[num_bytes];
+  uint16_t *d = dest;
+  while (p < end) {
+    uint8_t b = *p;
+    if (b < 0x80) {
+#ifdef __SSE2__
+      // Widen runs of ascii 16 bytes at a time.
+      const __m128i zero = _mm_setzero_si128();
+      while (end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        if (_mm_movemask_epi8(bytes)) break;
+        _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi8(bytes, zero));
+        _mm_storeu_si128((__m128i *)&d[8], _mm_unpackhi_epi8(bytes, zero));
+        p += 16;
+        d += 16;
+      }
+#endif
+      while (p < end && *p < 0x80) {
+        *d++ = *p++;
+      }
+    } else if (b < 0xe0) {
+      *d++ = (uint16_t)(((b & 0x1f) << 6) | (p[1] & 0x3f));
+      p += 2;
+    } else if (b < 0xf0) {
+      *d++ = (uint16_t)(((b & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f));
+      p += 3;
+    } else {
+      uint32_t c = ((uint32_t)(b & 0x07) << 18) | ((p[1] & 0x3f) << 12)
+          | ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+      c -= 0x10000;
+      *d++ = (uint16_t)(0xd800 | (c >> 10));
+      *d++ = (uint16_t)(0xdc00 | (c & 0x3ff));
+      p += 4;
+    }
+  }
+  return d - dest;
+}
+
+size_t rope_utf16_count(rope *r) {
+  assert(r);
+#if ROPE_WCHAR
+  return rope_wchar_count(r);
+#else
+  // Every character is one code unit, except the ones which need a surrogate pair.
+  thaw_rope(r);
+  size_t count = r->num_chars;
+  for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
+    for (size_t i = 0; i < n->num_bytes; i++) {
+      count += n->str[i] >= 0xf0;
+    }
+  }
+  return count;
+#endif
+}
+
+size_t rope_write_utf16(rope *r, uint16_t *dest) {
+  assert(r);
+  thaw_rope(r);
+  uint16_t *d = dest;
+  for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
+    d += utf8_to_utf16(n->str, n->num_bytes, d);
+  }
+  *d++ = 0;
+  return d - dest;
+}
+
+size_t rope_write_utf16_range(rope *r, size_t pos, size_t num, uint16_t *dest) {
+  assert(r);
+  pos = MIN(pos, r->num_chars);
+  num = MIN(num, r->num_chars - pos);
+  rope_iter iter;
+  rope_node *n = iter_at_char_pos(r, pos, &iter);
+  size_t offset = iter.s[0].skip_size; // Characters to skip in n.
+  uint16_t *d = dest;
+  while (num) {
+    size_t skip = n->nexts[0].skip_size;
+    if (offset == skip) {
+      n = n->nexts[0].node;
+      offset = 0;
+      continue;
+    }
+
+    thaw(r, n);
+    size_t start = count_bytes_in_utf8(n->str, offset);
+    size_t chars = MIN(num, skip - offset);
+    size_t bytes = chars == skip - offset
+        ? n->num_bytes - start
+        : count_bytes_in_utf8(&n->str[start], chars);
+    d += utf8_to_utf16(&n->str[start], bytes, d);
+    num -= chars;
+    n = n->nexts[0].node;
+    offset = 0;
+  }
+  return d - dest;
+}
+
+uint16_t *rope_create_utf16(rope *r, size_t *len_out) {
+  size_t len = rope_utf16_count(r);
+  uint16_t *dest = (uint16_t *)r->alloc((len + 1) * sizeof(uint16_t)); // Room for a zero.
+  rope_write_utf16(r, dest);
+  if (len_out) *len_out = len;
+  return dest;
+}
+
+// A run of nodes, [start, end), being searched for a string. The matches found are added to the
+// matches array.
+typedef struct {
+  rope *r;
+  rope_node *start;
+  rope_node *end;
+  size_t start_char;
+  const uint8_t *needle;
+  size_t needle_len;
+  size_t *matches;
+  size_t num_matches;
+  size_t capacity;
+} find_range;
+
+// Does needle appear at byte offset in n? Matches can carry on into the following nodes.
+static bool matches_at(rope_node *n, size_t offset, const uint8_t *needle, size_t len) {
+  while (len) {
+    if (n == NULL) return false;
+    size_t num = MIN(len, n->num_bytes - offset);
+    if (memcmp(&n->str[offset], needle, num) != 0) return false;
+    needle += num;
+    len -= num;
+    n = n->nexts[0].node;
+    offset = 0;
+  }
+  return true;
+}
+
+static void *find_in_range(void *arg) {
+  find_range *range = (find_range *)arg;
+  rope *r = range->r;
+  size_t pos = range->start_char;
+  for (rope_node *n = range->start; n != range->end; n = n->nexts[0].node) {
+    // Only look at the bytes which could start a match, and only count characters up to them.
+    const uint8_t *str = n->str;
+    const uint8_t *p = str, *counted = str;
+    size_t chars = 0;
+    while ((p = (const uint8_t *)memchr(p, range->needle[0], &str[n->num_bytes] - p)) != NULL) {
+      if (matches_at(n, p - str, range->needle, range->needle_len)) {
+        for (; counted < p; counted++) {
+          chars += (*counted & 0xc0) != 0x80;
+        }
+        if (range->num_matches == range->capacity) {
+          range->capacity = MAX(range->capacity * 2, 16);
+          range->matches = (size_t *)r->realloc(range->matches, range->capacity * sizeof(size_t));
+        }
+        range->matches[range->num_matches++] = pos + chars;
+      }
+      p++;
+    }
+    pos += n->nexts[0].skip_size;
+  }
+  return NULL;
+}
+
+size_t rope_find_all(rope *r, const uint8_t *needle, size_t **matches_out) {
+  assert(r);
+  assert(needle);
+  assert(matches_out);
+  thaw_rope(r);
+  find_range range = { r, &r->head, NULL, 0, needle, strlen((char *)needle), NULL, 0, 0 };
+  if (range.needle_len) {
+    find_in_range(&range);
+  }
+  *matches_out = range.matches;
+  return range.num_matches;
+}
+
+#if ROPE_PARALLEL
+// The most threads the parallel functions will use.
+#define MAX_THREADS 64
+
+// How many ranges should the rope be split into to work on it with up to num_threads threads?
+static size_t num_parallel_ranges(rope *r, int num_threads) {
+  if (num_threads <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = cores > 0 ? (int)cores : 1;
+  }
+  size_t num_ranges = MIN((size_t)num_threads, r->num_bytes / ROPE_PARALLEL_MIN_BYTES);
+  return MIN(num_ranges, MAX_THREADS);
+}
+
+// Split the rope into num_ranges runs of nodes with about the same number of characters, using
+// the skip list to find where each run starts. Run i is [starts[i], starts[i + 1]), and the last
+// run ends at NULL. start_chars[i] is set to the position of starts[i].
+static void split_rope(rope *r, size_t num_ranges, rope_node **starts, size_t *start_chars) {
   rope_iter iter;
+  starts[0] = &r->head;
+  start_chars[0] = 0;
+  for (size_t i = 1; i < num_ranges; i++) {
+    size_t pos = r->num_chars / num_ranges * i;
+    starts[i] = iter_at_char_pos(r, pos, &iter);
+    start_chars[i] = pos - iter.s[0].skip_size;
+  }
+  starts[num_ranges] = NULL;
+}
 
-  // Search for the node where we'll insert the string.
-  rope_node *start = iter_at_wchar_pos(r, wchar_pos, &iter);
-  size_t char_pos = iter.s[r->head.height - 1].skip_size;
+// Call fn on every range, each on its own thread. The first range runs on the calling thread, as
+// does any range we couldn't start a thread for.
+static void run_ranges(void *(*fn)(void *), void *ranges, size_t range_size, size_t num_ranges) {
+  pthread_t threads[MAX_THREADS];
+  bool started[MAX_THREADS];
+  for (size_t i = 1; i < num_ranges; i++) {
+    started[i] = pthread_create(&threads[i], NULL, fn, (char *)ranges + i * range_size) == 0;
+  }
+  fn(ranges);
+  for (size_t i = 1; i < num_ranges; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      fn((char *)ranges + i * range_size);
+    }
+  }
+}
 
-  rope_iter end_iter;
-  int h = r->head.height - 1;
-  iter_at_wchar_pos(r, iter.s[h].wchar_size + wchar_num, &end_iter);
+// A run of nodes, [start, end), copied out by one thread.
+typedef struct {
+  rope_node *start;
+  rope_node *end;
+  uint8_t *dest;
+  size_t num_bytes;
+} write_range;
+
+static void *count_range(void *arg) {
+  write_range *range = (write_range *)arg;
+  size_t num_bytes = 0;
+  for (rope_node *n = range->start; n != range->end; n = n->nexts[0].node) {
+    num_bytes += n->num_bytes;
+  }
+  range->num_bytes = num_bytes;
+  return NULL;
+}
 
-  size_t char_length = end_iter.s[h].skip_size - iter.s[h].skip_size;
-  rope_del_at_iter(r, start, &iter, char_length);
+static void *copy_range(void *arg) {
+  write_range *range = (write_range *)arg;
+  uint8_t *p = range->dest;
+  for (rope_node *n = range->start; n != range->end; n = n->nexts[0].node) {
+    copy_node_text(p, n);
+    p += n->num_bytes;
+  }
+  return NULL;
+}
+
+size_t rope_write_cstr_parallel(rope *r, uint8_t *dest, int num_threads) {
+  assert(r);
+  size_t num_ranges = num_parallel_ranges(r, num_threads);
+  if (num_ranges < 2) {
+    return rope_write_cstr(r, dest);
+  }
+
+  // We don't know how many bytes come before each range, so the threads total up their ranges
+  // before copying them.
+  rope_node *starts[MAX_THREADS + 1];
+  size_t start_chars[MAX_THREADS];
+  split_rope(r, num_ranges, starts, start_chars);
+  write_range ranges[MAX_THREADS];
+  for (size_t i = 0; i < num_ranges; i++) {
+    ranges[i].start = starts[i];
+    ranges[i].end = starts[i + 1];
+  }
+  run_ranges(count_range, ranges, sizeof(write_range), num_ranges);
+
+  uint8_t *p = dest;
+  for (size_t i = 0; i < num_ranges; i++) {
+    ranges[i].dest = p;
+    p += ranges[i].num_bytes;
+  }
+  assert(p == &dest[r->num_bytes]);
+  run_ranges(copy_range, ranges, sizeof(write_range), num_ranges);
+
+  dest[r->num_bytes] = '\0';
+  return r->num_bytes + 1;
+}
+
+size_t rope_find_all_parallel(rope *r, const uint8_t *needle, size_t **matches_out,
+    int num_threads) {
+  assert(r);
+  assert(needle);
+  assert(matches_out);
+  // The threads can't decompress nodes as they go, since they share the rope's allocator.
+  thaw_rope(r);
+  size_t num_ranges = num_parallel_ranges(r, num_threads);
+  if (num_ranges < 2) {
+    return rope_find_all(r, needle, matches_out);
+  }
+
+  // Each range finds the matches which start inside it. Matches which cross into the next range
+  // are checked by reading ahead.
+  rope_node *starts[MAX_THREADS + 1];
+  size_t start_chars[MAX_THREADS];
+  split_rope(r, num_ranges, starts, start_chars);
+  find_range ranges[MAX_THREADS];
+  size_t needle_len = strlen((char *)needle);
+  for (size_t i = 0; i < num_ranges; i++) {
+    find_range range = {
+      r, starts[i], starts[i + 1], start_chars[i], needle, needle_len, NULL, 0, 0
+    };
+    ranges[i] = range;
+  }
+  if (needle_len) {
+    run_ranges(find_in_range, ranges, sizeof(find_range), num_ranges);
+  }
+
+  size_t num_matches = 0;
+  for (size_t i = 0; i < num_ranges; i++) {
+    num_matches += ranges[i].num_matches;
+  }
+  size_t *matches = NULL;
+  if (num_matches) {
+    matches = (size_t *)r->alloc(num_matches * sizeof(size_t));
+    size_t *p = matches;
+    for (size_t i = 0; i < num_ranges; i++) {
+      memcpy(p, ranges[i].matches, ranges[i].num_matches * sizeof(size_t));
+      p += ranges[i].num_matches;
+    }
+  }
+  for (size_t i = 0; i < num_ranges; i++) {
+    if (ranges[i].matches) r->free(ranges[i].matches);
+  }
+
+  *matches_out = matches;
+  return num_matches;
+}
+#endif
+
+#if ROPE_CONCURRENT
+// Reading from other threads. Readers don't take any locks. Instead they copy out what they need,
+// then check the writer's sequence number hasn't changed; if it has they throw the copy away and
+// try again. Half-finished edits can leave the rope inconsistent while we read it, so everything
+// here has to be defensive: no read may leave a buffer or loop forever, even on garbage.
+
+rope_reader *rope_reader_new(rope *r) {
+  assert(r);
+  for (int i = 0; i < ROPE_MAX_READERS; i++) {
+    uint8_t unused = 0;
+    if (__atomic_compare_exchange_n(&r->reader_used[i], &unused, 1, false,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      rope_reader *reader = (rope_reader *)r->alloc(sizeof(rope_reader));
+      reader->r = r;
+      reader->slot = i;
+      return reader;
+    }
+  }
+  return NULL;
+}
+
+void rope_reader_free(rope_reader *reader) {
+  assert(reader);
+  rope *r = reader->r;
+  __atomic_store_n(&r->reader_used[reader->slot], 0, __ATOMIC_RELEASE);
+  r->free(reader);
+}
+
+// Announce that this reader is about to look at the rope. The writer won't free anything retired
+// after the epoch we saw until we leave.
+static void reader_enter(rope_reader *reader) {
+  rope *r = reader->r;
+  uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&r->reader_epochs[reader->slot], epoch, __ATOMIC_SEQ_CST);
+}
+
+static void reader_leave(rope_reader *reader) {
+  __atomic_store_n(&reader->r->reader_epochs[reader->slot], 0, __ATOMIC_RELEASE);
+}
+
+// Count the bytes in the first *num_chars characters of str without reading past len or splitting
+// a character. Invalid bytes count as single byte characters. *num_chars is set to the number of
+// characters actually counted.
+static size_t count_bytes_bounded(const uint8_t *str, size_t len, size_t *num_chars) {
+  size_t p = 0, i = 0;
+  while (i < *num_chars && p < len) {
+    size_t size = codepoint_size(str[p]);
+    if (size == SIZE_MAX) size = 1;
+    if (size > len - p) break;
+    p += size;
+    i++;
+  }
+  *num_chars = i;
+  return p;
+}
+
+// One attempt at copying part of the rope. Returns false if the writer modified the rope while we
+// were reading, in which case dest contains junk.
+static bool try_read(rope *r, size_t pos, size_t num, uint8_t *dest, size_t dest_size,
+    size_t *bytes_out, size_t *chars_out, size_t *total_bytes_out) {
+  uint64_t seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) return false;
+
+  size_t total_chars = LOAD_RELAXED(r->num_chars);
+  size_t total_bytes = LOAD_RELAXED(r->num_bytes);
+  pos = MIN(pos, total_chars);
+  num = MIN(num, total_chars - pos);
+
+  size_t bytes = 0, chars = 0;
+  if (num) {
+    // Find the node containing pos.
+    rope_node *e = &r->head;
+    int height = LOAD_ACQUIRE(r->head.height) - 1;
+    if (height < 0 || height >= ROPE_MAX_HEIGHT) return false;
+    size_t offset = pos;
+    while (true) {
+      size_t skip = LOAD_RELAXED(e->nexts[height].skip_size);
+      if (offset > skip) {
+        offset -= skip;
+        e = LOAD_ACQUIRE(e->nexts[height].node);
+        if (e == NULL) return false;
+      } else if (height == 0) {
+        break;
+      } else {
+        height--;
+      }
+    }
+
+    while (true) {
+      // Load capacity before str. See grow_node.
+      size_t len = LOAD_ACQUIRE(e->capacity);
+      const uint8_t *str = LOAD_ACQUIRE(e->str);
+      size_t num_bytes = LOAD_RELAXED(e->num_bytes);
+      len = (LOAD_RELAXED(e->flags) & ROPE_NODE_EXTERNAL) ? num_bytes : MIN(len, num_bytes);
+
+      size_t skipped = offset;
+      size_t start = count_bytes_bounded(str, len, &skipped);
+      if (skipped != offset) return false;
+
+      size_t room = dest_size - bytes;
+      size_t n = num - chars;
+      size_t copied = count_bytes_bounded(&str[start], MIN(len - start, room), &n);
+      memcpy(&dest[bytes], &str[start], copied);
+      bytes += copied;
+      chars += n;
+
+      // Stop when we have everything, or when dest is full.
+      if (chars == num || len - start > room) break;
+
+      offset = 0;
+      e = LOAD_ACQUIRE(e->nexts[0].node);
+      if (e == NULL) return false;
+    }
+  }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != seq) return false;
+
+  *bytes_out = bytes;
+  *chars_out = chars;
+  *total_bytes_out = total_bytes;
+  return true;
+}
+
+size_t rope_reader_char_count(rope_reader *reader) {
+  assert(reader);
+  return LOAD_RELAXED(reader->r->num_chars);
+}
+
+size_t rope_reader_read(rope_reader *reader, size_t pos, size_t num,
+    uint8_t *dest, size_t dest_size, size_t *chars_out) {
+  assert(reader);
+  assert(dest || dest_size == 0);
+  size_t bytes, chars, total_bytes;
+  while (true) {
+    reader_enter(reader);
+    bool ok = try_read(reader->r, pos, num, dest, dest_size, &bytes, &chars, &total_bytes);
+    reader_leave(reader);
+    if (ok) break;
+  }
+
+  if (chars_out) *chars_out = chars;
+  return bytes;
+}
+
+uint8_t *rope_reader_create_cstr(rope_reader *reader, size_t *num_bytes_out) {
+  assert(reader);
+  rope *r = reader->r;
+  size_t size = LOAD_RELAXED(r->num_bytes) + 1;
+  uint8_t *dest = (uint8_t *)r->alloc(size);
+  size_t bytes, chars, total_bytes;
+  while (true) {
+    reader_enter(reader);
+    bool ok = try_read(r, 0, SIZE_MAX, dest, size - 1, &bytes, &chars, &total_bytes);
+    reader_leave(reader);
+    if (ok) {
+      if (bytes == total_bytes) break;
+      // The rope grew since we allocated dest.
+      size = total_bytes + 1;
+      dest = (uint8_t *)r->realloc(dest, size);
+    }
+  }
+
+  dest[bytes] = '\0';
+  if (num_bytes_out) *num_bytes_out = bytes;
+  return dest;
+}
+#endif
+
+// Builds a new list of nodes after the head, one node at a time in document order.
+typedef struct {
+  rope *r;
+  // The last node added at each height (NULL for the head), and the link from it being built up.
+  rope_node *prevs[ROPE_MAX_HEIGHT];
+  rope_skip_node links[ROPE_MAX_HEIGHT];
+  // The links the head will have.
+  rope_skip_node head_links[ROPE_MAX_HEIGHT];
+  uint8_t max_height;
+  // The number of characters before the next node.
+  size_t pos;
+#if ROPE_ANCHORS
+  // Anchors waiting for the node they point into, with their offset set to their position.
+  rope_anchor *pending;
+#endif
+#if ROPE_COMPRESS
+  // Room to compress a node's text into, or NULL if nodes aren't being compressed.
+  uint8_t *packed;
+#endif
+} relayout;
+
+// Add the characters content describes (the contents of a node) to the end of link.
+static void extend_link(rope_skip_node *link, const rope_skip_node *content) {
+  link->skip_size += content->skip_size;
+#if ROPE_WCHAR
+  link->wchar_size += content->wchar_size;
+#endif
+#if ROPE_HASH
+  link->hash = hash_add(hash_mul(link->hash, content->hash_pow), content->hash);
+  link->hash_pow = hash_mul(link->hash_pow, content->hash_pow);
+#endif
+}
+
+static void relayout_start(relayout *l, rope *r) {
+  l->r = r;
+  l->max_height = 0;
+  l->pos = r->head.nexts[0].skip_size;
+#if ROPE_ANCHORS
+  l->pending = NULL;
+#endif
+  for (int i = 0; i < ROPE_MAX_HEIGHT; i++) {
+    l->prevs[i] = NULL;
+    // The head's own characters start every link from it.
+    l->links[i] = r->head.nexts[0];
+  }
+}
+
+// Store the link built up from the last node at height.
+static void relayout_link(relayout *l, int height) {
+  rope_skip_node *dest = l->prevs[height] ? &l->prevs[height]->nexts[height]
+      : &l->head_links[height];
+#if ROPE_ANCHORS
+  rope_node *prev = dest->prev;
+  *dest = l->links[height];
+  dest->prev = prev;
+#else
+  *dest = l->links[height];
+#endif
+}
+
+// Link n in after the nodes added so far. content has the node's level 0 link, minus the pointer.
+static void relayout_add(relayout *l, rope_node *n, const rope_skip_node *content) {
+  for (int i = 0; i < ROPE_MAX_HEIGHT; i++) {
+    if (i < n->height) {
+      l->links[i].node = n;
+      relayout_link(l, i);
+      set_prev(n, i, l->prevs[i] ? l->prevs[i] : &l->r->head);
+      l->prevs[i] = n;
+      memset(&l->links[i], 0, sizeof(rope_skip_node));
+#if ROPE_HASH
+      l->links[i].hash_pow = 1;
+#endif
+    }
+    extend_link(&l->links[i], content);
+  }
+  l->max_height = MAX(l->max_height, n->height);
+
+  size_t end = l->pos + content->skip_size;
+#if ROPE_ANCHORS
+  for (rope_anchor **a = &l->pending; *a; ) {
+    rope_anchor *anchor = *a;
+    if (anchor->offset <= end) {
+      *a = anchor->next;
+      link_anchor(anchor, n, anchor->offset - l->pos);
+    } else {
+      a = &anchor->next;
+    }
+  }
+#endif
+  l->pos = end;
+}
+
+// Take the anchors out of an old node, which starts at pos.
+static void relayout_take_anchors(relayout *l, rope_node *n, size_t pos) {
+#if ROPE_ANCHORS
+  for (rope_anchor *a = n->anchors, *next; a != NULL; a = next) {
+    next = a->next;
+    a->offset += pos;
+    a->next = l->pending;
+    l->pending = a;
+  }
+  n->anchors = NULL;
+#endif
+}
+
+// Swap the new nodes in for the old ones.
+static void relayout_finish(relayout *l) {
+  rope *r = l->r;
+  uint8_t height = l->max_height + 1;
+  for (int i = 0; i < height; i++) {
+    l->links[i].node = NULL;
+    relayout_link(l, i);
+  }
+
+  // Concurrent readers may be partway through the old nodes, which stay valid until they're
+  // reclaimed. They'll retry after seeing the mix of old and new links.
+  for (int i = 0; i < height; i++) {
+    rope_skip_node *link = &r->head.nexts[i];
+    STORE_RELAXED(link->skip_size, l->head_links[i].skip_size);
+#if ROPE_WCHAR
+    link->wchar_size = l->head_links[i].wchar_size;
+#endif
+#if ROPE_HASH
+    link->hash = l->head_links[i].hash;
+    link->hash_pow = l->head_links[i].hash_pow;
+#endif
+    PUBLISH(link->node, l->head_links[i].node);
+  }
+  PUBLISH(r->head.height, height);
+}
+
+// Add a node holding a copy of the num_bytes of utf8 at str. When compressing, the copy is
+// compressed if that makes it at least an eighth smaller.
+static void relayout_add_copy(relayout *l, const uint8_t *str, size_t num_bytes) {
+  rope *r = l->r;
+  rope_skip_node content;
+  memset(&content, 0, sizeof(content));
+  for (size_t i = 0; i < num_bytes; i++) {
+    content.skip_size += (str[i] & 0xc0) != 0x80;
+  }
+#if ROPE_WCHAR
+  content.wchar_size = count_wchars_in_utf8(str, content.skip_size);
+#endif
+#if ROPE_HASH
+  content.hash = hash_utf8(str, content.skip_size, &content.hash_pow);
+#endif
+
+  rope_node *n = NULL;
+#if ROPE_COMPRESS
+  size_t packed_size = l->packed ? pack_block(str, num_bytes, l->packed, num_bytes * 7 / 8) : 0;
+  if (packed_size) {
+    n = alloc_node(r, random_height(r), 0);
+    n->str = alloc_buffer(r, packed_size);
+    memcpy(n->str, l->packed, packed_size);
+    n->capacity = (uint32_t)packed_size;
+    n->flags = ROPE_NODE_COMPRESSED | ROPE_NODE_GROWN;
+    r->num_compressed++;
+  }
+#endif
+  if (n == NULL) {
+    n = alloc_node(r, random_height(r), MAX(num_bytes, NODE_STR_SIZE(r)));
+    memcpy(n->str, str, num_bytes);
+  }
+  n->num_bytes = (uint32_t)num_bytes;
+  relayout_add(l, n, &content);
+}
+
+// Lay the rope out again, as rope_relayout does. If compress is set, the repacked nodes are
+// compressed too.
+static void relayout_rope(rope *r, bool repack, bool compress) {
+  assert(r);
+  begin_write(r);
+  r->tail_valid = 0;
+
+  rope_node *old_nodes = r->head.nexts[0].node;
+#if ROPE_ARENA
+  rope_arena *old_arena = r->arena;
+  if (old_arena) {
+    r->arena = new_arena(r);
+    if (r->head.flags & ROPE_NODE_GROWN) {
+      uint8_t *str = (uint8_t *)arena_alloc(r, r->head.capacity);
+      memcpy(str, r->head.str, r->head.num_bytes);
+      r->head.str = str;
+    }
+  }
+#endif
+
+  relayout l;
+  relayout_start(&l, r);
+#if ROPE_COMPRESS
+  // Compressed nodes are counted again as they're added.
+  r->num_compressed = 0;
+  l.packed = compress ? (uint8_t *)r->alloc(NODE_MAX_SIZE(r)) : NULL;
+#endif
 
+  // When repacking, characters are gathered up here until there are enough to fill a node.
+  uint8_t *buffer = repack ? (uint8_t *)r->alloc(NODE_MAX_SIZE(r)) : NULL;
+  size_t buffered = 0;
+
+  size_t pos = l.pos;
+  for (rope_node *n = old_nodes; n != NULL; n = n->nexts[0].node) {
+    relayout_take_anchors(&l, n, pos);
+    pos += n->nexts[0].skip_size;
+
+    if (repack && !is_external(n) && !is_compressed(n)) {
+      const uint8_t *str = n->str;
+      size_t left = n->num_bytes;
+      while (left) {
+        size_t num = MIN(left, NODE_MAX_SIZE(r) - buffered);
+        // Don't split a character between nodes.
+        while (num < left && num && (str[num] & 0xc0) == 0x80) num--;
+        memcpy(&buffer[buffered], str, num);
+        buffered += num;
+        str += num;
+        left -= num;
+        if (left) {
+          relayout_add_copy(&l, buffer, buffered);
+          buffered = 0;
+        }
+      }
+      continue;
+    }
+
+    if (buffered) {
+      relayout_add_copy(&l, buffer, buffered);
+      buffered = 0;
+    }
+    rope_node *n2;
+    if (is_external(n)) {
+      n2 = alloc_node(r, n->height, 0);
+      n2->str = n->str;
+      n2->flags = ROPE_NODE_EXTERNAL;
+#if ROPE_COMPRESS
+    } else if (is_compressed(n)) {
+      n2 = copy_compressed(r, n, n->height);
+      r->num_compressed++;
+#endif
+    } else {
+      n2 = alloc_node(r, n->height, MAX(n->num_bytes, NODE_STR_SIZE(r)));
+      memcpy(n2->str, n->str, n->num_bytes);
+    }
+    n2->num_bytes = n->num_bytes;
+    relayout_add(&l, n2, &n->nexts[0]);
+  }
+  if (buffered) relayout_add_copy(&l, buffer, buffered);
+  if (buffer) r->free(buffer);
+#if ROPE_COMPRESS
+  if (l.packed) r->free(l.packed);
+#endif
+  relayout_finish(&l);
+
+#if ROPE_ARENA
+  if (old_arena) {
+    free_arena(r, old_arena);
+    old_nodes = NULL;
+  }
+#endif
+  for (rope_node *n = old_nodes, *next; n != NULL; n = next) {
+    next = n->nexts[0].node;
+    free_node(r, n);
+  }
+  end_write(r);
+}
+
+void rope_relayout(rope *r, int repack) {
+  relayout_rope(r, repack, false);
+}
+
+#if ROPE_COMPRESS
+void rope_compress(rope *r) {
+  relayout_rope(r, true, true);
 #ifdef DEBUG
   _rope_check(r);
 #endif
-  if (char_len_out) {
-    *char_len_out = char_length;
+}
+
+void rope_decompress(rope *r) {
+  assert(r);
+  for (rope_node *n = r->head.nexts[0].node; n != NULL && r->num_compressed; n = n->nexts[0].node) {
+    thaw(r, n);
   }
-  return char_pos;
+}
+#endif
+
+#if ROPE_STATS
+static rope_stats global_stats;
+
+void rope_get_stats(const rope *r, rope_stats *stats_out) {
+  assert(r);
+  *stats_out = r->stats;
+}
+
+// The stats are all counters, so they can be added up as an array of them.
+#define NUM_STATS (sizeof(rope_stats) / sizeof(uint64_t))
+
+void rope_reset_stats(rope *r) {
+  assert(r);
+  uint64_t *counts = (uint64_t *)&r->stats, *totals = (uint64_t *)&global_stats;
+  for (size_t i = 0; i < NUM_STATS; i++) {
+    __atomic_fetch_add(&totals[i], counts[i], __ATOMIC_RELAXED);
+  }
+  memset(&r->stats, 0, sizeof(rope_stats));
+}
+
+void rope_get_global_stats(rope_stats *stats_out) {
+  uint64_t *totals = (uint64_t *)&global_stats, *out = (uint64_t *)stats_out;
+  for (size_t i = 0; i < NUM_STATS; i++) {
+    out[i] = __atomic_load_n(&totals[i], __ATOMIC_RELAXED);
+  }
+}
+#endif
+
+#if ROPE_NODE_CACHE
+// Every block starts with a header, which says which cache it belongs to. Blocks too big to be
+// cached have no cache, and their header holds their size instead of their size class.
+typedef struct {
+  struct node_cache_t *cache;
+  size_t size_class;
+} block_header;
+
+// Size classes are multiples of 16 bytes, so blocks stay 16 byte aligned.
+#define CLASS_GRANULARITY 16
+#define NUM_CLASSES (ROPE_NODE_CACHE_MAX_SIZE / CLASS_GRANULARITY)
+// Blocks freed on another thread are sent back to their cache this many at a time.
+#define REMOTE_BATCH_SIZE 32
+
+// A free block. This overlays the block's memory after its header.
+typedef struct free_block_t {
+  struct free_block_t *next;
+} free_block;
+
+typedef struct node_cache_t {
+  free_block *free[NUM_CLASSES];
+  size_t free_bytes;
+
+  // Blocks freed by other threads, pushed a batch at a time. The owning thread takes them all when
+  // it runs out of free blocks.
+  free_block *remote;
+
+  // The batch being built up of blocks this thread has freed which belong to another cache.
+  struct node_cache_t *batch_cache;
+  free_block *batch_head, *batch_tail;
+  size_t batch_len;
+
+  // Caches whose thread has exited are kept in a list until another thread takes them over.
+  struct node_cache_t *next_idle;
+} node_cache;
+
+static __thread node_cache *thread_cache;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static pthread_mutex_t idle_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static node_cache *idle_caches;
+
+static inline block_header *header_of(void *ptr) {
+  return (block_header *)ptr - 1;
+}
+
+static inline size_t class_size(size_t size_class) {
+  return (size_class + 1) * CLASS_GRANULARITY;
+}
+
+static void flush_batch(node_cache *c) {
+  if (c->batch_len == 0) return;
+  node_cache *owner = c->batch_cache;
+  free_block *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+  do {
+    c->batch_tail->next = head;
+  } while (!__atomic_compare_exchange_n(&owner->remote, &head, c->batch_head, true,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  c->batch_head = c->batch_tail = NULL;
+  c->batch_len = 0;
+}
+
+static void cache_thread_exit(void *ptr) {
+  node_cache *c = (node_cache *)ptr;
+  flush_batch(c);
+  // Anything freed by later destructors on this thread gets a fresh cache.
+  thread_cache = NULL;
+  pthread_mutex_lock(&idle_caches_lock);
+  c->next_idle = idle_caches;
+  idle_caches = c;
+  pthread_mutex_unlock(&idle_caches_lock);
+}
+
+static void make_cache_key() {
+  pthread_key_create(&cache_key, cache_thread_exit);
+}
+
+static node_cache *get_cache() {
+  node_cache *c = thread_cache;
+  if (c) return c;
+
+  pthread_once(&cache_key_once, make_cache_key);
+  pthread_mutex_lock(&idle_caches_lock);
+  c = idle_caches;
+  if (c) idle_caches = c->next_idle;
+  pthread_mutex_unlock(&idle_caches_lock);
+  if (c == NULL) {
+    c = (node_cache *)calloc(1, sizeof(node_cache));
+    assert(c);
+  }
+  pthread_setspecific(cache_key, c);
+  return thread_cache = c;
+}
+
+// Put a block in the cache's free list, or give it back to malloc if the cache is full.
+static void cache_block(node_cache *c, free_block *b) {
+  size_t size_class = header_of(b)->size_class;
+  if (c->free_bytes + class_size(size_class) > ROPE_NODE_CACHE_BYTES) {
+    free(header_of(b));
+    return;
+  }
+  b->next = c->free[size_class];
+  c->free[size_class] = b;
+  c->free_bytes += class_size(size_class);
+}
+
+// Take back the blocks other threads have freed.
+static void take_remote(node_cache *c) {
+  free_block *b = __atomic_exchange_n(&c->remote, NULL, __ATOMIC_ACQUIRE);
+  while (b) {
+    free_block *next = b->next;
+    cache_block(c, b);
+    b = next;
+  }
+}
+
+void *rope_cache_alloc(size_t size) {
+  if (size > ROPE_NODE_CACHE_MAX_SIZE) {
+    block_header *h = (block_header *)malloc(sizeof(block_header) + size);
+    if (h == NULL) return NULL;
+    h->cache = NULL;
+    h->size_class = size;
+    return h + 1;
+  }
+
+  size_t size_class = size ? (size - 1) / CLASS_GRANULARITY : 0;
+  node_cache *c = get_cache();
+  if (c->free[size_class] == NULL && c->remote) take_remote(c);
+
+  free_block *b = c->free[size_class];
+  if (b) {
+    c->free[size_class] = b->next;
+    c->free_bytes -= class_size(size_class);
+    return b;
+  }
+
+  block_header *h = (block_header *)malloc(sizeof(block_header) + class_size(size_class));
+  if (h == NULL) return NULL;
+  h->cache = c;
+  h->size_class = size_class;
+  return h + 1;
+}
+
+void rope_cache_free(void *ptr) {
+  if (ptr == NULL) return;
+  block_header *h = header_of(ptr);
+  if (h->cache == NULL) {
+    free(h);
+    return;
+  }
+
+  node_cache *c = get_cache();
+  if (h->cache == c) {
+    cache_block(c, (free_block *)ptr);
+    return;
+  }
+
+  // The block belongs to another thread's cache. Add it to the batch going back there.
+  if (c->batch_cache != h->cache) {
+    flush_batch(c);
+    c->batch_cache = h->cache;
+  }
+  free_block *b = (free_block *)ptr;
+  b->next = c->batch_head;
+  c->batch_head = b;
+  if (c->batch_tail == NULL) c->batch_tail = b;
+  if (++c->batch_len == REMOTE_BATCH_SIZE) flush_batch(c);
+}
+
+void *rope_cache_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) return rope_cache_alloc(size);
+  block_header *h = header_of(ptr);
+  if (h->cache == NULL) {
+    // Uncached blocks stay uncached, and can be realloc'ed in place.
+    h = (block_header *)realloc(h, sizeof(block_header) + size);
+    if (h == NULL) return NULL;
+    h->size_class = size;
+    return h + 1;
+  }
+
+  size_t old_size = class_size(h->size_class);
+  if (size <= old_size) return ptr;
+  void *new_ptr = rope_cache_alloc(size);
+  if (new_ptr == NULL) return NULL;
+  memcpy(new_ptr, ptr, old_size);
+  rope_cache_free(ptr);
+  return new_ptr;
+}
+
+void rope_cache_trim() {
+  node_cache *c = get_cache();
+  flush_batch(c);
+  take_remote(c);
+  for (size_t i = 0; i < NUM_CLASSES; i++) {
+    while (c->free[i]) {
+      free_block *b = c->free[i];
+      c->free[i] = b->next;
+      free(header_of(b));
+    }
+  }
+  c->free_bytes = 0;
 }
 #endif
 
@@ -759,6 +4045,9 @@ void _rope_check(rope *r) {
 #if ROPE_WCHAR
   size_t num_wchar = 0;
 #endif
+#if ROPE_COMPRESS
+  size_t num_compressed = 0;
+#endif
 
   // The offsets here are used to store the total distance travelled from the start
   // of the rope.
@@ -766,17 +4055,68 @@ void _rope_check(rope *r) {
   for (int i = 0; i < r->head.height; i++) {
     iter.s[i].node = &r->head;
   }
+#if ROPE_ANCHORS
+  // The last node seen at each height.
+  rope_node *prevs[ROPE_MAX_HEIGHT];
+  for (int i = 0; i < r->head.height; i++) {
+    prevs[i] = &r->head;
+  }
+#endif
 
   for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
     assert(n == &r->head || n->num_bytes);
     assert(n->height <= ROPE_MAX_HEIGHT);
-    assert(count_bytes_in_utf8(n->str, n->nexts[0].skip_size) == n->num_bytes);
+    const uint8_t *str = n->str;
+    if (is_external(n)) {
+      assert(n != &r->head);
+#if ROPE_COMPRESS
+    } else if (is_compressed(n)) {
+      // Check the text it unpacks to, without thawing it.
+      assert(n != &r->head && (n->flags & ROPE_NODE_GROWN));
+      assert(n->capacity < n->num_bytes && n->num_bytes <= NODE_MAX_SIZE(r));
+      uint8_t *unpacked = (uint8_t *)r->alloc(n->num_bytes);
+      copy_node_text(unpacked, n);
+      str = unpacked;
+      num_compressed++;
+#endif
+    } else {
+      assert(n->num_bytes <= n->capacity);
+      assert(n->capacity <= NODE_MAX_SIZE(r));
+      assert((n->flags & ROPE_NODE_GROWN) || n->str == (n == &r->head
+          ? (uint8_t *)&n->nexts[ROPE_MAX_HEIGHT] : (uint8_t *)&n->nexts[n->height]));
+    }
+    assert(count_bytes_in_utf8(str, n->nexts[0].skip_size) == n->num_bytes);
 #if ROPE_WCHAR
-    assert(count_wchars_in_utf8(n->str, n->nexts[0].skip_size) == n->nexts[0].wchar_size);
+    assert(count_wchars_in_utf8(str, n->nexts[0].skip_size) == n->nexts[0].wchar_size);
+#endif
+#if ROPE_HASH
+    uint64_t pow;
+    assert(hash_utf8(str, n->nexts[0].skip_size, &pow) == n->nexts[0].hash);
+    assert(pow == n->nexts[0].hash_pow);
+    for (int i = 1; i < n->height; i++) {
+      rope_skip_node link = n->nexts[i];
+      rehash_link(n, i);
+      assert(link.hash == n->nexts[i].hash && link.hash_pow == n->nexts[i].hash_pow);
+    }
+#endif
+    if (str != n->str) r->free((void *)str);
+#if ROPE_ANCHORS
+    for (int i = 0; n != &r->head && i < n->height; i++) {
+      assert(n->nexts[i].prev == prevs[i]);
+      prevs[i] = n;
+    }
+    for (rope_anchor *a = n->anchors; a != NULL; a = a->next) {
+      assert(a->node == n);
+      assert(a->prev ? a->prev->next == a : n->anchors == a);
+      assert(a->offset <= n->nexts[0].skip_size);
+      assert(a->offset || n == &r->head);
+    }
 #endif
     for (int i = 0; i < n->height; i++) {
       assert(iter.s[i].node == n);
       assert(iter.s[i].skip_size == num_chars);
+      // The saved tail is the last node at each height.
+      assert(!r->tail_valid || (n->nexts[i].node == NULL) == (r->tail[i] == n));
       iter.s[i].node = n->nexts[i].node;
       iter.s[i].skip_size += n->nexts[i].skip_size;
 #if ROPE_WCHAR
@@ -805,6 +4145,9 @@ void _rope_check(rope *r) {
 #if ROPE_WCHAR
   assert(skip_over.wchar_size == num_wchar);
 #endif
+#if ROPE_COMPRESS
+  assert(r->num_compressed == num_compressed);
+#endif
 }
 
 // For debugging.
@@ -824,6 +4167,10 @@ void _rope_print(rope *r) {
     for (int i = 0; i < n->height; i++) {
       printf(" |%3zd ", n->nexts[i].skip_size);
     }
+    if (is_compressed(n)) {
+      printf("        : (%u bytes compressed)\n", n->capacity);
+      continue;
+    }
     printf("        : \"");
     fwrite(n->str, n->num_bytes, 1, stdout);
     printf("\"\n");
@@ -4,9 +4,14 @@
  * insert-at-position and delete-at-position operations.
  * 
  * It uses skip lists instead of trees. Trees might be faster - who knows?
+ * Compile rope_btree.c with -DROPE_BTREE=1 instead of rope.c to find out. The
+ * B+-tree only implements the core API (creating, copying, editing and reading
+ * out ropes, and the wchar functions). Everything declared below under
+ * !ROPE_BTREE is only implemented by the skip list.
  *
  * Ropes are not syncronized. Do not access the same rope from multiple threads
- * simultaneously.
+ * simultaneously - unless you compile with ROPE_CONCURRENT and use the
+ * rope_reader API to read from other threads.
  */
 
 #ifndef librope_rope_h
@@ -15,6 +20,11 @@
 #include <stdint.h>
 #include <stddef.h>
 
+// For struct iovec.
+#if ROPE_FILE_IO && !ROPE_BTREE
+#include <sys/uio.h>
+#endif
+
 // Whether or not the rope should support converting UTF-8 character offsets to
 // wchar array positions. This is useful when interoperating with strings in
 // JS, Objective-C and many other languages. See
@@ -25,11 +35,19 @@
 #define ROPE_WCHAR 0
 #endif
 
+// Use the B+-tree implementation of the rope API in rope_btree.c instead of
+// the skip list in rope.c. The two files are alternatives - build one or the
+// other.
+#ifndef ROPE_BTREE
+#define ROPE_BTREE 0
+#endif
+
 // These two magic values seem to be approximately optimal given the benchmark
 // in tests.c which does lots of small inserts.
 
-// Must be <= UINT16_MAX. Benchmarking says this is pretty close to optimal
-// (tested on a mac using clang 4.0 and x86_64).
+// The capacity of a normal node, and the largest size edits in the middle of
+// a node will grow it to. Benchmarking says this is pretty close to optimal
+// for small random edits (tested on a mac using clang 4.0 and x86_64).
 #ifndef ROPE_NODE_STR_SIZE
 #if ROPE_WCHAR
 #define ROPE_NODE_STR_SIZE 64
@@ -38,6 +56,14 @@
 #endif
 #endif
 
+// Nodes are allocated with only the bytes they need. Large inserts and
+// appends to the end of a node can make nodes up to this big, so bulk text
+// uses a fraction of the nodes. Must be >= ROPE_NODE_STR_SIZE and
+// <= UINT32_MAX.
+#ifndef ROPE_NODE_MAX_SIZE
+#define ROPE_NODE_MAX_SIZE 1024
+#endif
+
 // The likelyhood (%) a node will have height (n+1) instead of n
 #ifndef ROPE_BIAS
 #define ROPE_BIAS 25
@@ -49,6 +75,204 @@
 #define ROPE_MAX_HEIGHT 60
 #endif
 
+// The maximum number of bytes of caller-owned memory referenced by a single
+// external node (see rope_insert_external). Must be <= UINT32_MAX.
+#ifndef ROPE_EXTERNAL_SPAN_SIZE
+#define ROPE_EXTERNAL_SPAN_SIZE 32768
+#endif
+
+// Allow one thread to edit a rope while other threads read it through
+// rope_readers, without locks. Readers copy out consistent snapshots and retry
+// if the writer got in the way, and memory the writer unlinks from the rope is
+// only freed once no reader could still be looking at it. Skip list only.
+// Needs GCC or clang atomics.
+#ifndef ROPE_CONCURRENT
+#define ROPE_CONCURRENT 0
+#endif
+
+// The maximum number of rope_readers registered with a rope at once.
+#ifndef ROPE_MAX_READERS
+#define ROPE_MAX_READERS 64
+#endif
+
+// Build rope_write_cstr_parallel, which copies big ropes out using several
+// threads. Needs pthreads. Skip list only.
+#ifndef ROPE_PARALLEL
+#define ROPE_PARALLEL 0
+#endif
+
+// rope_write_cstr_parallel gives each thread at least this many bytes to copy.
+// Ropes smaller than twice this are just copied on the calling thread.
+#ifndef ROPE_PARALLEL_MIN_BYTES
+#define ROPE_PARALLEL_MIN_BYTES (1024 * 1024)
+#endif
+
+// Keep a hash of every node's contents, combined up the skip list like
+// skip_size, so rope_hash and rope_range_hash are cheap. Edited nodes are
+// rehashed on every change. Skip list only.
+#ifndef ROPE_HASH
+#define ROPE_HASH 0
+#endif
+
+// Support rope_anchors - positions which move with the text around them as
+// the rope is edited. Anchors live in the node they point into, so edits only
+// touch the anchors in the nodes they change. Adds a back pointer to every skip
+// list link, which is used to find a node's position. Skip list only.
+#ifndef ROPE_ANCHORS
+#define ROPE_ANCHORS 0
+#endif
+
+// Count what the rope's hot paths do (see rope_stats) so slow workloads can be
+// explained. Costs a few increments per edit when enabled. Skip list only.
+#ifndef ROPE_STATS
+#define ROPE_STATS 0
+#endif
+
+// Fire USDT (static tracepoint) probes from the same places ROPE_STATS counts,
+// for perf and bpftrace. The probes are in the librope provider and named
+// after the rope_stats fields, with the amount as their argument. Needs
+// <sys/sdt.h> from systemtap. Skip list only.
+#ifndef ROPE_USDT
+#define ROPE_USDT 0
+#endif
+
+// Prefetch the skip list links the next step of a search could read while the
+// current one is compared, so searches in ropes too big for the cache wait on
+// fewer misses one after another. Only does anything with GCC or clang.
+#ifndef ROPE_PREFETCH
+#define ROPE_PREFETCH 1
+#endif
+
+// Let each rope pick its own node sizes and skip list bias through
+// rope_new_with_config, instead of sharing ROPE_NODE_STR_SIZE,
+// ROPE_NODE_MAX_SIZE and ROPE_BIAS. Edits read them out of the rope rather
+// than using constants. Skip list only.
+#ifndef ROPE_CONFIG
+#define ROPE_CONFIG 0
+#endif
+
+// Build rope_cache_alloc, rope_cache_realloc and rope_cache_free, allocators
+// for rope_new2 which keep freed blocks in per thread free lists shared by all
+// the ropes on a thread. Needs pthreads, and GCC or clang atomics and __thread.
+// Skip list only.
+#ifndef ROPE_NODE_CACHE
+#define ROPE_NODE_CACHE 0
+#endif
+
+// Blocks bigger than this go straight to malloc instead of being cached.
+#ifndef ROPE_NODE_CACHE_MAX_SIZE
+#define ROPE_NODE_CACHE_MAX_SIZE 2048
+#endif
+
+// The most bytes of free blocks a thread's cache holds on to. Blocks freed
+// past this are given back to malloc.
+#ifndef ROPE_NODE_CACHE_BYTES
+#define ROPE_NODE_CACHE_BYTES (1024 * 1024)
+#endif
+
+// Build rope_new_arena, which makes ropes whose nodes are carved out of a few
+// big chunks of memory owned by the rope. Freeing the rope frees the chunks
+// rather than every node. Can't be used with ROPE_CONCURRENT, which needs
+// nodes to outlive their rope's edits. Skip list only.
+#ifndef ROPE_ARENA
+#define ROPE_ARENA 0
+#endif
+
+#if ROPE_ARENA && ROPE_CONCURRENT
+#error "ROPE_ARENA can't be used with ROPE_CONCURRENT"
+#endif
+
+// Build rope_read_fd and rope_load_file, which read files straight into the
+// rope's nodes, and rope_to_iovec and rope_write_fd, which write them out
+// without copying them. Needs POSIX readv and writev. Skip list only.
+#ifndef ROPE_FILE_IO
+#define ROPE_FILE_IO 0
+#endif
+
+// Build rope_compress, which packs an idle rope's text into compressed blocks
+// that are unpacked again one at a time as they're read or edited. Skip list
+// only.
+#ifndef ROPE_COMPRESS
+#define ROPE_COMPRESS 0
+#endif
+
+#if ROPE_COMPRESS && ROPE_CONCURRENT && !ROPE_BTREE
+#error "ROPE_COMPRESS can't be used with ROPE_CONCURRENT"
+#endif
+
+// The maximum number of children of an internal B+-tree node. Only used when
+// ROPE_BTREE is set.
+#ifndef ROPE_BTREE_FANOUT
+#define ROPE_BTREE_FANOUT 32
+#endif
+
+// Values for rope_node.flags.
+enum {
+  // The node's str points into memory owned by the caller instead of at its
+  // own data buffer. The rope never writes to or frees that memory - edits
+  // split the span and put new text in ordinary nodes.
+  ROPE_NODE_EXTERNAL = 1,
+
+  // The node outgrew the buffer it was allocated with. str was allocated
+  // separately using the rope's allocator.
+  ROPE_NODE_GROWN = 2,
+
+  // str holds the node's num_bytes of text compressed, in a separate buffer
+  // of capacity bytes (so the node is also ROPE_NODE_GROWN). It's
+  // decompressed before anything reads or edits its text.
+  ROPE_NODE_COMPRESSED = 4,
+};
+
+#if ROPE_BTREE
+
+// In the B+-tree, rope_nodes are the leaves. The internal nodes are private to
+// rope_btree.c.
+typedef struct rope_node_t {
+  // The node's utf8 content. Normally this points at the node's own buffer,
+  // which is allocated directly after the node.
+  uint8_t *str;
+
+  // The number of bytes in str in use
+  uint32_t num_bytes;
+
+  // The number of bytes str has room for.
+  uint32_t capacity;
+
+  // ROPE_NODE_* flags.
+  uint8_t flags;
+
+  // The number of characters in str.
+  size_t num_chars;
+#if ROPE_WCHAR
+  size_t num_wchars;
+#endif
+
+  // The leaves form a doubly linked list in document order.
+  struct rope_node_t *prev, *next;
+} rope_node;
+
+typedef struct {
+  // The total number of characters in the rope.
+  size_t num_chars;
+
+  // The total number of bytes which the characters in the rope take up.
+  size_t num_bytes;
+
+  void *(*alloc)(size_t bytes);
+  void *(*realloc)(void *ptr, size_t newsize);
+  void (*free)(void *ptr);
+
+  // The number of levels of internal nodes. When this is 0, root is a leaf.
+  uint8_t height;
+  void *root;
+
+  // The leftmost leaf. A rope always has at least one leaf, even when its
+  // empty.
+  rope_node *first;
+} rope;
+
+#else
+
 struct rope_node_t;
 
 // The number of characters in str can be read out of nexts[0].skip_size.
@@ -65,21 +289,91 @@ typedef struct {
   // The number of wide characters contained in space.
   size_t wchar_size;
 #endif
+
+#if ROPE_HASH
+  // The hash of the characters between the start of the current node and the
+  // start of next, and HASH_BASE ^ skip_size for combining it with others.
+  uint64_t hash;
+  uint64_t hash_pow;
+#endif
+
+#if ROPE_ANCHORS
+  // The previous node which is at least this tall. Unused in the head.
+  struct rope_node_t *prev;
+#endif
 } rope_skip_node;
 
 typedef struct rope_node_t {
-  uint8_t str[ROPE_NODE_STR_SIZE];
+  // The node's utf8 content. Normally this points at the node's own buffer,
+  // which is allocated directly after nexts.
+  uint8_t *str;
 
   // The number of bytes in str in use
-  uint16_t num_bytes;
+  uint32_t num_bytes;
+
+  // The number of bytes str has room for.
+  uint32_t capacity;
   
   // This is the number of elements allocated in nexts.
   // Each height is 1/2 as likely as the height before. The minimum height is 1.
   uint8_t height;
+
+  // ROPE_NODE_* flags.
+  uint8_t flags;
+
+#if ROPE_ARENA
+  // The number of bytes allocated for the node, for giving it back to the
+  // rope's arena.
+  uint32_t alloc_size;
+#endif
+
+#if ROPE_ANCHORS
+  // The anchors pointing into this node, in no particular order.
+  struct rope_anchor_t *anchors;
+#endif
   
   rope_skip_node nexts[];
 } rope_node;
 
+#if ROPE_STATS
+// Event counts from a rope's hot paths.
+typedef struct {
+  // Searches for a position, and how many steps along the skip list they took.
+  uint64_t descents;
+  uint64_t descent_steps;
+
+  // Inserts which fit into an existing node, and ones which added nodes.
+  uint64_t inserts_in_place;
+  uint64_t inserts_split;
+
+  // Bytes shifted along inside nodes by inserts and deletes.
+  uint64_t bytes_moved;
+
+  uint64_t nodes_allocated;
+  uint64_t nodes_freed;
+  // Nodes which outgrew their buffer and were given a bigger one.
+  uint64_t nodes_grown;
+
+  // Compressed nodes which were decompressed because something touched them.
+  uint64_t nodes_thawed;
+} rope_stats;
+#endif
+
+#if ROPE_CONFIG
+// Tuning for a single rope. Fields left as 0 get the compiled in default.
+typedef struct {
+  // The capacity of a normal node. See ROPE_NODE_STR_SIZE.
+  uint32_t node_str_size;
+
+  // The biggest a node can get. See ROPE_NODE_MAX_SIZE. Defaults to the
+  // bigger of ROPE_NODE_MAX_SIZE and node_str_size.
+  uint32_t node_max_size;
+
+  // The likelyhood (%) a node will have height (n+1) instead of n. 1-99.
+  uint8_t bias;
+} rope_config;
+#endif
+
 typedef struct {
   // The total number of characters in the rope.
   size_t num_chars;
@@ -91,10 +385,51 @@ typedef struct {
   void *(*realloc)(void *ptr, size_t newsize);
   void (*free)(void *ptr);
 
+#if ROPE_CONFIG
+  rope_config config;
+#endif
+
+#if ROPE_ARENA
+  // Where the rope's nodes come from, or NULL if they're allocated one by one.
+  struct rope_arena_t *arena;
+#endif
+
+#if ROPE_CONCURRENT
+  // Incremented before and after every edit, so its odd while the rope is
+  // being modified.
+  uint64_t seq;
+
+  // Epoch based reclamation. Each active reader publishes the epoch it saw
+  // when it started reading (or 0). Memory retired by the writer in epoch e
+  // is freed once the global epoch reaches e + 2.
+  uint64_t epoch;
+  uint64_t reader_epochs[ROPE_MAX_READERS];
+  uint8_t reader_used[ROPE_MAX_READERS];
+  struct rope_retired_t *retired;
+#endif
+
+#if ROPE_STATS
+  rope_stats stats;
+#endif
+
+#if ROPE_COMPRESS
+  // The number of ROPE_NODE_COMPRESSED nodes. Reads of the whole rope check
+  // it to skip looking for nodes to decompress.
+  size_t num_compressed;
+#endif
+
+  // The last node at each height, which rope_append adds to without searching
+  // for the end of the rope. Allocated by the first append, and only valid
+  // while tail_valid is set - every other edit clears it.
+  rope_node **tail;
+  uint8_t tail_valid;
+
   // The first node exists inline in the rope structure itself.
   rope_node head;
 } rope;
 
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -107,10 +442,43 @@ rope *rope_new2(void *(*alloc)(size_t bytes),
     void *(*realloc)(void *ptr, size_t newsize),
     void (*free)(void *ptr));
 
+#if ROPE_ARENA && !ROPE_BTREE
+// Create a new rope whose nodes are allocated out of chunks of memory it owns.
+// Nodes freed by edits are reused by later edits, and rope_free frees the
+// chunks in one go instead of walking the rope. Copies of the rope use an
+// arena too. Good for big ropes, since nodes made together end up together in
+// memory. rope_new_arena2 gets the chunks from custom allocators.
+rope *rope_new_arena();
+rope *rope_new_arena2(void *(*alloc)(size_t bytes),
+    void *(*realloc)(void *ptr, size_t newsize),
+    void (*free)(void *ptr));
+#endif
+
+#if ROPE_CONFIG && !ROPE_BTREE
+// Create a new rope with its own node sizes and skip list bias. Small nodes
+// and a low bias suit lots of small ropes, big nodes suit big mostly appended
+// ones. Returns NULL if the config is invalid: node_str_size must be at least
+// 4 bytes and no bigger than node_max_size, and bias must be below 100.
+// rope_new_with_config2 also takes custom allocators, like rope_new2.
+rope *rope_new_with_config(const rope_config *config);
+rope *rope_new_with_config2(const rope_config *config,
+    void *(*alloc)(size_t bytes),
+    void *(*realloc)(void *ptr, size_t newsize),
+    void (*free)(void *ptr));
+#endif
+
 // Create a new rope containing a copy of the given string. Shorthand for
 // r = rope_new(); rope_insert(r, 0, str);
 rope *rope_new_with_utf8(const uint8_t *str);
 
+// Create a new rope which refers to the len bytes at str without copying them.
+// This is useful for loading huge, mostly read-only documents (eg from an
+// mmap'ed file). str doesn't need to be null terminated, but it must be valid
+// utf8 and it must not be modified or freed until the rope has been freed.
+// Returns NULL if str isn't valid utf8. Shorthand for
+// r = rope_new(); rope_insert_external(r, 0, str, len);
+rope *rope_new_with_external(const uint8_t *str, size_t len);
+
 // Make a copy of an existing rope
 rope *rope_copy(const rope *r);
 
@@ -134,13 +502,214 @@ size_t rope_write_cstr(rope *r, uint8_t *dest);
 // Use rope_byte_count(r) to get the length of the returned string.
 uint8_t *rope_create_cstr(rope *r);
 
+#if !ROPE_BTREE
+// Find every place the utf8 string needle appears in the rope, including
+// overlapping matches. Returns the number of matches and sets *matches_out to
+// an array of their character positions, in order. The array is allocated with
+// the rope's allocator, or NULL if there are no matches.
+size_t rope_find_all(rope *r, const uint8_t *needle, size_t **matches_out);
+
+// Get the number of utf16 code units needed to hold the rope. With ROPE_WCHAR
+// this is rope_wchar_count(r), otherwise the rope is scanned to count them.
+size_t rope_utf16_count(rope *r);
+
+// Copies the rope's contents into dest as utf16, followed by a trailing 0.
+// Returns the number of code units written, which is rope_utf16_count(r) + 1.
+size_t rope_write_utf16(rope *r, uint16_t *dest);
+
+// Copies num characters starting at character pos into dest as utf16, without
+// a trailing 0. dest needs room for 2 * num code units. The range is clamped to
+// the end of the rope. Returns the number of code units written.
+size_t rope_write_utf16_range(rope *r, size_t pos, size_t num, uint16_t *dest);
+
+// Create a new utf16 string, allocated with the rope's allocator, which
+// contains the rope followed by a trailing 0. If len_out isn't NULL, its set to
+// the string's length in code units.
+uint16_t *rope_create_utf16(rope *r, size_t *len_out);
+#endif
+
+#if !ROPE_BTREE
+// Reallocate the rope's nodes one after another in document order, so walking
+// the rope reads memory in order. If repack is set, the text is also packed
+// into as few nodes as possible (which makes edits in the middle of them slower
+// until they're split up again). The rope's contents, anchors and positions
+// don't change. This touches every node, so it's best done when the rope is
+// idle. Arena ropes get a new arena, which leaves the nodes contiguous. Nodes
+// compressed by rope_compress stay compressed.
+void rope_relayout(rope *r, int repack);
+#endif
+
+#if ROPE_COMPRESS && !ROPE_BTREE
+// Repack the rope like rope_relayout(r, 1), compressing each full node's text
+// on the way. Nodes are decompressed again one at a time, the first time
+// anything searches into them or reads them - so a rope whose edits all land
+// in one place only decompresses the nodes around it. Functions which read the
+// whole rope (rope_find_all, rope_diff, the utf16 functions and ROPE_FOREACH)
+// decompress all of it first. rope_write_cstr decompresses straight into its
+// destination, and the comparisons read compressed nodes through a scratch
+// buffer, so neither changes the rope. Character and wchar counts stay
+// in the skip list, so navigating and deleting whole nodes doesn't decompress
+// anything. Call it on ropes which have gone idle.
+void rope_compress(rope *r);
+
+// Decompress every compressed node in the rope.
+void rope_decompress(rope *r);
+#endif
+
+#if !ROPE_BTREE
+// Get the unicode codepoint of the character at pos, or 0 if pos is past the
+// end of the rope.
+uint32_t rope_char_at(rope *r, size_t pos);
+
+// Convert between character and utf8 byte offsets. Positions past the end of
+// the rope are clamped, and byte offsets inside a character round down to it.
+// Byte offsets aren't indexed, so these walk the rope's nodes - convert many
+// positions at once with the batch functions below.
+size_t rope_char_to_byte(rope *r, size_t pos);
+size_t rope_byte_to_char(rope *r, size_t byte_pos);
+
+// Batch versions of rope_char_at, rope_char_to_byte and rope_byte_to_char,
+// which resolve num positions in one forward sweep through the rope. Positions
+// should be sorted - each one behind its predecessor restarts the sweep.
+// Results are written to the corresponding slot of the out array, which may
+// be the positions array itself.
+void rope_chars_at(rope *r, const size_t *positions, size_t num, uint32_t *chars_out);
+void rope_chars_to_bytes(rope *r, const size_t *positions, size_t num, size_t *bytes_out);
+void rope_bytes_to_chars(rope *r, const size_t *positions, size_t num, size_t *chars_out);
+#endif
+
+#if !ROPE_BTREE
+// Compare two ropes' contents, like memcmp. Returns a negative number, 0 or a
+// positive number if a sorts before, the same as or after b. utf8 byte order
+// is the same as codepoint order.
+int rope_compare(const rope *a, const rope *b);
+
+// Returns 1 if the ropes have the same contents, otherwise 0. Ropes with
+// different lengths (or hashes, with ROPE_HASH) are rejected without looking at
+// their contents.
+int rope_equal(const rope *a, const rope *b);
+
+// The same as rope_compare and rope_equal, but against len bytes of utf8.
+int rope_compare_buf(const rope *r, const uint8_t *buf, size_t len);
+int rope_equal_buf(const rope *r, const uint8_t *buf, size_t len);
+
+// One change found by rope_diff. It replaces del_chars characters at pos with
+// ins_chars characters, which are at pos in the new rope. Positions take the
+// earlier edits into account, so applying the edits in order with rope_del and
+// rope_insert turns the old rope into the new one.
+typedef struct {
+  size_t pos;
+  size_t del_chars;
+  size_t ins_chars;
+#if ROPE_WCHAR
+  // The same edit, measured in wchars.
+  size_t wchar_pos;
+  size_t del_wchars;
+  size_t ins_wchars;
+#endif
+} rope_diff_edit;
+
+// Find the changes which turn rope a into rope b. Returns the number of edits
+// and sets *edits_out to an array of them, in order, allocated with a's
+// allocator (or NULL if the ropes are equal). Small changed regions are diffed
+// character by character. Big ones are reported as a single replacement.
+size_t rope_diff(rope *a, rope *b, rope_diff_edit **edits_out);
+#endif
+
+#if ROPE_HASH && !ROPE_BTREE
+// A polynomial hash (mod 2^61 - 1) of the rope's characters. Ropes with the
+// same contents have the same hash, no matter how they were edited.
+uint64_t rope_hash(const rope *r);
+
+// The hash of num characters starting at pos. This is the same as rope_hash of
+// a rope containing just those characters. O(log n).
+uint64_t rope_range_hash(rope *r, size_t pos, size_t num);
+#endif
+
+#if ROPE_ANCHORS && !ROPE_BTREE
+// A character position which is kept up to date as the rope is edited, like a
+// cursor. Anchors inside deleted text move to the start of the deletion.
+typedef struct rope_anchor_t rope_anchor;
+
+// Where an anchor goes when text is inserted at its position. Left anchors
+// stay before the new text and right anchors move after it.
+typedef enum { ROPE_ANCHOR_LEFT, ROPE_ANCHOR_RIGHT } ROPE_ANCHOR_BIAS;
+
+// Create an anchor at the specified position. Any anchors which haven't been
+// freed are freed along with the rope. rope_copy doesn't copy anchors.
+rope_anchor *rope_anchor_new(rope *r, size_t pos, ROPE_ANCHOR_BIAS bias);
+
+// Move an anchor to a new position.
+void rope_anchor_set(rope *r, rope_anchor *anchor, size_t pos);
+
+// Get an anchor's current character position. O(log n).
+size_t rope_anchor_pos(rope *r, const rope_anchor *anchor);
+
+void rope_anchor_free(rope *r, rope_anchor *anchor);
+#endif
+
+#if ROPE_PARALLEL && !ROPE_BTREE
+// The same as rope_write_cstr, but splits big ropes into contiguous ranges and
+// copies them using up to num_threads threads. If num_threads is 0, one thread
+// is used per core.
+size_t rope_write_cstr_parallel(rope *r, uint8_t *dest, int num_threads);
+
+// The same as rope_find_all, but searches big ropes using up to num_threads
+// threads (or one per core if num_threads is 0).
+size_t rope_find_all_parallel(rope *r, const uint8_t *needle, size_t **matches_out,
+    int num_threads);
+#endif
+
 // If you try to insert data into the rope with an invalid UTF8 encoding,
-// nothing will happen and we'll return ROPE_INVALID_UTF8.
-typedef enum { ROPE_OK, ROPE_INVALID_UTF8 } ROPE_RESULT;
+// nothing will happen and we'll return ROPE_INVALID_UTF8. ROPE_IO_ERROR is
+// only returned by rope_read_fd and rope_write_fd.
+typedef enum { ROPE_OK, ROPE_INVALID_UTF8, ROPE_IO_ERROR } ROPE_RESULT;
   
 // Insert the given utf8 string into the rope at the specified position.
 ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str);
 
+// Insert the given utf8 string at the end of the rope. This is the same as
+// rope_insert(r, rope_char_count(r), str), except the skip list remembers
+// where its end is between appends, so a run of them doesn't search for it.
+ROPE_RESULT rope_append(rope *r, const uint8_t *str);
+
+#if ROPE_FILE_IO && !ROPE_BTREE
+// Append everything read from fd, up to the end of the file, to the rope. The
+// text is read straight into new nodes a batch at a time and checked as it
+// arrives, so the file is never held in memory outside the rope. Returns
+// ROPE_INVALID_UTF8 if it isn't valid utf8, or ROPE_IO_ERROR if a read fails
+// (with errno set by readv). Either way the rope is left as it was, but fd has
+// been read from. Ropes configured with a node_max_size under 10 can't be read
+// into, and get ROPE_IO_ERROR with errno set to EINVAL.
+ROPE_RESULT rope_read_fd(rope *r, int fd);
+
+// Create a new rope with the contents of the file at path. Returns NULL if the
+// file can't be read, with errno set, or if it isn't valid utf8 (errno is set
+// to EILSEQ).
+rope *rope_load_file(const char *path);
+
+// Point iov at the bytes of num characters starting at character pos, where
+// they sit in the rope's nodes. Fills at most max entries, and returns how
+// many it filled. If chars_out isn't NULL, it's set to the number of
+// characters they cover - when that's less than num, call again from there
+// for the rest. The range is clamped to the end of the rope. The entries are
+// only valid until the rope is next edited.
+size_t rope_to_iovec(rope *r, size_t pos, size_t num, struct iovec *iov, size_t max,
+    size_t *chars_out);
+
+// Write the rope's contents to fd with writev, straight from its nodes.
+// Returns ROPE_IO_ERROR if a write fails (with errno set by writev), in which
+// case some of the rope may have been written.
+ROPE_RESULT rope_write_fd(rope *r, int fd);
+#endif
+
+// Insert len bytes of utf8 at the specified position by reference, without
+// copying them into the rope. The same lifetime rules as
+// rope_new_with_external apply. Editing inside the referenced text only
+// copies the newly inserted characters - the external span is split around
+// them.
+ROPE_RESULT rope_insert_external(rope *r, size_t pos, const uint8_t *str, size_t len);
+
 // Delete num characters at position pos. Deleting past the end of the string
 // has no effect.
 void rope_del(rope *r, size_t pos, size_t num);
@@ -153,8 +722,18 @@ void rope_del(rope *r, size_t pos, size_t num);
 //  ROPE_FOREACH(r, iter) {
 //    printf("%s", rope_node_data(iter));
 //  }
+#if ROPE_BTREE
+#define ROPE_FOREACH(rope, iter) \
+  for (rope_node *iter = (rope)->first; iter != NULL; iter = iter->next)
+#elif ROPE_COMPRESS
+// Compressed nodes are decompressed before the first one is visited.
+#define ROPE_FOREACH(rope, iter) \
+  for (rope_node *iter = (rope_decompress(rope), &(rope)->head); iter != NULL; \
+      iter = iter->nexts[0].node)
+#else
 #define ROPE_FOREACH(rope, iter) \
   for (rope_node *iter = &(rope)->head; iter != NULL; iter = iter->nexts[0].node)
+#endif
 
 // Get the actual data inside a rope node.
 static inline uint8_t *rope_node_data(rope_node *n) {
@@ -169,7 +748,11 @@ static inline size_t rope_node_num_bytes(rope_node *n) {
 
 // Get the number of characters inside a rope node.
 static inline size_t rope_node_chars(rope_node *n) {
+#if ROPE_BTREE
+  return n->num_chars;
+#else
   return n->nexts[0].skip_size;
+#endif
 }
   
 #if ROPE_WCHAR
@@ -189,16 +772,96 @@ size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *utf8_str);
 // Returns the deletion position in characters. *char_len_out is set to the
 // deletion length, in chars if its not null.
 size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *char_len_out);
-  
+
+#if !ROPE_BTREE
+// Insert len code units of utf16 into the rope at the specified wchar
+// position. The text is transcoded straight into the rope, so callers with
+// utf16 strings don't need to convert them to utf8 first. Unpaired surrogates
+// and NULs are rejected with ROPE_INVALID_UTF8.
+ROPE_RESULT rope_insert_utf16(rope *r, size_t wchar_pos, const uint16_t *str, size_t len);
+
+// Convert between character and wchar offsets. Positions past the end of the
+// rope are clamped, and wchar offsets inside a surrogate pair round down.
+size_t rope_char_to_wchar(rope *r, size_t pos);
+size_t rope_wchar_to_char(rope *r, size_t wchar_pos);
+
+// Batch versions of the above, with the same rules as rope_chars_to_bytes.
+void rope_chars_to_wchars(rope *r, const size_t *positions, size_t num, size_t *wchars_out);
+void rope_wchars_to_chars(rope *r, const size_t *positions, size_t num, size_t *chars_out);
+#endif
+
 // Get the number of wchars inside a rope node. This is useful when you're
 // looping throuhg a rope.
 static inline size_t rope_node_wchars(rope_node *n) {
+#if ROPE_BTREE
+  return n->num_wchars;
+#else
   return n->nexts[0].wchar_size;
+#endif
 }
 #endif
 
 
   
+#if ROPE_CONCURRENT && !ROPE_BTREE
+// A handle for reading a rope from a thread other than the one editing it.
+// Each reading thread needs its own reader. Readers never block the writer.
+typedef struct rope_reader_t rope_reader;
+
+// Register a new reader. Returns NULL if ROPE_MAX_READERS readers are already
+// registered. Can be called from any thread.
+rope_reader *rope_reader_new(rope *r);
+
+// Unregister a reader. All readers must be freed before the rope.
+void rope_reader_free(rope_reader *reader);
+
+// Get the number of characters in the rope.
+size_t rope_reader_char_count(rope_reader *reader);
+
+// Copy up to num characters starting at pos into dest as utf8, without a
+// trailing '\0'. Copying stops early rather than split a character when
+// dest_size bytes are filled. The copied text is a consistent snapshot of the
+// rope at some point during the call.
+//
+// Returns the number of bytes written. If chars_out isn't NULL, its set to the
+// number of characters written.
+size_t rope_reader_read(rope_reader *reader, size_t pos, size_t num,
+    uint8_t *dest, size_t dest_size, size_t *chars_out);
+
+// Copy a consistent snapshot of the whole rope into a new C string, allocated
+// with the rope's allocator. If num_bytes_out isn't NULL, its set to the
+// string's length.
+uint8_t *rope_reader_create_cstr(rope_reader *reader, size_t *num_bytes_out);
+#endif
+
+#if ROPE_STATS && !ROPE_BTREE
+// Copy out the rope's counters. They're updated by the thread editing the rope.
+void rope_get_stats(const rope *r, rope_stats *stats_out);
+
+// Add the rope's counters to the global totals and zero them. Freeing a rope
+// does this too.
+void rope_reset_stats(rope *r);
+
+// Get the totals of every rope's counters, as of when they were last reset or
+// freed. Needs GCC or clang atomics.
+void rope_get_global_stats(rope_stats *stats_out);
+#endif
+
+#if ROPE_NODE_CACHE && !ROPE_BTREE
+// Allocators to pass to rope_new2. Freed blocks are kept in a free list on the
+// thread which allocated them, in size classes, so every rope using these on
+// a thread shares one pool of nodes. Blocks freed on another thread are queued
+// up and handed back to their thread in batches. A thread's cache is taken
+// over by the next thread to start after it exits.
+void *rope_cache_alloc(size_t size);
+void *rope_cache_realloc(void *ptr, size_t size);
+void rope_cache_free(void *ptr);
+
+// Hand back the calling thread's queued frees from other threads' blocks, and
+// give all the free blocks in its cache back to malloc.
+void rope_cache_trim();
+#endif
+
 // For debugging.
 void _rope_check(rope *r);
 void _rope_print(rope *r);
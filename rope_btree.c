@@ -0,0 +1,1001 @@
+// B+-tree implementation of the rope library. Compile this file instead of rope.c, with
+// -DROPE_BTREE=1.
+//
+// The text lives in the leaves (rope_node), which behave just like the skip list's nodes and are
+// also linked together in document order. Internal nodes store the size of each of their
+// children in contiguous arrays, so finding the child containing a position is a short linear
+// scan which doesn't touch the children themselves.
+//
+// Deletes don't rebalance the tree. Empty nodes are removed, but internal nodes are allowed to
+// become sparse.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+// Needed for VC++, which always compiles in C++ mode and doesn't have stdbool.
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+
+#include <assert.h>
+#include "rope.h"
+
+#if !ROPE_BTREE
+#error rope_btree.c must be compiled with -DROPE_BTREE=1. Use rope.c for the skip list.
+#endif
+
+#if ROPE_CONCURRENT
+#error ROPE_CONCURRENT is only supported by the skip list in rope.c.
+#endif
+
+#define MIN(x,y) ((x) > (y) ? (y) : (x))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+typedef struct rope_inner_t {
+  // The number of characters (and wchars) in each child's subtree.
+  size_t chars[ROPE_BTREE_FANOUT];
+#if ROPE_WCHAR
+  size_t wchars[ROPE_BTREE_FANOUT];
+#endif
+
+  // Either rope_inner or rope_node pointers, depending on the node's depth.
+  void *children[ROPE_BTREE_FANOUT];
+  int num_children;
+} rope_inner;
+
+// A path from the root to a position inside a leaf.
+typedef struct {
+  // s[i] is the internal node at depth i, and the index of the child we went down.
+  struct {
+    rope_inner *node;
+    int idx;
+  } s[ROPE_MAX_HEIGHT];
+
+  rope_node *leaf;
+
+  // The position inside leaf, in characters.
+  size_t offset;
+} rope_cursor;
+
+// Create a new rope with no contents
+rope *rope_new2(void *(*alloc)(size_t bytes),
+                void *(*realloc)(void *ptr, size_t newsize),
+                void (*free)(void *ptr)) {
+  rope *r = (rope *)alloc(sizeof(rope));
+  r->num_chars = r->num_bytes = 0;
+
+  r->alloc = alloc;
+  r->realloc = realloc;
+  r->free = free;
+
+  rope_node *leaf = (rope_node *)alloc(sizeof(rope_node) + ROPE_NODE_STR_SIZE);
+  leaf->str = (uint8_t *)&leaf[1];
+  leaf->num_bytes = 0;
+  leaf->capacity = ROPE_NODE_STR_SIZE;
+  leaf->flags = 0;
+  leaf->num_chars = 0;
+#if ROPE_WCHAR
+  leaf->num_wchars = 0;
+#endif
+  leaf->prev = leaf->next = NULL;
+
+  r->height = 0;
+  r->root = r->first = leaf;
+  return r;
+}
+
+rope *rope_new() {
+  return rope_new2(malloc, realloc, free);
+}
+
+// Create a new rope containing the specified string
+rope *rope_new_with_utf8(const uint8_t *str) {
+  rope *r = rope_new();
+  ROPE_RESULT result = rope_insert(r, 0, str);
+
+  if (result != ROPE_OK) {
+    rope_free(r);
+    return NULL;
+  } else {
+    return r;
+  }
+}
+
+// Create a new rope referencing the specified external string
+rope *rope_new_with_external(const uint8_t *str, size_t len) {
+  rope *r = rope_new();
+  ROPE_RESULT result = rope_insert_external(r, 0, str, len);
+
+  if (result != ROPE_OK) {
+    rope_free(r);
+    return NULL;
+  } else {
+    return r;
+  }
+}
+
+// Allocate a leaf with room for capacity bytes. The new leaf will be full of junk, except for its
+// capacity and str, which points to its own buffer.
+static rope_node *alloc_leaf(rope *r, size_t capacity) {
+  rope_node *leaf = (rope_node *)r->alloc(sizeof(rope_node) + capacity);
+  leaf->str = (uint8_t *)&leaf[1];
+  leaf->capacity = (uint32_t)capacity;
+  leaf->flags = 0;
+  return leaf;
+}
+
+static void free_leaf(rope *r, rope_node *leaf) {
+  if (leaf->flags & ROPE_NODE_GROWN) {
+    r->free(leaf->str);
+  }
+  r->free(leaf);
+}
+
+static inline bool is_external(const rope_node *n) {
+  return n->flags & ROPE_NODE_EXTERNAL;
+}
+
+// Move the leaf's contents to a separately allocated buffer with room for at least size bytes.
+// Leaves are never reallocated in place, to match rope.c.
+static void grow_leaf(rope *r, rope_node *n, size_t size) {
+  assert(!is_external(n));
+  assert(size <= ROPE_NODE_MAX_SIZE);
+  size_t capacity = MIN(MAX(size, 2 * (size_t)n->capacity), ROPE_NODE_MAX_SIZE);
+
+  if (n->flags & ROPE_NODE_GROWN) {
+    n->str = (uint8_t *)r->realloc(n->str, capacity);
+  } else {
+    uint8_t *str = (uint8_t *)r->alloc(capacity);
+    memcpy(str, n->str, n->num_bytes);
+    n->str = str;
+    n->flags |= ROPE_NODE_GROWN;
+  }
+  n->capacity = (uint32_t)capacity;
+}
+
+// Copy a subtree. prev is the last leaf copied so far, for linking up the leaf list.
+static void *copy_subtree(rope *r, const void *src, int height, rope_node **prev) {
+  if (height == 0) {
+    const rope_node *n = (const rope_node *)src;
+    rope_node *n2;
+    if (is_external(n)) {
+      // External spans are shared between the copies.
+      n2 = alloc_leaf(r, 0);
+      n2->str = n->str;
+      n2->flags = ROPE_NODE_EXTERNAL;
+    } else {
+      n2 = alloc_leaf(r, MAX(n->num_bytes, ROPE_NODE_STR_SIZE));
+      memcpy(n2->str, n->str, n->num_bytes);
+    }
+    n2->num_bytes = n->num_bytes;
+    n2->num_chars = n->num_chars;
+#if ROPE_WCHAR
+    n2->num_wchars = n->num_wchars;
+#endif
+
+    n2->prev = *prev;
+    n2->next = NULL;
+    if (*prev) {
+      (*prev)->next = n2;
+    } else {
+      r->first = n2;
+    }
+    *prev = n2;
+    return n2;
+  } else {
+    const rope_inner *n = (const rope_inner *)src;
+    rope_inner *n2 = (rope_inner *)r->alloc(sizeof(rope_inner));
+    *n2 = *n;
+    for (int i = 0; i < n->num_children; i++) {
+      n2->children[i] = copy_subtree(r, n->children[i], height - 1, prev);
+    }
+    return n2;
+  }
+}
+
+rope *rope_copy(const rope *other) {
+  rope *r = (rope *)other->alloc(sizeof(rope));
+  *r = *other;
+
+  rope_node *prev = NULL;
+  r->root = copy_subtree(r, other->root, other->height, &prev);
+  return r;
+}
+
+static void free_subtree(rope *r, void *n, int height) {
+  if (height == 0) {
+    free_leaf(r, (rope_node *)n);
+  } else {
+    rope_inner *inner = (rope_inner *)n;
+    for (int i = 0; i < inner->num_children; i++) {
+      free_subtree(r, inner->children[i], height - 1);
+    }
+    r->free(inner);
+  }
+}
+
+// Free the specified rope
+void rope_free(rope *r) {
+  assert(r);
+  free_subtree(r, r->root, r->height);
+  r->free(r);
+}
+
+// Get the number of characters in a rope
+size_t rope_char_count(const rope *r) {
+  assert(r);
+  return r->num_chars;
+}
+
+// Get the number of bytes which the rope would take up if stored as a utf8
+// string
+size_t rope_byte_count(const rope *r) {
+  assert(r);
+  return r->num_bytes;
+}
+
+// Copies the rope's contents into a utf8 encoded C string. Also copies a trailing '\0' character.
+// Returns the number of bytes written, which is rope_byte_count(r) + 1.
+size_t rope_write_cstr(rope *r, uint8_t *dest) {
+  size_t num_bytes = rope_byte_count(r);
+  dest[num_bytes] = '\0';
+
+  if (num_bytes) {
+    uint8_t *p = dest;
+    for (rope_node* restrict n = r->first; n != NULL; n = n->next) {
+      memcpy(p, n->str, n->num_bytes);
+      p += n->num_bytes;
+    }
+
+    assert(p == &dest[num_bytes]);
+  }
+  return num_bytes + 1;
+}
+
+// Create a new C string which contains the rope. The string will contain
+// the rope encoded as utf8.
+uint8_t *rope_create_cstr(rope *r) {
+  uint8_t *bytes = (uint8_t *)r->alloc(rope_byte_count(r) + 1); // Room for a zero.
+  rope_write_cstr(r, bytes);
+  return bytes;
+}
+
+#if ROPE_WCHAR
+size_t rope_wchar_count(rope *r) {
+  assert(r);
+  if (r->height == 0) {
+    return ((rope_node *)r->root)->num_wchars;
+  }
+
+  rope_inner *root = (rope_inner *)r->root;
+  size_t num = 0;
+  for (int i = 0; i < root->num_children; i++) {
+    num += root->wchars[i];
+  }
+  return num;
+}
+#endif
+
+// Find out how many bytes the unicode character which starts with the specified byte
+// will occupy in memory.
+// Returns the number of bytes, or SIZE_MAX if the byte is invalid.
+static inline size_t codepoint_size(uint8_t byte) {
+  if (byte == 0) { return SIZE_MAX; } // NULL byte.
+  else if (byte <= 0x7f) { return 1; } // 0x74 = 0111 1111
+  else if (byte <= 0xbf) { return SIZE_MAX; } // 1011 1111. Invalid for a starting byte.
+  else if (byte <= 0xdf) { return 2; } // 1101 1111
+  else if (byte <= 0xef) { return 3; } // 1110 1111
+  else if (byte <= 0xf7) { return 4; } // 1111 0111
+  else if (byte <= 0xfb) { return 5; } // 1111 1011
+  else if (byte <= 0xfd) { return 6; } // 1111 1101
+  else { return SIZE_MAX; }
+}
+
+// This little function counts how many bytes a certain number of characters take up.
+static size_t count_bytes_in_utf8(const uint8_t *str, size_t num_chars) {
+  const uint8_t *p = str;
+  for (unsigned int i = 0; i < num_chars; i++) {
+    p += codepoint_size(*p);
+  }
+  return p - str;
+}
+
+#if ROPE_WCHAR
+
+#define NEEDS_TWO_WCHARS(x) (((x) & 0xf0) == 0xf0)
+
+static size_t count_wchars_in_utf8(const uint8_t *str, size_t num_chars) {
+  size_t wchars = 0;
+  for (unsigned int i = 0; i < num_chars; i++) {
+    wchars += 1 + NEEDS_TWO_WCHARS(*str);
+    str += codepoint_size(*str);
+  }
+  return wchars;
+}
+
+static size_t count_utf8_in_wchars(const uint8_t *str, size_t num_wchars) {
+  size_t chars = num_wchars;
+  for (unsigned int i = 0; i < num_wchars; i++) {
+    if (NEEDS_TWO_WCHARS(*str)) {
+      chars--;
+      i++;
+    }
+    str += codepoint_size(*str);
+  }
+  return chars;
+}
+#endif
+
+// Checks that the len bytes at str are valid utf8 (with no embedded NULs).
+// Returns the number of characters in the string if it is ok, otherwise
+// returns SIZE_MAX.
+static size_t count_and_check_utf8(const uint8_t *str, size_t len) {
+  const uint8_t *p = str, *end = str + len;
+  size_t num_chars = 0;
+  while (p < end) {
+    size_t size = codepoint_size(*p);
+    if (size == SIZE_MAX || size > (size_t)(end - p)) return SIZE_MAX;
+    p++; size--;
+    while (size > 0) {
+      if ((*p & 0xc0) != 0x80)
+        return SIZE_MAX;
+      p++; size--;
+    }
+    num_chars++;
+  }
+  return num_chars;
+}
+
+// Find the leaf containing char_pos. Positions on the boundary between two leaves resolve to the
+// end of the first leaf, unless prefer_next is set.
+static rope_node *seek_char(rope *r, size_t char_pos, rope_cursor *c, bool prefer_next) {
+  assert(char_pos <= r->num_chars);
+  void *n = r->root;
+  size_t offset = char_pos;
+
+  for (int h = 0; h < r->height; h++) {
+    rope_inner *inner = (rope_inner *)n;
+    int i = 0;
+    int last = inner->num_children - 1;
+    // This loop is the hottest part of the tree. The sizes are contiguous, so its cheap.
+    if (prefer_next) {
+      while (i < last && offset >= inner->chars[i]) {
+        offset -= inner->chars[i++];
+      }
+    } else {
+      while (i < last && offset > inner->chars[i]) {
+        offset -= inner->chars[i++];
+      }
+    }
+    c->s[h].node = inner;
+    c->s[h].idx = i;
+    n = inner->children[i];
+  }
+
+  c->leaf = (rope_node *)n;
+  c->offset = offset;
+  assert(offset <= c->leaf->num_chars);
+  return c->leaf;
+}
+
+#if ROPE_WCHAR
+// Equivalent of seek_char, but for wchar positions instead. Returns the character position of
+// wchar_pos from the start of the rope.
+static size_t seek_wchar(rope *r, size_t wchar_pos, rope_cursor *c) {
+  void *n = r->root;
+  size_t offset = wchar_pos;
+  size_t char_pos = 0;
+
+  for (int h = 0; h < r->height; h++) {
+    rope_inner *inner = (rope_inner *)n;
+    int i = 0;
+    int last = inner->num_children - 1;
+    while (i < last && offset > inner->wchars[i]) {
+      offset -= inner->wchars[i];
+      char_pos += inner->chars[i];
+      i++;
+    }
+    c->s[h].node = inner;
+    c->s[h].idx = i;
+    n = inner->children[i];
+  }
+
+  c->leaf = (rope_node *)n;
+  assert(offset <= c->leaf->num_wchars);
+  c->offset = count_utf8_in_wchars(c->leaf->str, offset);
+  return char_pos + c->offset;
+}
+#endif
+
+// Adjust the sizes recorded for the cursor's leaf in all its ancestors.
+#if ROPE_WCHAR
+static void update_counts(rope *r, rope_cursor *c, size_t num_chars, size_t num_wchars) {
+  for (int h = 0; h < r->height; h++) {
+    c->s[h].node->chars[c->s[h].idx] += num_chars;
+    c->s[h].node->wchars[c->s[h].idx] += num_wchars;
+  }
+}
+#else
+static void update_counts(rope *r, rope_cursor *c, size_t num_chars) {
+  for (int h = 0; h < r->height; h++) {
+    c->s[h].node->chars[c->s[h].idx] += num_chars;
+  }
+}
+#endif
+
+static void inner_insert(rope_inner *n, int idx, void *child, size_t chars, size_t wchars) {
+  assert(n->num_children < ROPE_BTREE_FANOUT);
+  int num_moved = n->num_children - idx;
+  memmove(&n->children[idx + 1], &n->children[idx], num_moved * sizeof(void *));
+  memmove(&n->chars[idx + 1], &n->chars[idx], num_moved * sizeof(size_t));
+  n->children[idx] = child;
+  n->chars[idx] = chars;
+#if ROPE_WCHAR
+  memmove(&n->wchars[idx + 1], &n->wchars[idx], num_moved * sizeof(size_t));
+  n->wchars[idx] = wchars;
+#else
+  (void)wchars;
+#endif
+  n->num_children++;
+}
+
+static void inner_remove(rope_inner *n, int idx) {
+  int num_moved = n->num_children - idx - 1;
+  memmove(&n->children[idx], &n->children[idx + 1], num_moved * sizeof(void *));
+  memmove(&n->chars[idx], &n->chars[idx + 1], num_moved * sizeof(size_t));
+#if ROPE_WCHAR
+  memmove(&n->wchars[idx], &n->wchars[idx + 1], num_moved * sizeof(size_t));
+#endif
+  n->num_children--;
+}
+
+static size_t inner_chars(const rope_inner *n) {
+  size_t num = 0;
+  for (int i = 0; i < n->num_children; i++) {
+    num += n->chars[i];
+  }
+  return num;
+}
+
+#if ROPE_WCHAR
+static size_t inner_wchars(const rope_inner *n) {
+  size_t num = 0;
+  for (int i = 0; i < n->num_children; i++) {
+    num += n->wchars[i];
+  }
+  return num;
+}
+#endif
+
+// Link a new leaf into the tree directly after the cursor's leaf, and move the cursor to the end
+// of the new leaf. Full internal nodes are split on the way back up.
+static void insert_leaf_after(rope *r, rope_cursor *c, rope_node *leaf) {
+  leaf->prev = c->leaf;
+  leaf->next = c->leaf->next;
+  if (leaf->next) leaf->next->prev = leaf;
+  c->leaf->next = leaf;
+
+  c->leaf = leaf;
+  c->offset = leaf->num_chars;
+  r->num_chars += leaf->num_chars;
+  r->num_bytes += leaf->num_bytes;
+
+  // The new child to insert at each level, and whether the cursor goes through it.
+  void *child = leaf;
+  size_t child_chars = leaf->num_chars;
+  size_t child_wchars = 0;
+#if ROPE_WCHAR
+  child_wchars = leaf->num_wchars;
+#endif
+  bool follow = true;
+
+  for (int h = r->height - 1; h >= 0; h--) {
+    rope_inner *n = c->s[h].node;
+    int idx = c->s[h].idx;
+
+    if (h < r->height - 1) {
+      // The child on our path was split below. Its size needs recalculating.
+      rope_inner *split = (rope_inner *)n->children[idx];
+      n->chars[idx] = inner_chars(split);
+#if ROPE_WCHAR
+      n->wchars[idx] = inner_wchars(split);
+#endif
+    }
+
+    if (n->num_children < ROPE_BTREE_FANOUT) {
+      inner_insert(n, idx + 1, child, child_chars, child_wchars);
+      if (follow) c->s[h].idx = idx + 1;
+
+      // Nothing else changes shape. Everything above just got bigger.
+      for (h--; h >= 0; h--) {
+        c->s[h].node->chars[c->s[h].idx] += leaf->num_chars;
+#if ROPE_WCHAR
+        c->s[h].node->wchars[c->s[h].idx] += leaf->num_wchars;
+#endif
+      }
+      return;
+    }
+
+    // Split the node in half, and put the new child in whichever half it belongs to.
+    const int half = ROPE_BTREE_FANOUT / 2;
+    rope_inner *sibling = (rope_inner *)r->alloc(sizeof(rope_inner));
+    sibling->num_children = n->num_children - half;
+    memcpy(sibling->children, &n->children[half], sibling->num_children * sizeof(void *));
+    memcpy(sibling->chars, &n->chars[half], sibling->num_children * sizeof(size_t));
+#if ROPE_WCHAR
+    memcpy(sibling->wchars, &n->wchars[half], sibling->num_children * sizeof(size_t));
+#endif
+    n->num_children = half;
+
+    int new_idx = idx + 1;
+    rope_inner *dest = new_idx <= half ? n : sibling;
+    if (dest == sibling) new_idx -= half;
+    inner_insert(dest, new_idx, child, child_chars, child_wchars);
+
+    if (follow) {
+      c->s[h].node = dest;
+      c->s[h].idx = new_idx;
+    } else if (idx >= half) {
+      c->s[h].node = sibling;
+      c->s[h].idx = idx - half;
+    }
+
+    follow = c->s[h].node == sibling;
+    child = sibling;
+    child_chars = inner_chars(sibling);
+#if ROPE_WCHAR
+    child_wchars = inner_wchars(sibling);
+#endif
+
+    if (h == 0) {
+      // We split the root. Grow the tree by one level.
+      assert(r->height < ROPE_MAX_HEIGHT);
+      rope_inner *root = (rope_inner *)r->alloc(sizeof(rope_inner));
+      root->num_children = 0;
+      inner_insert(root, 0, n, inner_chars(n), 0);
+      inner_insert(root, 1, sibling, child_chars, child_wchars);
+#if ROPE_WCHAR
+      root->wchars[0] = inner_wchars(n);
+#endif
+      memmove(&c->s[1], &c->s[0], r->height * sizeof(c->s[0]));
+      c->s[0].node = root;
+      c->s[0].idx = follow;
+      r->root = root;
+      r->height++;
+      return;
+    }
+  }
+
+  if (r->height == 0) {
+    // The root was a single leaf. Now it has two.
+    rope_inner *root = (rope_inner *)r->alloc(sizeof(rope_inner));
+    rope_node *first = leaf->prev;
+    root->num_children = 0;
+    inner_insert(root, 0, first, first->num_chars, 0);
+    inner_insert(root, 1, leaf, leaf->num_chars, 0);
+#if ROPE_WCHAR
+    root->wchars[0] = first->num_wchars;
+    root->wchars[1] = leaf->num_wchars;
+#endif
+    c->s[0].node = root;
+    c->s[0].idx = 1;
+    r->root = root;
+    r->height = 1;
+  }
+}
+
+// Unlink and free the (empty) leaf at the cursor. The cursor is invalid afterwards.
+static void remove_leaf(rope *r, rope_cursor *c) {
+  rope_node *leaf = c->leaf;
+  assert(leaf->num_chars == 0 && r->height > 0);
+
+  if (leaf->prev) {
+    leaf->prev->next = leaf->next;
+  } else {
+    r->first = leaf->next;
+  }
+  if (leaf->next) leaf->next->prev = leaf->prev;
+  free_leaf(r, leaf);
+
+  // Remove the leaf from its parent, and any ancestors which are left empty.
+  for (int h = r->height - 1; h >= 0; h--) {
+    rope_inner *n = c->s[h].node;
+    inner_remove(n, c->s[h].idx);
+    if (n->num_children > 0) break;
+    assert(h > 0);
+    r->free(n);
+  }
+
+  // Shrink the tree while the root only has one child.
+  while (r->height > 0 && ((rope_inner *)r->root)->num_children == 1) {
+    rope_inner *root = (rope_inner *)r->root;
+    r->root = root->children[0];
+    r->height--;
+    r->free(root);
+  }
+}
+
+// Can num bytes be inserted at byte offset pos in the leaf (growing it if need be)? This matches
+// the skip list's policy in rope.c.
+static bool leaf_has_room(const rope_node *e, size_t pos, size_t num) {
+  if (is_external(e)) return false;
+
+  size_t size = e->num_bytes + num;
+  if (size <= e->capacity) return true;
+  return size <= (pos == e->num_bytes ? ROPE_NODE_MAX_SIZE : ROPE_NODE_STR_SIZE);
+}
+
+// Make a new leaf containing the specified string and link it in after the cursor.
+static void insert_leaf(rope *r, rope_cursor *c, const uint8_t *str, size_t num_bytes,
+    size_t num_chars, bool external) {
+  rope_node *leaf;
+  if (external) {
+    leaf = alloc_leaf(r, 0);
+    leaf->str = (uint8_t *)str;
+    leaf->flags = ROPE_NODE_EXTERNAL;
+  } else {
+    leaf = alloc_leaf(r, MAX(num_bytes, ROPE_NODE_STR_SIZE));
+    memcpy(leaf->str, str, num_bytes);
+  }
+  leaf->num_bytes = (uint32_t)num_bytes;
+  leaf->num_chars = num_chars;
+#if ROPE_WCHAR
+  leaf->num_wchars = count_wchars_in_utf8(str, num_chars);
+#endif
+  insert_leaf_after(r, c, leaf);
+}
+
+// Insert num_inserted_bytes of (already validated) utf8 at the cursor, which is at char_pos.
+static void insert_at_cursor(rope *r, rope_cursor *c, size_t char_pos,
+    const uint8_t *str, size_t num_inserted_bytes, bool external) {
+  if (num_inserted_bytes == 0) return;
+  rope_node *e = c->leaf;
+
+  size_t offset = c->offset;
+  size_t offset_bytes = offset == e->num_chars ? e->num_bytes : count_bytes_in_utf8(e->str, offset);
+
+  bool insert_here = !external && leaf_has_room(e, offset_bytes, num_inserted_bytes);
+
+  // Can we insert at the start of the next leaf instead?
+  if (!insert_here && !external && offset_bytes == e->num_bytes
+      && e->next && leaf_has_room(e->next, 0, num_inserted_bytes)) {
+    e = seek_char(r, char_pos, c, true);
+    assert(c->offset == 0);
+    offset = offset_bytes = 0;
+    insert_here = true;
+  }
+
+  if (insert_here) {
+    if (e->num_bytes + num_inserted_bytes > e->capacity) {
+      grow_leaf(r, e, e->num_bytes + num_inserted_bytes);
+    }
+    if (offset_bytes < e->num_bytes) {
+      memmove(&e->str[offset_bytes + num_inserted_bytes],
+              &e->str[offset_bytes],
+              e->num_bytes - offset_bytes);
+    }
+    memcpy(&e->str[offset_bytes], str, num_inserted_bytes);
+    e->num_bytes += num_inserted_bytes;
+    r->num_bytes += num_inserted_bytes;
+
+    size_t num_inserted_chars = count_and_check_utf8(str, num_inserted_bytes);
+    e->num_chars += num_inserted_chars;
+    r->num_chars += num_inserted_chars;
+#if ROPE_WCHAR
+    size_t num_inserted_wchars = count_wchars_in_utf8(str, num_inserted_chars);
+    e->num_wchars += num_inserted_wchars;
+    update_counts(r, c, num_inserted_chars, num_inserted_wchars);
+#else
+    update_counts(r, c, num_inserted_chars);
+#endif
+    return;
+  }
+
+  // There isn't room. Truncate the leaf at the insertion point, then add new leaves for the
+  // inserted string and the truncated tail.
+  size_t num_end_bytes = e->num_bytes - offset_bytes;
+  size_t num_end_chars = e->num_chars - offset;
+  if (num_end_bytes) {
+    e->num_bytes = offset_bytes;
+    e->num_chars = offset;
+#if ROPE_WCHAR
+    size_t num_end_wchars = count_wchars_in_utf8(&e->str[offset_bytes], num_end_chars);
+    e->num_wchars -= num_end_wchars;
+    update_counts(r, c, -num_end_chars, -num_end_wchars);
+#else
+    update_counts(r, c, -num_end_chars);
+#endif
+    r->num_chars -= num_end_chars;
+    r->num_bytes -= num_end_bytes;
+  }
+
+  size_t max_node_bytes = external ? ROPE_EXTERNAL_SPAN_SIZE : ROPE_NODE_MAX_SIZE;
+  size_t str_offset = 0;
+  while (str_offset < num_inserted_bytes) {
+    size_t new_node_bytes = 0;
+    size_t new_node_chars = 0;
+
+    while (str_offset + new_node_bytes < num_inserted_bytes) {
+      size_t cs = codepoint_size(str[str_offset + new_node_bytes]);
+      if (cs + new_node_bytes > max_node_bytes) {
+        break;
+      } else {
+        new_node_bytes += cs;
+        new_node_chars++;
+      }
+    }
+
+    insert_leaf(r, c, &str[str_offset], new_node_bytes, new_node_chars, external);
+    str_offset += new_node_bytes;
+  }
+
+  if (num_end_bytes) {
+    // The tail of an external leaf stays external.
+    insert_leaf(r, c, &e->str[offset_bytes], num_end_bytes, num_end_chars, is_external(e));
+  }
+
+  if (e->num_bytes == 0 && r->height > 0) {
+    // We inserted at the very start of the rope and moved all of the first leaf's content after
+    // the new text. Only an empty rope has an empty leaf.
+    seek_char(r, 0, c, false);
+    assert(c->leaf == e);
+    remove_leaf(r, c);
+  }
+}
+
+ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str) {
+  assert(r);
+  assert(str);
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  pos = MIN(pos, r->num_chars);
+
+  size_t num_bytes = strlen((const char *)str);
+  if (count_and_check_utf8(str, num_bytes) == SIZE_MAX) return ROPE_INVALID_UTF8;
+
+  rope_cursor c;
+  seek_char(r, pos, &c, false);
+  insert_at_cursor(r, &c, pos, str, num_bytes, false);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  return ROPE_OK;
+}
+
+// Finding the end of the tree only takes a few steps, so there's no need to remember it.
+ROPE_RESULT rope_append(rope *r, const uint8_t *str) {
+  assert(r);
+  return rope_insert(r, r->num_chars, str);
+}
+
+ROPE_RESULT rope_insert_external(rope *r, size_t pos, const uint8_t *str, size_t len) {
+  assert(r);
+  assert(str || len == 0);
+  if (count_and_check_utf8(str, len) == SIZE_MAX) return ROPE_INVALID_UTF8;
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  pos = MIN(pos, r->num_chars);
+
+  rope_cursor c;
+  seek_char(r, pos, &c, false);
+  insert_at_cursor(r, &c, pos, str, len, true);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  return ROPE_OK;
+}
+
+#if ROPE_WCHAR
+// Insert the given utf8 string into the rope at the specified position.
+size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *str) {
+  assert(r);
+  assert(str);
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  wchar_pos = MIN(wchar_pos, rope_wchar_count(r));
+
+  rope_cursor c;
+  size_t pos = seek_wchar(r, wchar_pos, &c);
+
+  size_t num_bytes = strlen((const char *)str);
+  if (count_and_check_utf8(str, num_bytes) != SIZE_MAX) {
+    insert_at_cursor(r, &c, pos, str, num_bytes, false);
+  }
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  return pos;
+}
+#endif
+
+// Delete length characters at pos, one leaf at a time.
+static void del_at(rope *r, size_t pos, size_t length) {
+  while (length) {
+    rope_cursor c;
+    rope_node *e = seek_char(r, pos, &c, true);
+    size_t offset = c.offset;
+    size_t removed = MIN(length, e->num_chars - offset);
+    assert(removed);
+
+    size_t leading_bytes = count_bytes_in_utf8(e->str, offset);
+    size_t removed_bytes = count_bytes_in_utf8(&e->str[leading_bytes], removed);
+    size_t trailing_bytes = e->num_bytes - leading_bytes - removed_bytes;
+#if ROPE_WCHAR
+    size_t removed_wchars = count_wchars_in_utf8(&e->str[leading_bytes], removed);
+#endif
+
+    const uint8_t *split_str = NULL;
+    size_t split_chars = e->num_chars - offset - removed;
+    if (trailing_bytes) {
+      if (!is_external(e)) {
+        memmove(&e->str[leading_bytes], &e->str[leading_bytes + removed_bytes], trailing_bytes);
+      } else if (leading_bytes == 0) {
+        e->str += removed_bytes;
+      } else {
+        // Deleting from the middle of an external span. Truncate it, and reinsert the tail as a new
+        // external leaf below.
+        split_str = &e->str[leading_bytes + removed_bytes];
+        removed_bytes += trailing_bytes;
+        removed += split_chars;
+#if ROPE_WCHAR
+        removed_wchars += count_wchars_in_utf8(split_str, split_chars);
+#endif
+      }
+    }
+
+    e->num_bytes -= removed_bytes;
+    e->num_chars -= removed;
+    r->num_bytes -= removed_bytes;
+    r->num_chars -= removed;
+#if ROPE_WCHAR
+    e->num_wchars -= removed_wchars;
+    update_counts(r, &c, -removed, -removed_wchars);
+#else
+    update_counts(r, &c, -removed);
+#endif
+
+    if (split_str) {
+      c.offset = e->num_chars;
+      insert_leaf(r, &c, split_str, trailing_bytes, split_chars, true);
+      removed -= split_chars;
+    } else if (e->num_chars == 0 && r->height > 0) {
+      remove_leaf(r, &c);
+    }
+
+    length -= removed;
+  }
+}
+
+void rope_del(rope *r, size_t pos, size_t length) {
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+
+  assert(r);
+  pos = MIN(pos, r->num_chars);
+  length = MIN(length, r->num_chars - pos);
+  del_at(r, pos, length);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+}
+
+#if ROPE_WCHAR
+size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *char_len_out) {
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+
+  assert(r);
+  size_t wchar_total = rope_wchar_count(r);
+  wchar_pos = MIN(wchar_pos, wchar_total);
+  wchar_num = MIN(wchar_num, wchar_total - wchar_pos);
+
+  rope_cursor c;
+  size_t char_pos = seek_wchar(r, wchar_pos, &c);
+  size_t char_length = seek_wchar(r, wchar_pos + wchar_num, &c) - char_pos;
+  del_at(r, char_pos, char_length);
+
+#ifdef DEBUG
+  _rope_check(r);
+#endif
+  if (char_len_out) {
+    *char_len_out = char_length;
+  }
+  return char_pos;
+}
+#endif
+
+// Check a subtree, returning the number of characters (and wchars) in it. next is the leaf
+// expected next in the leaf list.
+static size_t check_subtree(rope *r, void *n, int height, rope_node **next, size_t *wchars_out) {
+  if (height == 0) {
+    rope_node *leaf = (rope_node *)n;
+    assert(leaf == *next);
+    *next = leaf->next;
+    assert(leaf->next == NULL || leaf->next->prev == leaf);
+    assert(leaf->num_bytes || r->height == 0);
+    if (is_external(leaf)) {
+      assert(leaf->capacity == 0);
+    } else {
+      assert(leaf->num_bytes <= leaf->capacity);
+      assert(leaf->capacity <= ROPE_NODE_MAX_SIZE);
+      assert((leaf->flags & ROPE_NODE_GROWN) || leaf->str == (uint8_t *)&leaf[1]);
+    }
+    assert(count_and_check_utf8(leaf->str, leaf->num_bytes) == leaf->num_chars);
+#if ROPE_WCHAR
+    assert(count_wchars_in_utf8(leaf->str, leaf->num_chars) == leaf->num_wchars);
+    *wchars_out = leaf->num_wchars;
+#endif
+    return leaf->num_chars;
+  }
+
+  rope_inner *inner = (rope_inner *)n;
+  assert(inner->num_children > 0 && inner->num_children <= ROPE_BTREE_FANOUT);
+  assert(inner->num_children > 1 || n != r->root);
+  size_t chars = 0;
+  size_t wchars = 0;
+  for (int i = 0; i < inner->num_children; i++) {
+    size_t child_wchars = 0;
+    size_t child_chars = check_subtree(r, inner->children[i], height - 1, next, &child_wchars);
+    assert(inner->chars[i] == child_chars);
+#if ROPE_WCHAR
+    assert(inner->wchars[i] == child_wchars);
+#endif
+    chars += child_chars;
+    wchars += child_wchars;
+  }
+  *wchars_out = wchars;
+  return chars;
+}
+
+void _rope_check(rope *r) {
+  assert(r->num_bytes >= r->num_chars);
+  assert(r->first && r->first->prev == NULL);
+
+  rope_node *next = r->first;
+  size_t wchars = 0;
+  size_t chars = check_subtree(r, r->root, r->height, &next, &wchars);
+  assert(next == NULL);
+  assert(chars == r->num_chars);
+
+  size_t num_bytes = 0;
+  ROPE_FOREACH(r, n) {
+    num_bytes += n->num_bytes;
+  }
+  assert(num_bytes == r->num_bytes);
+#if ROPE_WCHAR
+  assert(wchars == rope_wchar_count(r));
+#endif
+}
+
+// For debugging.
+#include <stdio.h>
+static void print_subtree(void *n, int height, int depth) {
+  if (height == 0) {
+    rope_node *leaf = (rope_node *)n;
+    printf("%*s%3zd: \"", depth * 2, "", leaf->num_chars);
+    fwrite(leaf->str, leaf->num_bytes, 1, stdout);
+    printf("\"\n");
+  } else {
+    rope_inner *inner = (rope_inner *)n;
+    printf("%*s[%d children]\n", depth * 2, "", inner->num_children);
+    for (int i = 0; i < inner->num_children; i++) {
+      print_subtree(inner->children[i], height - 1, depth + 1);
+    }
+  }
+}
+
+void _rope_print(rope *r) {
+  printf("chars: %zd\tbytes: %zd\theight: %d\n", r->num_chars, r->num_bytes, r->height);
+  print_subtree(r->root, r->height, 0);
+}
@@ -10,6 +10,15 @@
 
 #include "slowstring.h"
 
+#if (ROPE_CONCURRENT || ROPE_PARALLEL) && !ROPE_BTREE
+#include <pthread.h>
+#endif
+
+#if ROPE_FILE_IO && !ROPE_BTREE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifdef __cplusplus
 #include <ext/rope>
 #endif
@@ -26,6 +35,16 @@ static void _rope_del(void *r, size_t pos, size_t len) {
   rope_del((rope *)r, pos, len);
 }
 static void _rope_destroy(void *r) {
+#if ROPE_STATS && !ROPE_BTREE
+  rope_stats stats;
+  rope_get_stats((rope *)r, &stats);
+  printf("descents %llu (%.1f steps each), inserts %llu in place / %llu split, "
+         "%llu bytes moved, nodes %llu allocated / %llu freed / %llu grown\n",
+         (unsigned long long)stats.descents, (double)stats.descent_steps / stats.descents,
+         (unsigned long long)stats.inserts_in_place, (unsigned long long)stats.inserts_split,
+         (unsigned long long)stats.bytes_moved, (unsigned long long)stats.nodes_allocated,
+         (unsigned long long)stats.nodes_freed, (unsigned long long)stats.nodes_grown);
+#endif
   rope_free((rope *)r);
 }
 
@@ -97,9 +116,578 @@ struct rope_implementation {
   { "c string", &_str_create, &_str_insert, &_str_del, &_str_destroy, &_str_num_chars },
 };
 
+static double elapsed_since(struct timeval *start) {
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+}
+
+// Documents which are appended to in large blocks and then mostly read.
+static void benchmark_bulk() {
+  printf("Benchmarking bulk appends and scans (max node size = %d)\n", ROPE_NODE_MAX_SIZE);
+
+  const size_t block_size = 16 * 1024;
+  const size_t doc_size = 64 * 1024 * 1024;
+  uint8_t *block = (uint8_t *)malloc(block_size + 1);
+  random_ascii_string(block, block_size + 1);
+  struct timeval start;
+
+  rope *r = rope_new();
+  gettimeofday(&start, NULL);
+  while (rope_byte_count(r) < doc_size) {
+    rope_insert(r, rope_char_count(r), block);
+  }
+  double elapsed = elapsed_since(&start);
+  printf("appended %zu MB in %f ms: %f MB/sec\n", doc_size >> 20, elapsed * 1000,
+         doc_size / elapsed / (1 << 20));
+
+  size_t num_nodes = 0;
+  ROPE_FOREACH(r, n) {
+    num_nodes++;
+  }
+#if ROPE_BTREE
+  printf("%zu nodes, tree height %d\n", num_nodes, r->height);
+#else
+  printf("%zu nodes, head height %d\n", num_nodes, r->head.height);
+#endif
+
+  gettimeofday(&start, NULL);
+  size_t count = 0;
+  for (int i = 0; i < 10; i++) {
+    ROPE_FOREACH(r, n) {
+      uint8_t *data = rope_node_data(n);
+      for (size_t b = 0; b < rope_node_num_bytes(n); b++) {
+        count += data[b] == 'a';
+      }
+    }
+  }
+  elapsed = elapsed_since(&start);
+  printf("scanned in %f ms: %f MB/sec (%zu)\n", elapsed * 100,
+         10 * doc_size / elapsed / (1 << 20), count);
+
+  uint8_t *dest = (uint8_t *)malloc(rope_byte_count(r) + 1);
+  gettimeofday(&start, NULL);
+  rope_write_cstr(r, dest);
+  elapsed = elapsed_since(&start);
+  printf("rope_write_cstr in %f ms: %f MB/sec\n", elapsed * 1000,
+         doc_size / elapsed / (1 << 20));
+#if ROPE_PARALLEL && !ROPE_BTREE
+  gettimeofday(&start, NULL);
+  rope_write_cstr_parallel(r, dest, 0);
+  elapsed = elapsed_since(&start);
+  printf("rope_write_cstr_parallel in %f ms: %f MB/sec\n", elapsed * 1000,
+         doc_size / elapsed / (1 << 20));
+#endif
+  free(dest);
+#if !ROPE_BTREE
+  uint16_t *dest16 = (uint16_t *)malloc((rope_utf16_count(r) + 1) * sizeof(uint16_t));
+  gettimeofday(&start, NULL);
+  rope_write_utf16(r, dest16);
+  elapsed = elapsed_since(&start);
+  printf("rope_write_utf16 in %f ms: %f MB/sec\n", elapsed * 1000,
+         doc_size / elapsed / (1 << 20));
+  free(dest16);
+#endif
+
+  // And some small edits, to make sure they don't suffer.
+  long iterations = 1000000;
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < iterations; i++) {
+    size_t pos = random() % rope_char_count(r);
+    if (i % 2) {
+      rope_insert(r, pos, (uint8_t *)"x");
+    } else {
+      rope_del(r, pos, 1);
+    }
+  }
+  elapsed = elapsed_since(&start);
+  printf("did %ld random edits in %f ms: %f Miter/sec\n",
+         iterations, elapsed * 1000, iterations / elapsed / 1000000);
+
+  rope_free(r);
+  free(block);
+}
+
+// A synthetic editing trace. Someone types at a cursor, backspaces now and then and occasionally
+// clicks somewhere else in the document.
+static void benchmark_trace() {
+  printf("Benchmarking typing trace\n");
+
+  long iterations = 10000000;
+  struct timeval start;
+  srandom(4321);
+  rope *r = rope_new();
+  size_t cursor = 0;
+
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < iterations; i++) {
+    long action = random() % 100;
+    if (action == 0) {
+      cursor = random() % (rope_char_count(r) + 1);
+    } else if (action < 12 && cursor > 0) {
+      rope_del(r, --cursor, 1);
+    } else {
+      rope_insert(r, cursor++, (uint8_t *)(action % 7 ? "e" : " "));
+    }
+  }
+  double elapsed = elapsed_since(&start);
+  printf("did %ld iterations in %f ms: %f Miter/sec\n",
+         iterations, elapsed * 1000, iterations / elapsed / 1000000);
+  printf("final string length: %zi\n", rope_char_count(r));
+  rope_free(r);
+}
+
+// Streaming output, which is only ever appended to in small pieces.
+static void benchmark_append() {
+  printf("Benchmarking small appends\n");
+  const long iterations = 10000000;
+  uint8_t *strings[16];
+  for (int i = 0; i < 16; i++) {
+    size_t len = 1 + random() % 32;
+    strings[i] = (uint8_t *)malloc(len + 1);
+    random_ascii_string(strings[i], len + 1);
+  }
+
+  struct timeval start;
+  for (int method = 0; method < 2; method++) {
+    rope *r = rope_new();
+    gettimeofday(&start, NULL);
+    for (long i = 0; i < iterations; i++) {
+      if (method == 0) {
+        rope_insert(r, rope_char_count(r), strings[i % 16]);
+      } else {
+        rope_append(r, strings[i % 16]);
+      }
+    }
+    double elapsed = elapsed_since(&start);
+    printf("%s: %ld appends in %f ms: %f Miter/sec\n",
+           method == 0 ? "rope_insert at the end" : "rope_append", iterations, elapsed * 1000,
+           iterations / elapsed / 1000000);
+    rope_free(r);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    free(strings[i]);
+  }
+}
+
+#if !ROPE_BTREE
+// Searching a 1GB document.
+static void benchmark_find() {
+  printf("Benchmarking find all\n");
+  const size_t block_size = 16 * 1024;
+  const size_t doc_size = 1024 * 1024 * 1024;
+  uint8_t *block = (uint8_t *)malloc(block_size + 1);
+  rope *r = rope_new();
+  while (rope_byte_count(r) < doc_size) {
+    random_ascii_string(block, block_size + 1);
+    rope_insert(r, rope_char_count(r), block);
+  }
+  free(block);
+
+  struct timeval start;
+  size_t *matches;
+  gettimeofday(&start, NULL);
+  size_t num = rope_find_all(r, (uint8_t *)"abc", &matches);
+  double elapsed = elapsed_since(&start);
+  printf("rope_find_all found %zu matches in %f ms: %f MB/sec\n", num, elapsed * 1000,
+         doc_size / elapsed / (1 << 20));
+  free(matches);
+
+#if ROPE_PARALLEL
+  gettimeofday(&start, NULL);
+  num = rope_find_all_parallel(r, (uint8_t *)"abc", &matches, 0);
+  elapsed = elapsed_since(&start);
+  printf("rope_find_all_parallel found %zu matches in %f ms: %f MB/sec\n", num, elapsed * 1000,
+         doc_size / elapsed / (1 << 20));
+  free(matches);
+#endif
+
+  rope_free(r);
+}
+#endif
+
+#if ROPE_CONCURRENT && !ROPE_BTREE
+typedef struct {
+  rope *r;
+  volatile int done;
+  long reads;
+} concurrent_bench_state;
+
+static void *bench_reader(void *arg) {
+  concurrent_bench_state *state = (concurrent_bench_state *)arg;
+  rope_reader *reader = rope_reader_new(state->r);
+  uint8_t buf[256];
+  long reads = 0;
+  unsigned int seed = 1;
+  while (!__atomic_load_n(&state->done, __ATOMIC_ACQUIRE)) {
+    seed = seed * 1103515245 + 12345;
+    size_t pos = seed % (rope_reader_char_count(reader) + 1);
+    rope_reader_read(reader, pos, 100, buf, sizeof(buf), NULL);
+    reads++;
+  }
+  rope_reader_free(reader);
+  __atomic_fetch_add(&state->reads, reads, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+// How much do readers on other threads slow the writer down, and how fast can they read?
+static void benchmark_concurrent() {
+  printf("Benchmarking single writer with concurrent readers\n");
+  long iterations = 2000000;
+  struct timeval start;
+
+  for (int num_readers = 0; num_readers <= 4; num_readers = num_readers ? num_readers * 2 : 1) {
+    srandom(4321);
+    concurrent_bench_state state = { rope_new(), 0, 0 };
+    rope *r = state.r;
+    uint8_t *block = (uint8_t *)malloc(100001);
+    random_ascii_string(block, 100001);
+    rope_insert(r, 0, block);
+    free(block);
+
+    pthread_t readers[4];
+    for (int i = 0; i < num_readers; i++) {
+      pthread_create(&readers[i], NULL, bench_reader, &state);
+    }
+
+    gettimeofday(&start, NULL);
+    for (long i = 0; i < iterations; i++) {
+      size_t pos = random() % rope_char_count(r);
+      if (i % 2) {
+        rope_insert(r, pos, (uint8_t *)"x");
+      } else {
+        rope_del(r, pos, 1);
+      }
+    }
+    double elapsed = elapsed_since(&start);
+
+    __atomic_store_n(&state.done, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < num_readers; i++) {
+      pthread_join(readers[i], NULL);
+    }
+    printf("%d readers: writer %f Miter/sec, readers %f Mreads/sec\n", num_readers,
+           iterations / elapsed / 1000000, state.reads / elapsed / 1000000);
+    rope_free(r);
+  }
+}
+#endif
+
+#if ROPE_ANCHORS && !ROPE_BTREE
+// Edits with lots of anchors in the document, and how fast they can all be looked up.
+static void benchmark_anchors() {
+  printf("Benchmarking edits with anchors\n");
+  long iterations = 2000000;
+  struct timeval start;
+  srandom(4321);
+
+  for (int num_anchors = 0; num_anchors <= 100000;
+       num_anchors = num_anchors ? num_anchors * 10 : 1000) {
+    rope *r = rope_new();
+    uint8_t *block = (uint8_t *)malloc(1000001);
+    random_ascii_string(block, 1000001);
+    rope_insert(r, 0, block);
+    free(block);
+
+    rope_anchor **anchors = (rope_anchor **)malloc(num_anchors * sizeof(rope_anchor *));
+    for (int i = 0; i < num_anchors; i++) {
+      anchors[i] = rope_anchor_new(r, random() % rope_char_count(r), ROPE_ANCHOR_LEFT);
+    }
+
+    gettimeofday(&start, NULL);
+    for (long i = 0; i < iterations; i++) {
+      size_t pos = random() % rope_char_count(r);
+      if (i % 2) {
+        rope_insert(r, pos, (uint8_t *)"x");
+      } else {
+        rope_del(r, pos, 1);
+      }
+    }
+    double elapsed = elapsed_since(&start);
+    printf("%d anchors: %f Miter/sec", num_anchors, iterations / elapsed / 1000000);
+
+    gettimeofday(&start, NULL);
+    size_t sum = 0;
+    for (int i = 0; i < num_anchors; i++) {
+      sum += rope_anchor_pos(r, anchors[i]);
+    }
+    elapsed = elapsed_since(&start);
+    printf(", looked them all up in %f ms (%zu)\n", elapsed * 1000, sum);
+    free(anchors);
+    rope_free(r);
+  }
+}
+#endif
+
+#if ROPE_ARENA && !ROPE_BTREE
+// Builds a rope out of lots of small inserts, which spreads its nodes around the heap, and then
+// times scanning, copying and freeing it.
+static void benchmark_arena_rope(rope *r, const char *name) {
+  const size_t doc_size = 16 * 1024 * 1024;
+  struct timeval start;
+  srandom(1234);
+
+  gettimeofday(&start, NULL);
+  uint8_t str[65];
+  while (rope_byte_count(r) < doc_size) {
+    random_ascii_string(str, 2 + random() % 64);
+    rope_insert(r, random() % (rope_char_count(r) + 1), str);
+  }
+  double build = elapsed_since(&start);
+
+  uint8_t *dest = (uint8_t *)malloc(rope_byte_count(r) + 1);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < 10; i++) {
+    rope_write_cstr(r, dest);
+  }
+  double scan = elapsed_since(&start) / 10;
+  free(dest);
+
+  gettimeofday(&start, NULL);
+  rope *copy = rope_copy(r);
+  double copy_time = elapsed_since(&start);
+
+  gettimeofday(&start, NULL);
+  rope_free(r);
+  double free_time = elapsed_since(&start);
+  rope_free(copy);
+
+  printf("%s: built in %.0f ms, scanned in %.2f ms, copied in %.2f ms, freed in %.3f ms\n",
+         name, build * 1000, scan * 1000, copy_time * 1000, free_time * 1000);
+}
+
+static void benchmark_arena() {
+  printf("Benchmarking arena ropes against malloc\n");
+  benchmark_arena_rope(rope_new(), "malloc");
+  benchmark_arena_rope(rope_new_arena(), "arena");
+}
+#endif
+
+#if !ROPE_BTREE
+// Times writing out the rope and walking its nodes, and prints them with the node count.
+static void benchmark_scans(rope *r, const char *name, uint8_t *dest) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < 10; i++) {
+    rope_write_cstr(r, dest);
+  }
+  double write = elapsed_since(&start) / 10;
+
+  size_t nodes = 0, sum = 0;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < 10; i++) {
+    ROPE_FOREACH(r, n) {
+      // Touch each node's last byte too, like a search would.
+      size_t bytes = rope_node_num_bytes(n);
+      if (bytes) sum += rope_node_data(n)[bytes - 1];
+      nodes++;
+    }
+  }
+  double walk = elapsed_since(&start) / 10;
+
+  // sum is printed so the walk isn't optimized away.
+  printf("%s: %zu nodes, write_cstr in %.2f ms (%.0f MB/sec), node walk in %.3f ms (%zu)\n",
+         name, nodes / 10, write * 1000, rope_byte_count(r) / write / (1 << 20), walk * 1000,
+         sum % 10);
+}
+
+// Lots of small inserts leave a rope's nodes scattered around the heap in no particular order.
+// Scans before and after relaying them out in document order.
+static void benchmark_relayout() {
+  printf("Benchmarking scans after rope_relayout\n");
+  const size_t doc_size = 16 * 1024 * 1024;
+  srandom(1234);
+  rope *r = rope_new();
+  uint8_t str[65];
+  while (rope_byte_count(r) < doc_size) {
+    random_ascii_string(str, 2 + random() % 64);
+    rope_insert(r, random() % (rope_char_count(r) + 1), str);
+  }
+  uint8_t *dest = (uint8_t *)malloc(rope_byte_count(r) + 1);
+  benchmark_scans(r, "scattered", dest);
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  rope_relayout(r, 0);
+  double relayout = elapsed_since(&start);
+  printf("rope_relayout took %.1f ms\n", relayout * 1000);
+  benchmark_scans(r, "relaid out", dest);
+
+  gettimeofday(&start, NULL);
+  rope_relayout(r, 1);
+  relayout = elapsed_since(&start);
+  printf("rope_relayout with repacking took %.1f ms\n", relayout * 1000);
+  benchmark_scans(r, "repacked", dest);
+
+  free(dest);
+  rope_free(r);
+}
+#endif
+
+#if ROPE_FILE_IO && !ROPE_BTREE
+// Loading and saving a 256MB file, against going through a buffer holding all of it.
+static void benchmark_files() {
+  printf("Benchmarking loading and saving files\n");
+  const size_t block_size = 1024 * 1024;
+  const size_t file_size = 256 * 1024 * 1024;
+  char path[] = "/tmp/librope_bench_XXXXXX";
+  int fd = mkstemp(path);
+  uint8_t *block = (uint8_t *)malloc(block_size + 1);
+  for (size_t written = 0; written < file_size; written += block_size) {
+    random_ascii_string(block, block_size + 1);
+    if (write(fd, block, block_size) != (ssize_t)block_size) {
+      printf("Couldn't write %s\n", path);
+      break;
+    }
+  }
+  free(block);
+  close(fd);
+
+  struct timeval start;
+  for (int method = 0; method < 2; method++) {
+    gettimeofday(&start, NULL);
+    rope *r;
+    if (method == 0) {
+      fd = open(path, O_RDONLY);
+      size_t len = lseek(fd, 0, SEEK_END);
+      lseek(fd, 0, SEEK_SET);
+      uint8_t *contents = (uint8_t *)malloc(len + 1);
+      for (size_t done = 0; done < len; ) {
+        ssize_t bytes = read(fd, &contents[done], len - done);
+        if (bytes <= 0) break;
+        done += bytes;
+      }
+      contents[len] = '\0';
+      close(fd);
+      r = rope_new_with_utf8(contents);
+      free(contents);
+    } else {
+      r = rope_load_file(path);
+    }
+    double elapsed = elapsed_since(&start);
+    printf("%s: %zu MB in %f ms: %f MB/sec\n",
+           method == 0 ? "read + rope_new_with_utf8" : "rope_load_file",
+           rope_byte_count(r) >> 20, elapsed * 1000, rope_byte_count(r) / elapsed / 1048576);
+    if (method == 0) {
+      rope_free(r);
+      continue;
+    }
+
+    for (int save = 0; save < 2; save++) {
+      gettimeofday(&start, NULL);
+      fd = open(path, O_WRONLY | O_TRUNC);
+      if (save == 0) {
+        uint8_t *contents = rope_create_cstr(r);
+        size_t len = rope_byte_count(r);
+        for (size_t done = 0; done < len; ) {
+          ssize_t bytes = write(fd, &contents[done], len - done);
+          if (bytes <= 0) break;
+          done += bytes;
+        }
+        free(contents);
+      } else {
+        rope_write_fd(r, fd);
+      }
+      close(fd);
+      elapsed = elapsed_since(&start);
+      printf("%s: %zu MB in %f ms: %f MB/sec\n",
+             save == 0 ? "rope_create_cstr + write" : "rope_write_fd",
+             rope_byte_count(r) >> 20, elapsed * 1000, rope_byte_count(r) / elapsed / 1048576);
+    }
+    rope_free(r);
+  }
+  unlink(path);
+}
+#endif
+
+#if ROPE_COMPRESS && !ROPE_BTREE
+// Allocations made through these are counted in live_bytes. Each one keeps its size just before
+// the memory it hands out.
+static size_t live_bytes;
+
+static void *counted_alloc(size_t size) {
+  size_t *block = (size_t *)malloc(size + sizeof(size_t));
+  live_bytes += size;
+  block[0] = size;
+  return &block[1];
+}
+static void *counted_realloc(void *ptr, size_t size) {
+  if (ptr == NULL) return counted_alloc(size);
+  size_t *block = (size_t *)ptr - 1;
+  live_bytes += size - block[0];
+  block = (size_t *)realloc(block, size + sizeof(size_t));
+  block[0] = size;
+  return &block[1];
+}
+static void counted_free(void *ptr) {
+  if (ptr == NULL) return;
+  size_t *block = (size_t *)ptr - 1;
+  live_bytes -= block[0];
+  free(block);
+}
+
+// A 64MB rope of prose-like text, compressed and then edited again.
+static void benchmark_compress() {
+  printf("Benchmarking rope_compress\n");
+  static const char *words[] = {
+    "the ", "a ", "rope ", "is ", "made ", "of ", "nodes ", "which ", "hold ", "text ",
+    "and ", "each ", "one ", "links ", "to ", "next ", "in ", "skip ", "list ", ".\n"
+  };
+  const size_t doc_size = 64 * 1024 * 1024;
+  srandom(1234);
+  uint8_t *text = (uint8_t *)malloc(doc_size + 1);
+  size_t len = 0;
+  while (len + 16 < doc_size) {
+    const char *word = words[random() % (sizeof(words) / sizeof(words[0]))];
+    memcpy(&text[len], word, strlen(word));
+    len += strlen(word);
+  }
+  text[len] = '\0';
+
+  rope *r = rope_new2(counted_alloc, counted_realloc, counted_free);
+  rope_insert(r, 0, text);
+  rope_relayout(r, 1);
+  size_t before = live_bytes;
+  benchmark_scans(r, "plain", text);
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  rope_compress(r);
+  double compress = elapsed_since(&start);
+  printf("rope_compress took %.1f ms (%.0f MB/sec), %zu nodes compressed\n",
+         compress * 1000, len / compress / (1 << 20), r->num_compressed);
+  printf("memory: %.1f MB before, %.1f MB after\n", before / 1048576.0, live_bytes / 1048576.0);
+
+  // Writing the rope out decompresses each node on the way past, and leaves them compressed.
+  gettimeofday(&start, NULL);
+  rope_write_cstr(r, text);
+  double write = elapsed_since(&start);
+  printf("write_cstr of the compressed rope took %.1f ms (%.0f MB/sec)\n",
+         write * 1000, len / write / (1 << 20));
+
+  // Each edit decompresses the node it lands in.
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < 10000; i++) {
+    rope_insert(r, random() % (rope_char_count(r) + 1), (const uint8_t *)"x");
+  }
+  double edits = elapsed_since(&start);
+  printf("10000 inserts into the compressed rope took %.1f ms, %.1f MB after\n",
+         edits * 1000, live_bytes / 1048576.0);
+
+  gettimeofday(&start, NULL);
+  rope_decompress(r);
+  double decompress = elapsed_since(&start);
+  printf("rope_decompress took %.1f ms (%.0f MB/sec), %.1f MB after\n",
+         decompress * 1000, len / decompress / (1 << 20), live_bytes / 1048576.0);
+
+  rope_free(r);
+  free(text);
+}
+#endif
+
 void benchmark() {
-  printf("Benchmarking... (node size = %d, wchar support = %d)\n",
-         ROPE_NODE_STR_SIZE, ROPE_WCHAR);
+  printf("Benchmarking %s... (node size = %d, wchar support = %d)\n",
+         ROPE_BTREE ? "B+-tree" : "skip list", ROPE_NODE_STR_SIZE, ROPE_WCHAR);
   
   long iterations = 20000000;
 //  long iterations = 1000000;
@@ -159,5 +747,31 @@ void benchmark() {
   for (int i = 0; i < 100; i++) {
     free(strings[i]);
   }
+  free(rvals);
+
+  benchmark_trace();
+  benchmark_bulk();
+  benchmark_append();
+#if !ROPE_BTREE
+  benchmark_find();
+#endif
+#if ROPE_CONCURRENT && !ROPE_BTREE
+  benchmark_concurrent();
+#endif
+#if ROPE_ANCHORS && !ROPE_BTREE
+  benchmark_anchors();
+#endif
+#if ROPE_ARENA && !ROPE_BTREE
+  benchmark_arena();
+#endif
+#if !ROPE_BTREE
+  benchmark_relayout();
+#endif
+#if ROPE_FILE_IO && !ROPE_BTREE
+  benchmark_files();
+#endif
+#if ROPE_COMPRESS && !ROPE_BTREE
+  benchmark_compress();
+#endif
 }
 
@@ -0,0 +1,157 @@
+// Per-operation latency microbenchmarks for librope.
+//
+// Each operation is timed individually, and the run reports the 50th, 99th and
+// 99.9th percentile latencies for a few document sizes. `make microbench`
+// builds this against several variants of the library (node sizes, skip list
+// bias, prefetching, wchar support, the B+-tree) and prints a table comparing
+// them. Prefetching only makes a difference once documents are much bigger than
+// the CPU's last level cache - set MICROBENCH_MAX_SIZE to 1073741824 to see it.
+//
+// Usage: microbench <variant name> [max document size in bytes]
+//
+// Output is one line per operation and document size:
+//   <variant> <op> <doc bytes> <samples> <p50 ns> <p99 ns> <p999 ns>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rope.h"
+
+// How many times the cheap (edit) and expensive (whole document) operations
+// are timed for each document size. Expensive operations are timed less often
+// on bigger documents. Samples have the cost of reading the clock taken off.
+#define EDIT_SAMPLES 200000
+#define BULK_SAMPLES 2000
+#define BULK_BYTES_PER_SIZE (256 * 1024 * 1024)
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// The median time taken to read the clock, which is taken off every sample.
+static uint64_t timer_overhead;
+
+static void calibrate_timer() {
+  uint64_t samples[1001];
+  for (int i = 0; i < 1001; i++) {
+    uint64_t start = now_ns();
+    samples[i] = now_ns() - start;
+  }
+  qsort(samples, 1001, sizeof(uint64_t), compare_u64);
+  timer_overhead = samples[500];
+}
+
+static void report(const char *variant, const char *op, size_t doc_size,
+    uint64_t *samples, size_t num) {
+  for (size_t i = 0; i < num; i++) {
+    samples[i] = samples[i] > timer_overhead ? samples[i] - timer_overhead : 0;
+  }
+  qsort(samples, num, sizeof(uint64_t), compare_u64);
+  printf("%s %s %zu %zu %llu %llu %llu\n", variant, op, doc_size, num,
+         (unsigned long long)samples[num / 2],
+         (unsigned long long)samples[num * 99 / 100],
+         (unsigned long long)samples[num * 999 / 1000]);
+  fflush(stdout);
+}
+
+static void random_text(uint8_t *buffer, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    buffer[i] = i % 8 == 7 ? ' ' : 'a' + random() % 26;
+  }
+  buffer[len] = '\0';
+}
+
+static void bench_size(const char *variant, size_t doc_size) {
+  uint8_t *text = (uint8_t *)malloc(doc_size + 1);
+  random_text(text, doc_size);
+  rope *r = rope_new_with_utf8(text);
+  free(text);
+
+  uint64_t *inserts = (uint64_t *)malloc(EDIT_SAMPLES * sizeof(uint64_t));
+  uint64_t *deletes = (uint64_t *)malloc(EDIT_SAMPLES * sizeof(uint64_t));
+
+  // Inserts and deletes alternate, so the document stays the same size.
+  for (size_t i = 0; i < EDIT_SAMPLES; i++) {
+    size_t pos = random() % (rope_char_count(r) + 1);
+    uint64_t start = now_ns();
+    rope_insert(r, pos, (const uint8_t *)"x");
+    inserts[i] = now_ns() - start;
+
+    pos = random() % rope_char_count(r);
+    start = now_ns();
+    rope_del(r, pos, 1);
+    deletes[i] = now_ns() - start;
+  }
+  report(variant, "insert", doc_size, inserts, EDIT_SAMPLES);
+  report(variant, "delete", doc_size, deletes, EDIT_SAMPLES);
+
+#if !ROPE_BTREE
+  // Reading a character is just a search, so this shows what finding a position costs.
+  for (size_t i = 0; i < EDIT_SAMPLES; i++) {
+    size_t pos = random() % rope_char_count(r);
+    uint64_t start = now_ns();
+    rope_char_at(r, pos);
+    inserts[i] = now_ns() - start;
+  }
+  report(variant, "lookup", doc_size, inserts, EDIT_SAMPLES);
+#endif
+  free(inserts);
+  free(deletes);
+
+  size_t bulk_samples = BULK_BYTES_PER_SIZE / doc_size;
+  if (bulk_samples > BULK_SAMPLES) bulk_samples = BULK_SAMPLES;
+  if (bulk_samples < 10) bulk_samples = 10;
+  uint64_t *samples = (uint64_t *)malloc(bulk_samples * sizeof(uint64_t));
+
+  for (size_t i = 0; i < bulk_samples; i++) {
+    uint64_t start = now_ns();
+    rope *copy = rope_copy(r);
+    samples[i] = now_ns() - start;
+    rope_free(copy);
+  }
+  report(variant, "copy", doc_size, samples, bulk_samples);
+
+  uint8_t *dest = (uint8_t *)malloc(rope_byte_count(r) + 1);
+  for (size_t i = 0; i < bulk_samples; i++) {
+    uint64_t start = now_ns();
+    rope_write_cstr(r, dest);
+    samples[i] = now_ns() - start;
+  }
+  report(variant, "serialize", doc_size, samples, bulk_samples);
+  free(dest);
+
+#if !ROPE_BTREE
+  for (size_t i = 0; i < bulk_samples; i++) {
+    size_t *matches;
+    uint64_t start = now_ns();
+    rope_find_all(r, (const uint8_t *)"abc", &matches);
+    samples[i] = now_ns() - start;
+    free(matches);
+  }
+  report(variant, "search", doc_size, samples, bulk_samples);
+#endif
+
+  free(samples);
+  rope_free(r);
+}
+
+int main(int argc, const char *argv[]) {
+  const char *variant = argc > 1 ? argv[1] : "librope";
+  size_t max_size = argc > 2 ? strtoull(argv[2], NULL, 10) : 1024 * 1024;
+  srandom(1234);
+  calibrate_timer();
+
+  for (size_t size = 1024; size <= max_size; size *= 32) {
+    bench_size(variant, size);
+  }
+  return 0;
+}
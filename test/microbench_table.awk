@@ -0,0 +1,48 @@
+# Turns the output of several microbench runs into tables comparing the
+# variants, one table per percentile.
+#
+# Input lines: <variant> <op> <doc bytes> <samples> <p50 ns> <p99 ns> <p999 ns>
+
+function human_time(ns) {
+  if (ns < 10000) return sprintf("%dns", ns);
+  if (ns < 10000000) return sprintf("%.1fus", ns / 1000);
+  return sprintf("%.1fms", ns / 1000000);
+}
+
+function human_size(bytes) {
+  if (bytes < 1024 * 1024) return sprintf("%dK", bytes / 1024);
+  return sprintf("%dM", bytes / 1024 / 1024);
+}
+
+{
+  variant = $1
+  row = $2 " " human_size($3)
+  if (!(variant in seen_variant)) {
+    seen_variant[variant] = 1
+    variants[num_variants++] = variant
+  }
+  if (!(row in seen_row)) {
+    seen_row[row] = 1
+    rows[num_rows++] = row
+  }
+  for (p = 0; p < 3; p++) {
+    cell[p, row, variant] = human_time($(5 + p))
+  }
+}
+
+END {
+  split("p50 p99 p99.9", names, " ")
+  for (p = 0; p < 3; p++) {
+    printf "\n%s latency\n%-16s", names[p + 1], "op / doc size"
+    for (v = 0; v < num_variants; v++) printf " %12s", variants[v]
+    printf "\n"
+    for (i = 0; i < num_rows; i++) {
+      printf "%-16s", rows[i]
+      for (v = 0; v < num_variants; v++) {
+        c = cell[p, rows[i], variants[v]]
+        printf " %12s", c == "" ? "-" : c
+      }
+      printf "\n"
+    }
+  }
+}
@@ -0,0 +1,287 @@
+// Throughput benchmark for lots of independent ropes being edited at once.
+//
+// Production hosts one rope per document, with many documents being edited on
+// a pool of worker threads. Here each thread owns an equal share of the ropes
+// and makes small random edits to them for a fixed time, so no two threads
+// ever touch the same rope. Anything the ropes share behind the scenes - the
+// allocator, and the global random() in random_height - shows up as the
+// throughput of each thread dropping as threads are added. The ropes use a
+// wrapped allocator, which samples how long allocating and freeing take.
+//
+// Usage: multibench [num ropes] [max threads] [seconds per run] [malloc|cache]
+//
+// Runs with 1, 2, 4 ... max threads. max threads defaults to the number of
+// online CPUs. Scaling is the total throughput over what perfect scaling from
+// the single thread run would give, which is 1 thread's throughput times the
+// number of threads (or CPUs, if there are fewer). The last argument picks
+// whether the ropes' nodes come from malloc or from rope_cache_alloc (when
+// built with ROPE_NODE_CACHE). Each run happens in a fresh process, so the
+// RSS it reports - measured while all the ropes are alive - is just its own.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rope.h"
+
+#define DOC_SIZE 4096
+#define MAX_EDIT_SIZE 8
+// One in this many allocator calls is timed, so timing doesn't swamp malloc.
+#define ALLOC_SAMPLE_RATE 8
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+  // xorshift64. Each thread has its own, so the benchmark itself doesn't contend on random().
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+typedef struct {
+  uint64_t allocs, frees;
+  // Calls timed, and the total time they took.
+  uint64_t timed_allocs, alloc_ns;
+  uint64_t timed_frees, free_ns;
+} alloc_counters;
+
+static __thread alloc_counters counters;
+
+// The allocator being benchmarked.
+static void *(*base_alloc)(size_t size) = malloc;
+static void *(*base_realloc)(void *ptr, size_t size) = realloc;
+static void (*base_free)(void *ptr) = free;
+
+static void *timed_alloc(size_t size) {
+  if (counters.allocs++ % ALLOC_SAMPLE_RATE) return base_alloc(size);
+  uint64_t start = now_ns();
+  void *ptr = base_alloc(size);
+  counters.alloc_ns += now_ns() - start;
+  counters.timed_allocs++;
+  return ptr;
+}
+
+static void *timed_realloc(void *ptr, size_t size) {
+  if (counters.allocs++ % ALLOC_SAMPLE_RATE) return base_realloc(ptr, size);
+  uint64_t start = now_ns();
+  ptr = base_realloc(ptr, size);
+  counters.alloc_ns += now_ns() - start;
+  counters.timed_allocs++;
+  return ptr;
+}
+
+static void timed_free(void *ptr) {
+  if (counters.frees++ % ALLOC_SAMPLE_RATE) {
+    base_free(ptr);
+    return;
+  }
+  uint64_t start = now_ns();
+  base_free(ptr);
+  counters.free_ns += now_ns() - start;
+  counters.timed_frees++;
+}
+
+// The process's resident memory in bytes, or 0 if it can't be found out.
+static size_t resident_bytes() {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return 0;
+  unsigned long size, resident = 0;
+  if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+typedef struct {
+  size_t num_ropes;
+  uint64_t seed;
+  pthread_barrier_t *start, *done;
+  volatile int *stop;
+
+  // Results.
+  uint64_t edits;
+  uint64_t elapsed_ns;
+  alloc_counters alloc;
+} worker;
+
+static void *run_worker(void *arg) {
+  worker *w = (worker *)arg;
+  uint64_t rng = w->seed;
+
+  // Ropes are created on the thread which edits them, like they would be in a server.
+  rope **ropes = (rope **)malloc(w->num_ropes * sizeof(rope *));
+  uint8_t text[DOC_SIZE + 1];
+  for (size_t i = 0; i < DOC_SIZE; i++) {
+    text[i] = i % 8 == 7 ? ' ' : 'a' + next_random(&rng) % 26;
+  }
+  text[DOC_SIZE] = '\0';
+  for (size_t i = 0; i < w->num_ropes; i++) {
+    ropes[i] = rope_new2(timed_alloc, timed_realloc, timed_free);
+    rope_insert(ropes[i], 0, text);
+  }
+  memset(&counters, 0, sizeof(counters));
+
+  pthread_barrier_wait(w->start);
+  uint64_t start = now_ns();
+  uint64_t edits = 0;
+  while (!__atomic_load_n(w->stop, __ATOMIC_RELAXED)) {
+    for (int i = 0; i < 64; i++) {
+      rope *r = ropes[next_random(&rng) % w->num_ropes];
+      size_t len = rope_char_count(r);
+      size_t num = 1 + next_random(&rng) % MAX_EDIT_SIZE;
+      // Inserts and deletes balance out, so documents stay around DOC_SIZE.
+      if (len < DOC_SIZE) {
+        uint8_t str[MAX_EDIT_SIZE + 1];
+        memset(str, 'x', num);
+        str[num] = '\0';
+        rope_insert(r, next_random(&rng) % (len + 1), str);
+      } else {
+        rope_del(r, next_random(&rng) % (len - num + 1), num);
+      }
+    }
+    edits += 64;
+  }
+  w->elapsed_ns = now_ns() - start;
+  w->edits = edits;
+  w->alloc = counters;
+
+  // The ropes are kept around until the main thread has measured how much memory they take.
+  pthread_barrier_wait(w->done);
+  pthread_barrier_wait(w->done);
+  for (size_t i = 0; i < w->num_ropes; i++) {
+    rope_free(ropes[i]);
+  }
+  free(ropes);
+  return NULL;
+}
+
+// Runs the benchmark on num_threads threads, and returns the total edits per second.
+static double run(size_t num_ropes, int num_threads, double seconds, int num_cpus,
+    double single_rate) {
+  worker *workers = (worker *)calloc(num_threads, sizeof(worker));
+  pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  pthread_barrier_t start, done;
+  pthread_barrier_init(&start, NULL, num_threads + 1);
+  pthread_barrier_init(&done, NULL, num_threads + 1);
+  volatile int stop = 0;
+
+  for (int t = 0; t < num_threads; t++) {
+    workers[t].num_ropes = num_ropes / num_threads + (t < num_ropes % num_threads);
+    workers[t].seed = 0x9e3779b97f4a7c15ULL * (t + 1);
+    workers[t].start = &start;
+    workers[t].done = &done;
+    workers[t].stop = &stop;
+    pthread_create(&threads[t], NULL, run_worker, &workers[t]);
+  }
+  pthread_barrier_wait(&start);
+  struct timespec duration = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+  nanosleep(&duration, NULL);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  pthread_barrier_wait(&done);
+  size_t rss = resident_bytes();
+  pthread_barrier_wait(&done);
+
+  double total = 0, min = 0, max = 0;
+  alloc_counters alloc = {0};
+  uint64_t thread_ns = 0;
+  for (int t = 0; t < num_threads; t++) {
+    pthread_join(threads[t], NULL);
+    worker *w = &workers[t];
+    double rate = w->edits * 1e9 / w->elapsed_ns;
+    total += rate;
+    if (t == 0 || rate < min) min = rate;
+    if (t == 0 || rate > max) max = rate;
+    alloc.allocs += w->alloc.allocs;
+    alloc.frees += w->alloc.frees;
+    alloc.timed_allocs += w->alloc.timed_allocs;
+    alloc.alloc_ns += w->alloc.alloc_ns;
+    alloc.timed_frees += w->alloc.timed_frees;
+    alloc.free_ns += w->alloc.free_ns;
+    thread_ns += w->elapsed_ns;
+  }
+  pthread_barrier_destroy(&start);
+  pthread_barrier_destroy(&done);
+
+  double alloc_ns = alloc.timed_allocs ? (double)alloc.alloc_ns / alloc.timed_allocs : 0;
+  double free_ns = alloc.timed_frees ? (double)alloc.free_ns / alloc.timed_frees : 0;
+  double allocator_share = (alloc_ns * alloc.allocs + free_ns * alloc.frees) / thread_ns;
+  if (single_rate == 0) single_rate = total;
+  double ideal = single_rate * (num_threads < num_cpus ? num_threads : num_cpus);
+
+  printf("%7d %12.0f %12.0f %12.0f %12.0f %8.0f%% %10.1f %9.1f %9.1f %8.1f%% %8.1f\n",
+         num_threads, total, min, total / num_threads, max, 100 * total / ideal,
+         (double)alloc.allocs / num_threads / seconds / 1000, alloc_ns, free_ns,
+         100 * allocator_share, rss / (1024.0 * 1024.0));
+  fflush(stdout);
+
+  free(workers);
+  free(threads);
+  return total;
+}
+
+int main(int argc, const char *argv[]) {
+  int num_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus < 1) num_cpus = 1;
+  size_t num_ropes = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000;
+  int max_threads = argc > 2 ? atoi(argv[2]) : num_cpus;
+  double seconds = argc > 3 ? atof(argv[3]) : 1;
+  const char *allocator = argc > 4 ? argv[4] : "malloc";
+  if (max_threads < 1 || num_ropes < (size_t)max_threads) {
+    fprintf(stderr, "Need at least 1 thread, and a rope for every thread\n");
+    return 1;
+  }
+  if (strcmp(allocator, "cache") == 0) {
+#if ROPE_NODE_CACHE
+    base_alloc = rope_cache_alloc;
+    base_realloc = rope_cache_realloc;
+    base_free = rope_cache_free;
+#else
+    fprintf(stderr, "The node cache needs ROPE_NODE_CACHE\n");
+    return 1;
+#endif
+  } else if (strcmp(allocator, "malloc") != 0) {
+    fprintf(stderr, "Unknown allocator %s\n", allocator);
+    return 1;
+  }
+
+  printf("%zu ropes of %d bytes, %d CPUs, %.1fs per run, %s\n", num_ropes, DOC_SIZE, num_cpus,
+         seconds, allocator);
+  printf("                         edits/s per thread\n");
+  printf("threads      edits/s          min          avg          max  scaling  "
+         "kallocs/s  alloc ns   free ns  allocator   RSS MB\n");
+
+  double single_rate = 0;
+  for (int threads = 1; ; threads *= 2) {
+    if (threads > max_threads) threads = max_threads;
+
+    // Each run's child process sends back its throughput.
+    int fds[2];
+    double rate = 0;
+    if (pipe(fds) != 0) return 1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      rate = run(num_ropes, threads, seconds, num_cpus, single_rate);
+      if (write(fds[1], &rate, sizeof(rate)) != sizeof(rate)) _exit(1);
+      _exit(0);
+    }
+    int status;
+    if (pid < 0 || read(fds[0], &rate, sizeof(rate)) != sizeof(rate)) return 1;
+    waitpid(pid, &status, 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    if (threads == 1) single_rate = rate;
+    if (threads == max_threads) break;
+  }
+  return 0;
+}
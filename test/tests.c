@@ -9,6 +9,16 @@
 #include "slowstring.h"
 #include "rope.h"
 
+#if (ROPE_CONCURRENT || ROPE_PARALLEL || ROPE_NODE_CACHE) && !ROPE_BTREE
+#include <pthread.h>
+#endif
+
+#if ROPE_FILE_IO && !ROPE_BTREE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 static float rand_float() {
   return (float)random() / INT32_MAX;
 }
@@ -112,7 +122,9 @@ void test(int cond) {
   }
 }
 
-void check(rope *rope, char *expected) {
+// Like check, for ropes whose allocator isn't malloc. The string the rope is written out to is
+// freed with free_str.
+static void check_with_free(rope *rope, char *expected, void (*free_str)(void *)) {
   // Rope will be null when the inserted data is invalid.
   assert((rope == NULL) == (expected == NULL));
   
@@ -121,7 +133,32 @@ void check(rope *rope, char *expected) {
     test(rope_byte_count(rope) == strlen(expected));
     uint8_t *cstr = rope_create_cstr(rope);
     test(strcmp((char *)cstr, expected) == 0);
-    free(cstr);
+    free_str(cstr);
+  }
+}
+
+void check(rope *rope, char *expected) {
+  check_with_free(rope, expected, free);
+}
+
+// Make the same random edits to r and str, keeping them around target_len characters. Inserts
+// are up to 100 bytes of random unicode, and deletes take out up to 100 characters.
+static void random_edits(rope *r, _string *str, size_t target_len, int num_edits) {
+  uint8_t strbuffer[101];
+  for (int i = 0; i < num_edits; i++) {
+    size_t len = str_num_chars(str);
+    if (len < target_len) {
+      random_unicode_string(strbuffer, 1 + random() % 100);
+      size_t pos = random() % (len + 1);
+      rope_insert(r, pos, strbuffer);
+      str_insert(str, pos, strbuffer);
+    } else {
+      size_t pos = random() % len;
+      size_t dellen = random() % 100;
+      dellen = MIN(len - pos, dellen);
+      rope_del(r, pos, dellen);
+      str_del(str, pos, dellen);
+    }
   }
 }
 
@@ -295,6 +332,111 @@ static void test_really_long_ascii_string() {
   rope_free(r);
 }
 
+static void test_external() {
+  // The external string doesn't need a null terminator.
+  const char *text = "Hello external world! κόσμε";
+  size_t len = strlen(text);
+  char *buf = malloc(len);
+  memcpy(buf, text, len);
+
+  rope *r = rope_new_with_external((uint8_t *)buf, len);
+  check(r, (char *)text);
+  test(rope_char_count(r) == 27);
+
+  rope *r2 = rope_copy(r);
+  check(r2, (char *)text);
+  rope_free(r2);
+
+  // Trimming the start, end and middle of the span.
+  rope_del(r, 0, 6);
+  check(r, "external world! κόσμε");
+  rope_del(r, 19, 2);
+  check(r, "external world! κόσ");
+  rope_del(r, 3, 5);
+  check(r, "ext world! κόσ");
+
+  // Inserting in the middle splits the span.
+  checked_insert(r, 4, "big ");
+  check(r, "ext big world! κόσ");
+  rope_insert_external(r, 0, (uint8_t *)"Hi ", 3);
+  check(r, "Hi ext big world! κόσ");
+
+  // The external memory is never written to.
+  test(memcmp(buf, text, len) == 0);
+  rope_free(r);
+  free(buf);
+
+  test(rope_new_with_external((uint8_t *)"\xe0\xb0", 2) == NULL);
+  test(rope_new_with_external((uint8_t *)"a\0b", 3) == NULL);
+}
+
+static void test_random_external_edits() {
+  // A big external buffer, edited randomly. Spans get split and trimmed, while
+  // inserts land in normal nodes.
+  size_t len = 100000;
+  uint8_t *buf = malloc(len + 1);
+  random_unicode_string(buf, len + 1);
+  uint8_t *copy = malloc(len + 1);
+  memcpy(copy, buf, len + 1);
+
+  _string *str = str_create();
+  str_insert(str, 0, buf);
+  rope *r = rope_new_with_external(buf, strlen((char *)buf));
+  random_edits(r, str, str_num_chars(str), 1000);
+  check(r, (char *)str->mem);
+  test(strcmp((char *)buf, (char *)copy) == 0);
+
+  rope_free(r);
+  str_destroy(str);
+  free(buf);
+  free(copy);
+}
+
+static size_t count_nodes(rope *r) {
+  size_t num = 0;
+  ROPE_FOREACH(r, n) {
+    num++;
+  }
+  return num;
+}
+
+static void test_node_capacity() {
+  // Large inserts get big nodes.
+  size_t len = 100000;
+  uint8_t *str = malloc(len + 1);
+  random_ascii_string(str, len + 1);
+  rope *r = rope_new_with_utf8(str);
+  check(r, (char *)str);
+  test(count_nodes(r) <= len / ROPE_NODE_MAX_SIZE + 2);
+
+  // Small edits in the middle of a big node split it rather than growing it.
+  rope_insert(r, 10, (uint8_t *)"hi");
+  rope_del(r, 20, 5);
+  ROPE_FOREACH(r, n) {
+    test(n->capacity <= ROPE_NODE_MAX_SIZE);
+  }
+  _rope_check(r);
+  rope_free(r);
+
+  // Appending lots of small strings grows the last node.
+  r = rope_new();
+  _string *s = str_create();
+  for (int i = 0; i < 1000; i++) {
+    rope_insert(r, rope_char_count(r), (uint8_t *)"Appending text. ");
+    str_insert(s, str_num_chars(s), (uint8_t *)"Appending text. ");
+  }
+  check(r, (char *)s->mem);
+  test(count_nodes(r) <= 16000 / ROPE_NODE_MAX_SIZE + 2);
+
+  rope *r2 = rope_copy(r);
+  check(r2, (char *)s->mem);
+  rope_free(r2);
+
+  rope_free(r);
+  str_destroy(s);
+  free(str);
+}
+
 static int alloced_regions = 0;
 
 void *_alloc(size_t size) {
@@ -307,135 +449,1766 @@ void _free(void *mem) {
   free(mem);
 }
 
-static void test_custom_allocator() {
-  // Its really hard to test that malloc is never called, but I can make sure
-  // custom frees match custom allocs.
-  rope *r = rope_new2(_alloc, realloc, _free);
-  for (int i = 0; i < 100; i++) {
-    rope_insert(r, random() % (rope_char_count(r) + 1),
-        (uint8_t *)"Whoa super happy fun times!\n");
+static void test_write_cstr_parallel() {
+#if ROPE_PARALLEL && !ROPE_BTREE
+  // Big enough to be split between 3 threads, with blocks inserted all over the place so the
+  // ranges don't line up with anything.
+  rope *r = rope_new();
+  uint8_t block[16 * 1024];
+  while (rope_byte_count(r) < 3 * ROPE_PARALLEL_MIN_BYTES + 12345) {
+    random_unicode_string(block, 1 + random() % sizeof(block));
+    rope_insert(r, random() % (rope_char_count(r) + 1), block);
   }
 
+  size_t num_bytes = rope_byte_count(r);
+  uint8_t *expected = rope_create_cstr(r);
+  uint8_t *actual = malloc(num_bytes + 1);
+  int num_threads[] = {0, 1, 2, 3, 7};
+  for (int i = 0; i < sizeof(num_threads) / sizeof(num_threads[0]); i++) {
+    memset(actual, 'x', num_bytes + 1);
+    test(rope_write_cstr_parallel(r, actual, num_threads[i]) == num_bytes + 1);
+    test(memcmp(actual, expected, num_bytes + 1) == 0);
+  }
+  free(actual);
+  free(expected);
   rope_free(r);
 
-  test(alloced_regions == 0);
+  // Small ropes are just copied.
+  r = rope_new_with_utf8((uint8_t *)"hi there");
+  uint8_t buf[10];
+  test(rope_write_cstr_parallel(r, buf, 4) == 9);
+  test(strcmp((char *)buf, "hi there") == 0);
+  rope_free(r);
+#else
+  printf("Skipping parallel write tests - ROPE_PARALLEL disabled.\n");
+#endif
 }
 
-static void test_copy() {
-  // Copy an empty string.
-  rope *r1 = rope_new();
-  rope *r2 = rope_copy(r1);
-  check(r2, "");
-  rope_free(r2);
-  
-  // Insert some text (less than one node worth)
-  rope_insert(r1, 0, (uint8_t *)"Eureka!");
-  r2 = rope_copy(r1);
-  check(r2, "Eureka!");
-  
-  rope_free(r1);
-  rope_free(r2);
+#if !ROPE_BTREE
+static void check_find_all(rope *r, const char *needle, size_t num, const size_t *expected) {
+  size_t *matches;
+  test(rope_find_all(r, (uint8_t *)needle, &matches) == num);
+  test(num ? memcmp(matches, expected, num * sizeof(size_t)) == 0 : matches == NULL);
+  free(matches);
 }
 
-static void test_random_edits() {
-  // This string should always have the same content as the rope.
-  _string *str = str_create();
+// Find needle in the rope the slow way, to check against.
+static size_t naive_find_all(rope *r, const char *needle, size_t *matches) {
+  uint8_t *str = rope_create_cstr(r);
+  size_t num = 0, chars = 0, len = strlen(needle);
+  for (uint8_t *p = str; *p; p++) {
+    if (strncmp((char *)p, needle, len) == 0) matches[num++] = chars;
+    chars += (*p & 0xc0) != 0x80;
+  }
+  free(str);
+  return num;
+}
+#endif
+
+static void test_find_all() {
+#if !ROPE_BTREE
+  rope *r = rope_new_with_utf8((uint8_t *)"abcabcab");
+  size_t abc[] = {0, 3};
+  check_find_all(r, "abc", 2, abc);
+  check_find_all(r, "x", 0, NULL);
+  check_find_all(r, "", 0, NULL);
+  rope_free(r);
+
+  r = rope_new_with_utf8((uint8_t *)"aaaa");
+  size_t aa[] = {0, 1, 2};
+  check_find_all(r, "aa", 3, aa);
+  rope_free(r);
+
+  r = rope_new_with_utf8((uint8_t *)"δaδaδ");
+  size_t ad[] = {1, 3};
+  check_find_all(r, "aδ", 2, ad);
+  rope_free(r);
+
+  // External nodes never merge, so these matches cross node boundaries.
+  r = rope_new();
+  const char *parts[] = {"xa", "b", "", "cxab", "c", "a"};
+  for (int i = 0; i < 6; i++) {
+    rope_insert_external(r, rope_char_count(r), (uint8_t *)parts[i], strlen(parts[i]));
+  }
+  size_t spans[] = {1, 5};
+  check_find_all(r, "abc", 2, spans);
+  check_find_all(r, "abcxabca", 1, spans);
+  check_find_all(r, "abcxabcab", 0, NULL);
+  rope_free(r);
+
+  // A big rope with a small alphabet, so there are lots of matches. It's big enough to be split
+  // up when searching in parallel.
+  r = rope_new();
+  const char *alphabet[] = {"a", "b", "δ"};
+  uint8_t block[10000];
+  for (int i = 0; i < 300; i++) {
+    size_t len = 0;
+    while (len + 2 < sizeof(block)) {
+      const char *c = alphabet[random() % 3];
+      strcpy((char *)&block[len], c);
+      len += strlen(c);
+    }
+    rope_insert(r, random() % (rope_char_count(r) + 1), block);
+  }
+  size_t *expected = malloc(rope_byte_count(r) * sizeof(size_t));
+  const char *needles[] = {"a", "ab", "bδa", "abababa"};
+  for (int i = 0; i < 4; i++) {
+    size_t num = naive_find_all(r, needles[i], expected);
+    check_find_all(r, needles[i], num, expected);
+  }
+
+#if ROPE_PARALLEL
+  for (int threads = 0; threads <= 5; threads++) {
+    size_t num = naive_find_all(r, "abδ", expected);
+    size_t *matches;
+    test(rope_find_all_parallel(r, (uint8_t *)"abδ", &matches, threads) == num);
+    test(memcmp(matches, expected, num * sizeof(size_t)) == 0);
+    free(matches);
+  }
+#endif
+
+  free(expected);
+  rope_free(r);
+#else
+  printf("Skipping find tests - not supported by the B+-tree.\n");
+#endif
+}
+
+#if !ROPE_BTREE
+// A slow but obvious utf8 to utf16 transcoder to check the rope against. Returns the number of
+// code units written.
+static size_t naive_utf16(const uint8_t *str, size_t num_chars, uint16_t *dest) {
+  size_t len = 0;
+  for (size_t i = 0; i < num_chars; i++) {
+    uint32_t c;
+    if (str[0] < 0x80) { c = str[0]; str += 1; }
+    else if (str[0] < 0xe0) { c = ((str[0] & 0x1f) << 6) | (str[1] & 0x3f); str += 2; }
+    else if (str[0] < 0xf0) {
+      c = ((str[0] & 0xf) << 12) | ((str[1] & 0x3f) << 6) | (str[2] & 0x3f);
+      str += 3;
+    } else {
+      c = ((str[0] & 0x7) << 18) | ((str[1] & 0x3f) << 12) | ((str[2] & 0x3f) << 6) | (str[3] & 0x3f);
+      str += 4;
+    }
+    if (c < 0x10000) {
+      dest[len++] = c;
+    } else {
+      dest[len++] = 0xd800 + ((c - 0x10000) >> 10);
+      dest[len++] = 0xdc00 + ((c - 0x10000) & 0x3ff);
+    }
+  }
+  return len;
+}
+
+static size_t utf8_skip(const uint8_t *str, size_t num_chars) {
+  const uint8_t *p = str;
+  for (; num_chars; num_chars--) {
+    p++;
+    while ((*p & 0xc0) == 0x80) p++;
+  }
+  return p - str;
+}
+#endif
+
+static void test_utf16() {
+#if !ROPE_BTREE
   rope *r = rope_new();
-  
-  const size_t max_stringsize = 1000;
-  uint8_t strbuffer[max_stringsize + 1];
-  
-  for (int i = 0; i < 1000; i++) {
-    // First, some sanity checks.
-    check(r, (char *)str->mem);
-    
-    rope *r2 = rope_copy(r);
-    check(r2, (char *)str->mem);
-    rope_free(r2);
-    
-//    printf("String contains '%s'\n", str->mem);
-    test(rope_byte_count(r) == str->len);
-    size_t len = strlen_utf8(str->mem);
-    test(rope_char_count(r) == len);
-    test(str_num_chars(str) == len);
-    
-    if (len == 0 || rand_float() < 0.5f) {
-      // Insert.
-      random_unicode_string(strbuffer, 1 + random() % max_stringsize);
-      size_t pos = random() % (len + 1);
-      
-//      printf("inserting %s at %zd\n", strbuffer, pos);
-      rope_insert(r, pos, strbuffer);
-      str_insert(str, pos, strbuffer);
+  uint16_t empty[1] = {0xffff};
+  test(rope_utf16_count(r) == 0);
+  test(rope_write_utf16(r, empty) == 1);
+  test(empty[0] == 0);
+
+  // Mix long ascii runs, which take the fast path, with other characters. External nodes keep
+  // some of the node boundaries where they were inserted.
+  uint8_t str[1000];
+  for (int i = 0; i < 200; i++) {
+    if (i % 3 == 0) {
+      random_unicode_string(str, 1 + random() % 100);
     } else {
-      // Delete
-      size_t pos = random() % len;
-      
-      size_t dellen = random() % 10;
-      dellen = MIN(len - pos, dellen);
-      
-//      printf("deleting %zd chars at %zd\n", dellen, pos);
-      rope_del(r, pos, dellen);
-      str_del(str, pos, dellen);
+      random_ascii_string(str, 1 + random() % 100);
     }
+    rope_insert(r, random() % (rope_char_count(r) + 1), str);
   }
-  
+  const char *ext = "0123456789abcdef0123456789abcdefδ𐆔x";
+  rope_insert_external(r, 17, (const uint8_t *)ext, strlen(ext));
+  rope_insert_external(r, rope_char_count(r), (const uint8_t *)ext, 32);
+
+  size_t num_chars = rope_char_count(r);
+  uint8_t *utf8 = rope_create_cstr(r);
+  uint16_t *expected = malloc(2 * num_chars * sizeof(uint16_t));
+  size_t len = naive_utf16(utf8, num_chars, expected);
+  test(rope_utf16_count(r) == len);
+#if ROPE_WCHAR
+  test(len == rope_wchar_count(r));
+#endif
+
+  size_t actual_len;
+  uint16_t *actual = rope_create_utf16(r, &actual_len);
+  test(actual_len == len);
+  test(memcmp(actual, expected, len * sizeof(uint16_t)) == 0);
+  test(actual[len] == 0);
+  free(actual);
+
+  uint16_t *range = malloc(2 * num_chars * sizeof(uint16_t));
+  uint16_t *range_expected = malloc(2 * num_chars * sizeof(uint16_t));
+  for (int i = 0; i < 200; i++) {
+    size_t pos = random() % (num_chars + 1);
+    size_t num = random() % (num_chars - pos + 1);
+    size_t short_num = random() % 40;
+    if (i % 2) num = MIN(num, short_num);
+    size_t n = naive_utf16(&utf8[utf8_skip(utf8, pos)], num, range_expected);
+    test(rope_write_utf16_range(r, pos, num, range) == n);
+    test(memcmp(range, range_expected, n * sizeof(uint16_t)) == 0);
+  }
+
+  // Ranges past the end are clamped.
+  size_t tail = utf8_skip(utf8, num_chars - 10);
+  size_t n = naive_utf16(&utf8[tail], 10, range_expected);
+  test(rope_write_utf16_range(r, num_chars - 10, 100, range) == n);
+  test(memcmp(range, range_expected, n * sizeof(uint16_t)) == 0);
+  test(rope_write_utf16_range(r, num_chars + 5, 10, range) == 0);
+
+  free(range);
+  free(range_expected);
+  free(expected);
+  free(utf8);
+  rope_free(r);
+#else
+  printf("Skipping utf16 tests - not supported by the B+-tree.\n");
+#endif
+}
+
+static void test_insert_utf16() {
+#if ROPE_WCHAR && !ROPE_BTREE
+  rope *r = rope_new_with_utf8((uint8_t *)"𐆔𐆔");
+  const uint16_t abc[] = {'a', 0x3b4, 0x2190, 0xd800, 0xdd94, 'c'}; // aδ←𐆔c
+  test(rope_insert_utf16(r, 2, abc, 6) == ROPE_OK);
+  check(r, "𐆔aδ←𐆔c𐆔");
+  test(rope_wchar_count(r) == 10);
+  test(rope_insert_utf16(r, 0, abc, 0) == ROPE_OK);
+  check(r, "𐆔aδ←𐆔c𐆔");
+
+  // Unpaired surrogates and NULs are rejected.
+  const uint16_t bad[][2] = {{'a', 0xd800}, {0xdd94, 'a'}, {0xd800, 'a'}, {'a', 0}};
+  for (int i = 0; i < 4; i++) {
+    test(rope_insert_utf16(r, 0, bad[i], 2) == ROPE_INVALID_UTF8);
+  }
+  check(r, "𐆔aδ←𐆔c𐆔");
   rope_free(r);
+
+  // Small inserts fill in existing nodes, and big ones and inserts into external nodes make new
+  // ones.
+  _string *str = str_create();
+  r = rope_new();
+  const char *ext = "external text δ𐆔";
+  rope_insert_external(r, 0, (const uint8_t *)ext, strlen(ext));
+  str_insert(str, 0, (const uint8_t *)ext);
+  uint8_t utf8[3000];
+  uint16_t utf16[3000];
+  for (int i = 0; i < 300; i++) {
+    random_unicode_string(utf8, 1 + (i % 10 ? random() % 20 : random() % sizeof(utf8)));
+    size_t pos = random() % (str_num_chars(str) + 1);
+    size_t len = naive_utf16(utf8, strlen_utf8(utf8), utf16);
+    test(rope_insert_utf16(r, count_wchars_in_utf8(str->mem, pos), utf16, len) == ROPE_OK);
+    str_insert(str, pos, utf8);
+  }
+  check(r, (char *)str->mem);
+  test(rope_wchar_count(r) == wchar_size_count(str->mem));
   str_destroy(str);
+  rope_free(r);
+#else
+  printf("Skipping utf16 insert tests - needs ROPE_WCHAR and the skip list.\n");
+#endif
 }
 
-static void test_random_wchar_edits() {
+static void test_positions() {
+#if !ROPE_BTREE
+  rope *r = rope_new_with_utf8((uint8_t *)"aδ𐆔b");
+  test(rope_char_at(r, 0) == 'a');
+  test(rope_char_at(r, 1) == 0x3b4);
+  test(rope_char_at(r, 2) == 0x10194);
+  test(rope_char_at(r, 3) == 'b');
+  test(rope_char_at(r, 4) == 0);
+  test(rope_char_to_byte(r, 2) == 3);
+  test(rope_char_to_byte(r, 100) == 8);
+  test(rope_byte_to_char(r, 3) == 2);
+  test(rope_byte_to_char(r, 5) == 2); // Inside the 𐆔.
+  test(rope_byte_to_char(r, 100) == 4);
 #if ROPE_WCHAR
-  // This string should always have the same content as the rope.
-  // Both are stored using UTF-8, but we'll make edits using the wchar functions.
-  _string *str = str_create();
-  rope *r = rope_new();
-  
-  const size_t max_stringsize = 1000;
-  uint8_t strbuffer[max_stringsize + 1];
-  
-  for (int i = 0; i < 1000; i++) {
-    check(r, (char *)str->mem);
-    
-//    printf("String contains '%s'\n", str->mem);
-    test(rope_byte_count(r) == str->len);
-    size_t len = strlen_utf8(str->mem);
-    test(rope_char_count(r) == len);
-    test(str_num_chars(str) == len);
-    test(rope_wchar_count(r) == wchar_size_count(str->mem));
-    
-    if (len == 0 || rand_float() < 0.5f) {
-      // Insert.
-      random_unicode_string(strbuffer, 1 + random() % max_stringsize);
-      size_t pos = random() % (len + 1);
-      
-      // We need to convert pos to the wchar offset. There's a private function in rope.c for this
-      // but ...
-      size_t wchar_pos = count_wchars_in_utf8(str->mem, pos);
-      
-//      printf("inserting '%s' at %zd\n", strbuffer, pos);
-      rope_insert_at_wchar(r, wchar_pos, strbuffer);
-      str_insert(str, pos, strbuffer);
-    } else {
-      // Delete
-      size_t pos = random() % len;
-      
-      size_t dellen = random() % 10;
-      dellen = MIN(len - pos, dellen);
-      
-      size_t wchar_pos = count_wchars_in_utf8(str->mem, pos);
-      size_t wchar_len = count_wchars_in_utf8(str->mem, pos + dellen) - wchar_pos;
-//      printf("deleting %zd (%zd) chars at %zd (%zd)\n", dellen, wchar_len, pos, wchar_pos);
-      rope_del_at_wchar(r, wchar_pos, wchar_len, NULL);
-      str_del(str, pos, dellen);
+  test(rope_char_to_wchar(r, 3) == 4);
+  test(rope_wchar_to_char(r, 4) == 3);
+  test(rope_wchar_to_char(r, 3) == 2); // Inside the surrogate pair.
+  test(rope_wchar_to_char(r, 100) == 4);
+#endif
+  rope_free(r);
+
+  // Check every position of a rope with lots of nodes against its C string.
+  r = rope_new();
+  uint8_t str[1000];
+  for (int i = 0; i < 100; i++) {
+    random_unicode_string(str, 1 + random() % sizeof(str));
+    rope_insert(r, random() % (rope_char_count(r) + 1), str);
+  }
+  const char *ext = "an external node δ";
+  rope_insert_external(r, 50, (const uint8_t *)ext, strlen(ext));
+
+  uint8_t *cstr = rope_create_cstr(r);
+  size_t num_chars = rope_char_count(r), num_bytes = rope_byte_count(r);
+  // Positions of every character, plus the end.
+  size_t *char_bytes = malloc((num_chars + 1) * sizeof(size_t));
+  size_t *byte_chars = malloc((num_bytes + 1) * sizeof(size_t));
+  size_t c = 0;
+  for (size_t b = 0; b <= num_bytes; b++) {
+    if (b == num_bytes || (cstr[b] & 0xc0) != 0x80) char_bytes[c++] = b;
+    byte_chars[b] = c - 1;
+  }
+  byte_chars[num_bytes] = num_chars;
+  test(c == num_chars + 1);
+
+  size_t *positions = malloc((num_bytes + 1) * sizeof(size_t));
+  size_t *out = malloc((num_bytes + 1) * sizeof(size_t));
+  uint32_t *chars = malloc((num_chars + 1) * sizeof(uint32_t));
+  for (size_t i = 0; i <= num_chars; i++) positions[i] = i;
+  rope_chars_to_bytes(r, positions, num_chars + 1, out);
+  test(memcmp(out, char_bytes, (num_chars + 1) * sizeof(size_t)) == 0);
+  rope_chars_at(r, positions, num_chars + 1, chars);
+  test(chars[num_chars] == 0);
+  for (size_t i = 0; i < num_chars; i += 1 + random() % 50) {
+    test(rope_char_at(r, i) == chars[i]);
+    test(rope_char_to_byte(r, i) == char_bytes[i]);
+    if (cstr[char_bytes[i]] < 0x80) test(chars[i] == cstr[char_bytes[i]]);
+  }
+
+  for (size_t i = 0; i <= num_bytes; i++) positions[i] = i;
+  rope_bytes_to_chars(r, positions, num_bytes + 1, out);
+  test(memcmp(out, byte_chars, (num_bytes + 1) * sizeof(size_t)) == 0);
+  test(rope_byte_to_char(r, num_bytes / 2) == byte_chars[num_bytes / 2]);
+
+  // Unsorted positions restart the sweep, and the output can overwrite the input.
+  size_t unsorted[] = {num_chars, 10, 5, num_chars + 10, 0};
+  rope_chars_to_bytes(r, unsorted, 5, unsorted);
+  test(unsorted[0] == num_bytes && unsorted[1] == char_bytes[10] && unsorted[2] == char_bytes[5]);
+  test(unsorted[3] == num_bytes && unsorted[4] == 0);
+  size_t back[] = {num_chars - 1, num_chars / 2, 5};
+  rope_chars_at(r, back, 3, chars);
+  test(chars[0] == rope_char_at(r, num_chars - 1) && chars[1] == rope_char_at(r, num_chars / 2));
+  test(chars[2] == rope_char_at(r, 5));
+
+#if ROPE_WCHAR
+  size_t *char_wchars = malloc((num_chars + 1) * sizeof(size_t));
+  size_t w = 0;
+  for (size_t i = 0; i <= num_chars; i++) {
+    char_wchars[i] = w;
+    if (i < num_chars) w += cstr[char_bytes[i]] >= 0xf0 ? 2 : 1;
+  }
+  for (size_t i = 0; i <= num_chars; i++) positions[i] = i;
+  rope_chars_to_wchars(r, positions, num_chars + 1, out);
+  test(memcmp(out, char_wchars, (num_chars + 1) * sizeof(size_t)) == 0);
+  rope_wchars_to_chars(r, char_wchars, num_chars + 1, out);
+  test(memcmp(out, positions, (num_chars + 1) * sizeof(size_t)) == 0);
+  size_t wchar_back[] = {char_wchars[num_chars], char_wchars[num_chars / 2], 0};
+  rope_wchars_to_chars(r, wchar_back, 3, wchar_back);
+  test(wchar_back[0] == num_chars && wchar_back[1] == num_chars / 2 && wchar_back[2] == 0);
+  for (size_t i = 0; i < num_chars; i += 1 + random() % 50) {
+    test(rope_char_to_wchar(r, i) == char_wchars[i]);
+    test(rope_wchar_to_char(r, char_wchars[i]) == i);
+    // The second half of a surrogate pair rounds down.
+    if (char_wchars[i + 1] == char_wchars[i] + 2) {
+      test(rope_wchar_to_char(r, char_wchars[i] + 1) == i);
     }
   }
-  
+  free(char_wchars);
+#endif
+
+  free(chars);
+  free(out);
+  free(positions);
+  free(byte_chars);
+  free(char_bytes);
+  free(cstr);
   rope_free(r);
-  str_destroy(str);
+#else
+  printf("Skipping position tests - not supported by the B+-tree.\n");
 #endif
 }
 
+#if ROPE_ANCHORS && !ROPE_BTREE
+// Where an anchor at pos should be after num chars are inserted at ins_pos.
+static size_t anchor_after_insert(size_t pos, ROPE_ANCHOR_BIAS bias, size_t ins_pos, size_t num) {
+  return pos > ins_pos || (pos == ins_pos && bias == ROPE_ANCHOR_RIGHT) ? pos + num : pos;
+}
+
+static size_t anchor_after_del(size_t pos, size_t del_pos, size_t num) {
+  return pos <= del_pos ? pos : pos <= del_pos + num ? del_pos : pos - num;
+}
+#endif
+
+static void test_anchors() {
+#if ROPE_ANCHORS && !ROPE_BTREE
+  rope *r = rope_new_with_utf8((uint8_t *)"hello world");
+  rope_anchor *left = rope_anchor_new(r, 5, ROPE_ANCHOR_LEFT);
+  rope_anchor *right = rope_anchor_new(r, 5, ROPE_ANCHOR_RIGHT);
+  rope_anchor *end = rope_anchor_new(r, 100, ROPE_ANCHOR_RIGHT);
+  test(rope_anchor_pos(r, end) == 11);
+
+  rope_insert(r, 5, (uint8_t *)",");
+  test(rope_anchor_pos(r, left) == 5);
+  test(rope_anchor_pos(r, right) == 6);
+  test(rope_anchor_pos(r, end) == 12);
+  rope_del(r, 3, 5);
+  check(r, "helorld");
+  test(rope_anchor_pos(r, left) == 3);
+  test(rope_anchor_pos(r, right) == 3);
+  test(rope_anchor_pos(r, end) == 7);
+  rope_anchor_set(r, left, 1);
+  test(rope_anchor_pos(r, left) == 1);
+
+  // Copies don't share anchors.
+  rope *copy = rope_copy(r);
+  rope_insert(copy, 0, (uint8_t *)"xx");
+  test(rope_anchor_pos(r, left) == 1);
+  rope_free(copy);
+
+  rope_anchor_free(r, right);
+  rope_anchor_free(r, NULL);
+  // left and end are freed with the rope.
+  rope_free(r);
+
+  // Lots of anchors through random edits, including big inserts and external nodes which make
+  // edits split nodes and move anchors between them.
+  r = rope_new();
+  enum { NUM_ANCHORS = 200 };
+  rope_anchor *anchors[NUM_ANCHORS];
+  size_t expected[NUM_ANCHORS];
+  ROPE_ANCHOR_BIAS biases[NUM_ANCHORS];
+  for (int i = 0; i < NUM_ANCHORS; i++) {
+    biases[i] = i % 2 ? ROPE_ANCHOR_RIGHT : ROPE_ANCHOR_LEFT;
+    anchors[i] = rope_anchor_new(r, 0, biases[i]);
+    expected[i] = 0;
+  }
+
+  uint8_t str[3000];
+  const char *ext = "some external text δ𐆔";
+  for (int iter = 0; iter < 1000; iter++) {
+    size_t len = rope_char_count(r);
+    size_t pos = random() % (len + 1);
+    // Sometimes edit right at an anchor.
+    if (iter % 3 == 0) pos = expected[random() % NUM_ANCHORS];
+
+    if (len == 0 || rand_float() < 0.55f) {
+      size_t num;
+      if (iter % 7 == 0) {
+        num = 1 + random() % (strlen(ext) - 1);
+        while ((ext[num] & 0xc0) == 0x80) num--;
+        rope_insert_external(r, pos, (const uint8_t *)ext, num);
+        memcpy(str, ext, num);
+        str[num] = '\0';
+        num = strlen_utf8(str);
+      } else {
+        random_unicode_string(str, 1 + (iter % 10 ? random() % 20 : random() % sizeof(str)));
+        rope_insert(r, pos, str);
+        num = strlen_utf8(str);
+      }
+      for (int i = 0; i < NUM_ANCHORS; i++) {
+        expected[i] = anchor_after_insert(expected[i], biases[i], pos, num);
+      }
+    } else {
+      size_t num = iter % 10 ? random() % 10 : random() % 500;
+      num = MIN(len - pos, num);
+      rope_del(r, pos, num);
+      for (int i = 0; i < NUM_ANCHORS; i++) {
+        expected[i] = anchor_after_del(expected[i], pos, num);
+      }
+    }
+
+    if (iter % 50 == 0) {
+      // Move an anchor somewhere new.
+      int i = random() % NUM_ANCHORS;
+      expected[i] = random() % (rope_char_count(r) + 1);
+      rope_anchor_set(r, anchors[i], expected[i]);
+    }
+
+    for (int i = 0; i < NUM_ANCHORS; i++) {
+      test(rope_anchor_pos(r, anchors[i]) == expected[i]);
+    }
+  }
+
+  for (int i = 0; i < NUM_ANCHORS; i += 2) {
+    rope_anchor_free(r, anchors[i]);
+  }
+  rope_free(r);
+#else
+  printf("Skipping anchor tests - ROPE_ANCHORS disabled.\n");
+#endif
+}
+
+static void test_stats() {
+#if ROPE_STATS && !ROPE_BTREE
+  rope_stats before, stats;
+  rope_get_global_stats(&before);
+
+  rope *r = rope_new();
+  rope_get_stats(r, &stats);
+  test(stats.descents == 0 && stats.nodes_allocated == 0);
+
+  // A small insert fits in the head.
+  rope_insert(r, 0, (uint8_t *)"hi there");
+  rope_insert(r, 2, (uint8_t *)"!");
+  rope_get_stats(r, &stats);
+  test(stats.descents == 2);
+  test(stats.inserts_in_place == 2 && stats.inserts_split == 0);
+  test(stats.bytes_moved == 6);
+  test(stats.nodes_allocated == 0);
+
+  // A big one needs new nodes.
+  uint8_t str[5000];
+  random_ascii_string(str, sizeof(str));
+  rope_insert(r, 3, str);
+  rope_get_stats(r, &stats);
+  test(stats.inserts_split == 1);
+  test(stats.nodes_allocated >= (sizeof(str) - 1) / ROPE_NODE_MAX_SIZE);
+  rope_del(r, 0, rope_char_count(r));
+  rope_get_stats(r, &stats);
+  test(stats.nodes_freed == stats.nodes_allocated);
+
+  rope_reset_stats(r);
+  rope_get_stats(r, &stats);
+  test(stats.descents == 0 && stats.nodes_freed == 0);
+  rope_free(r);
+
+  // Everything was added to the global totals. Other threads aren't using ropes here.
+  rope_get_global_stats(&stats);
+  test(stats.descents == before.descents + 4);
+  test(stats.inserts_in_place == before.inserts_in_place + 2);
+  test(stats.nodes_freed - before.nodes_freed == stats.nodes_allocated - before.nodes_allocated);
+#else
+  printf("Skipping stats tests - ROPE_STATS disabled.\n");
+#endif
+}
+
+static void test_config() {
+#if ROPE_CONFIG && !ROPE_BTREE
+  rope_config bad[] = {{3, 0, 0}, {512, 256, 0}, {0, 0, 100}};
+  for (int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    test(rope_new_with_config(&bad[i]) == NULL);
+  }
+
+  // Tiny nodes in a flat list, big nodes, and the defaults.
+  rope_config configs[] = {{4, 4, 1}, {16, 64, 50}, {4096, 0, 0}, {0, 0, 0}};
+  for (int c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+    rope *r = rope_new_with_config(&configs[c]);
+    test(r != NULL);
+    size_t max_size = r->config.node_max_size;
+    test(max_size >= r->config.node_str_size);
+    test(r->head.capacity == r->config.node_str_size);
+
+    _string *str = str_create();
+    random_edits(r, str, 5000, 300);
+    check(r, (char *)str->mem);
+    ROPE_FOREACH(r, n) {
+      test(n->capacity <= max_size);
+    }
+
+    // Copies keep the config.
+    rope *r2 = rope_copy(r);
+    check(r2, (char *)str->mem);
+    test(r2->config.node_str_size == r->config.node_str_size);
+    test(r2->config.bias == r->config.bias);
+    rope_insert(r2, 0, (uint8_t *)"Inserted into the copy");
+    _rope_check(r2);
+    rope_free(r2);
+
+    rope_free(r);
+    str_destroy(str);
+  }
+
+  // Configured ropes can use custom allocators too.
+  int start_regions = alloced_regions;
+  test(rope_new_with_config2(&bad[0], _alloc, realloc, _free) == NULL);
+  rope *r = rope_new_with_config2(&configs[1], _alloc, realloc, _free);
+  test(r->config.node_str_size == 16);
+  for (int i = 0; i < 50; i++) {
+    rope_insert(r, random() % (rope_char_count(r) + 1), (uint8_t *)"Some text ");
+  }
+  _rope_check(r);
+  test(alloced_regions > start_regions);
+  uint8_t text[501];
+  rope_write_cstr(r, text);
+  test(strlen((char *)text) == 500);
+  rope_free(r);
+  test(alloced_regions == start_regions);
+#else
+  printf("Skipping config tests - ROPE_CONFIG disabled.\n");
+#endif
+}
+
+#if ROPE_NODE_CACHE && !ROPE_BTREE
+#define NUM_CACHE_BLOCKS 64
+
+static void *alloc_cache_blocks(void *arg) {
+  void **blocks = (void **)arg;
+  for (int i = 0; i < NUM_CACHE_BLOCKS; i++) {
+    blocks[i] = rope_cache_alloc(100);
+  }
+  return NULL;
+}
+
+// The same, but starting from an empty cache, so none of the blocks are left over from earlier.
+static void *alloc_fresh_cache_blocks(void *arg) {
+  rope_cache_trim();
+  return alloc_cache_blocks(arg);
+}
+
+static void *make_cached_ropes(void *arg) {
+  rope **ropes = (rope **)arg;
+  for (int i = 0; i < 10; i++) {
+    ropes[i] = rope_new2(rope_cache_alloc, rope_cache_realloc, rope_cache_free);
+    for (int j = 0; j < 50; j++) {
+      rope_insert(ropes[i], 0, (uint8_t *)"Some text in a cached rope. ");
+    }
+  }
+  return NULL;
+}
+#endif
+
+static void test_node_cache() {
+#if ROPE_NODE_CACHE && !ROPE_BTREE
+  // Freed blocks are reused by the next allocation of their size class.
+  void *a = rope_cache_alloc(100);
+  rope_cache_free(a);
+  test(rope_cache_alloc(97) == a);
+  a = rope_cache_realloc(a, 1000);
+  memset(a, 'x', 1000);
+  a = rope_cache_realloc(a, 5000);
+  test(((char *)a)[999] == 'x');
+  rope_cache_free(a);
+
+  // Ropes using the cache.
+  _string *str = str_create();
+  rope *r = rope_new2(rope_cache_alloc, rope_cache_realloc, rope_cache_free);
+  random_edits(r, str, 5000, 500);
+  check_with_free(r, (char *)str->mem, rope_cache_free);
+  rope *r2 = rope_copy(r);
+  rope_free(r);
+  check_with_free(r2, (char *)str->mem, rope_cache_free);
+  rope_free(r2);
+  str_destroy(str);
+
+#if ROPE_CONFIG
+  // Lots of small configured ropes is what the cache is for.
+  rope_config config = {16, 64, 50};
+  r = rope_new_with_config2(&config, rope_cache_alloc, rope_cache_realloc, rope_cache_free);
+  rope_insert(r, 0, (uint8_t *)"Small nodes from the cache");
+  rope_del(r, 0, 6);
+  check_with_free(r, "nodes from the cache", rope_cache_free);
+  rope_free(r);
+#endif
+
+  // Ropes made on one thread can be edited and freed on another.
+  rope *ropes[10];
+  pthread_t thread;
+  pthread_create(&thread, NULL, make_cached_ropes, ropes);
+  pthread_join(thread, NULL);
+  for (int i = 0; i < 10; i++) {
+    rope_del(ropes[i], 10, 1000);
+    rope_insert(ropes[i], 5, (uint8_t *)"hi");
+    _rope_check(ropes[i]);
+    rope_free(ropes[i]);
+  }
+
+  // Blocks freed here go back to the cache of the thread which allocated them, which the next
+  // thread takes over. The ropes' nodes can share the blocks' size class, so they're handed back
+  // first, and the first thread empties the cache it takes over.
+  rope_cache_trim();
+  void *blocks[NUM_CACHE_BLOCKS], *reused[NUM_CACHE_BLOCKS];
+  pthread_create(&thread, NULL, alloc_fresh_cache_blocks, blocks);
+  pthread_join(thread, NULL);
+  for (int i = 0; i < NUM_CACHE_BLOCKS; i++) {
+    rope_cache_free(blocks[i]);
+  }
+  rope_cache_trim();
+  pthread_create(&thread, NULL, alloc_cache_blocks, reused);
+  pthread_join(thread, NULL);
+  for (int i = 0; i < NUM_CACHE_BLOCKS; i++) {
+    int found = 0;
+    for (int j = 0; j < NUM_CACHE_BLOCKS; j++) {
+      if (reused[i] == blocks[j]) found = 1;
+    }
+    test(found);
+    rope_cache_free(reused[i]);
+  }
+  rope_cache_trim();
+#else
+  printf("Skipping node cache tests - ROPE_NODE_CACHE disabled.\n");
+#endif
+}
+
+static void test_arena() {
+#if ROPE_ARENA && !ROPE_BTREE
+  int start_regions = alloced_regions;
+  rope *r = rope_new_arena2(_alloc, realloc, _free);
+  _string *str = str_create();
+  random_edits(r, str, 10000, 2000);
+  check_with_free(r, (char *)str->mem, _free);
+
+  // Once the rope stops growing, edits reuse the nodes earlier edits freed.
+  int regions = alloced_regions;
+  random_edits(r, str, 10000, 20000);
+  check_with_free(r, (char *)str->mem, _free);
+  test(alloced_regions - regions <= 1);
+
+  rope *r2 = rope_copy(r);
+  check_with_free(r2, (char *)str->mem, _free);
+  _string *str2 = str_create();
+  str_insert(str2, 0, str->mem);
+  random_edits(r2, str2, 5000, 1000);
+  check_with_free(r2, (char *)str2->mem, _free);
+  check_with_free(r, (char *)str->mem, _free);
+  rope_free(r2);
+  str_destroy(str2);
+
+  // Big nodes come out of the arena too.
+  uint8_t *big = malloc(100001);
+  random_ascii_string(big, 100001);
+  rope_insert(r, 0, big);
+  str_insert(str, 0, big);
+  check_with_free(r, (char *)str->mem, _free);
+  rope_del(r, 0, 100000);
+  str_del(str, 0, 100000);
+  check_with_free(r, (char *)str->mem, _free);
+  free(big);
+
+  rope_free(r);
+  str_destroy(str);
+  test(alloced_regions == start_regions);
+#else
+  printf("Skipping arena tests - ROPE_ARENA disabled.\n");
+#endif
+}
+
+#if !ROPE_BTREE
+// Relayout r and check nothing about its contents changed.
+static void check_relayout(rope *r, int repack) {
+  uint8_t *before = rope_create_cstr(r);
+  size_t chars = rope_char_count(r);
+#if ROPE_WCHAR
+  size_t wchars = rope_wchar_count(r);
+#endif
+#if ROPE_HASH
+  uint64_t hash = rope_hash(r);
+  uint64_t range_hash = rope_range_hash(r, chars / 3, chars / 3);
+#endif
+  size_t nodes = count_nodes(r);
+
+  rope_relayout(r, repack);
+  _rope_check(r);
+  test(rope_char_count(r) == chars);
+  uint8_t *after = rope_create_cstr(r);
+  test(strcmp((char *)before, (char *)after) == 0);
+  r->free(before);
+  r->free(after);
+#if ROPE_WCHAR
+  test(rope_wchar_count(r) == wchars);
+#endif
+#if ROPE_HASH
+  test(rope_hash(r) == hash);
+  test(rope_range_hash(r, chars / 3, chars / 3) == range_hash);
+#endif
+  if (repack) {
+    test(count_nodes(r) <= nodes);
+  } else {
+    test(count_nodes(r) == nodes);
+  }
+}
+#endif
+
+static void test_relayout() {
+#if !ROPE_BTREE
+  rope *r = rope_new();
+  check_relayout(r, 0);
+  check_relayout(r, 1);
+  check(r, "");
+
+  // Lots of small edits leave lots of part full nodes, along with some external ones.
+  _string *str = str_create();
+  const char *ext = "external text δ𐆔 ";
+  for (int i = 0; i < 60; i++) {
+    size_t pos = random() % (str_num_chars(str) + 1);
+    rope_insert_external(r, pos, (const uint8_t *)ext, strlen(ext));
+    str_insert(str, pos, (const uint8_t *)ext);
+    random_edits(r, str, 20000, 50);
+  }
+  check(r, (char *)str->mem);
+
+#if ROPE_ANCHORS
+  enum { NUM_ANCHORS = 100 };
+  rope_anchor *anchors[NUM_ANCHORS];
+  size_t expected[NUM_ANCHORS];
+  size_t len = rope_char_count(r);
+  for (int i = 0; i < NUM_ANCHORS; i++) {
+    // Include both ends of the rope.
+    expected[i] = i == 0 ? 0 : i == 1 ? len : random() % (len + 1);
+    anchors[i] = rope_anchor_new(r, expected[i], i % 2 ? ROPE_ANCHOR_RIGHT : ROPE_ANCHOR_LEFT);
+  }
+#endif
+
+  size_t nodes = count_nodes(r);
+  check_relayout(r, 0);
+  check(r, (char *)str->mem);
+  check_relayout(r, 1);
+  check(r, (char *)str->mem);
+  test(count_nodes(r) < nodes);
+#if ROPE_ANCHORS
+  for (int i = 0; i < NUM_ANCHORS; i++) {
+    test(rope_anchor_pos(r, anchors[i]) == expected[i]);
+  }
+#endif
+
+  // The rope still edits normally afterwards.
+  rope_insert(r, 10, (uint8_t *)"hi");
+  str_insert(str, 10, (uint8_t *)"hi");
+  rope_del(r, str_num_chars(str) / 2, 20);
+  str_del(str, str_num_chars(str) / 2, 20);
+  check(r, (char *)str->mem);
+  check_relayout(r, 1);
+  check(r, (char *)str->mem);
+  rope_free(r);
+  str_destroy(str);
+
+#if ROPE_ARENA
+  // Arena ropes move into a new arena, and the old one is freed.
+  int start_regions = alloced_regions;
+  r = rope_new_arena2(_alloc, realloc, _free);
+  str = str_create();
+  random_edits(r, str, 10000, 2000);
+  check_relayout(r, 0);
+  check_with_free(r, (char *)str->mem, _free);
+  check_relayout(r, 1);
+  check_with_free(r, (char *)str->mem, _free);
+  random_edits(r, str, 10000, 2000);
+  check_with_free(r, (char *)str->mem, _free);
+  rope_free(r);
+  str_destroy(str);
+  test(alloced_regions == start_regions);
+#endif
+#else
+  printf("Skipping relayout tests - not supported by the B+-tree.\n");
+#endif
+}
+
+#if ROPE_COMPRESS && !ROPE_BTREE
+// Fill buffer (of size s) with words from a small vocabulary, which compresses like real text.
+static void random_words(uint8_t *buffer, size_t s) {
+  static const char *words[] = {
+    "the ", "rope ", "node ", "skip ", "list ", "of ", "δέλτα ", "日本語 ", "𐆔 ", ".\n"
+  };
+  size_t len = 0;
+  for (;;) {
+    const char *word = words[random() % (sizeof(words) / sizeof(words[0]))];
+    if (len + strlen(word) >= s) break;
+    memcpy(&buffer[len], word, strlen(word));
+    len += strlen(word);
+  }
+  buffer[len] = '\0';
+}
+
+// Insert num_bytes of words at the start of r and str.
+static void insert_words(rope *r, _string *str, size_t num_bytes) {
+  uint8_t *words = malloc(num_bytes + 1);
+  random_words(words, num_bytes + 1);
+  rope_insert(r, 0, words);
+  str_insert(str, 0, words);
+  free(words);
+}
+#endif
+
+static void test_compress() {
+#if ROPE_COMPRESS && !ROPE_BTREE
+  rope *r = rope_new();
+  rope_compress(r);
+  check(r, "");
+
+  // Mostly words, which compress, with random edits on top, which mostly don't.
+  _string *str = str_create();
+  insert_words(r, str, 60000);
+  random_edits(r, str, 40000, 500);
+  check(r, (char *)str->mem);
+#if ROPE_ANCHORS
+  size_t anchor_pos = rope_char_count(r) / 2;
+  rope_anchor *anchor = rope_anchor_new(r, anchor_pos, ROPE_ANCHOR_LEFT);
+#endif
+
+  for (int round = 0; round < 20; round++) {
+    rope_compress(r);
+    test(r->num_compressed > 0);
+    // Reading the whole rope out decompresses straight into the string.
+    size_t compressed = r->num_compressed;
+    check_with_free(r, (char *)str->mem, r->free);
+    test(r->num_compressed == compressed);
+
+    // A rope with the same contents which isn't compressed, to compare with.
+    rope *plain = rope_new_with_utf8(str->mem);
+#if ROPE_WCHAR
+    test(rope_wchar_count(r) == rope_wchar_count(plain));
+#endif
+#if ROPE_HASH
+    test(rope_hash(r) == rope_hash(plain));
+#endif
+
+    // Reads only decompress the nodes they land in.
+    size_t len = rope_char_count(r);
+    test(rope_char_at(r, len / 2) == rope_char_at(plain, len / 2));
+    test(r->num_compressed + 1 >= compressed);
+    for (int i = 0; i < 20; i++) {
+      size_t pos = random() % len;
+      test(rope_char_at(r, pos) == rope_char_at(plain, pos));
+      test(rope_char_to_byte(r, pos) == rope_char_to_byte(plain, pos));
+#if ROPE_WCHAR
+      test(rope_char_to_wchar(r, pos) == rope_char_to_wchar(plain, pos));
+      size_t wchar_pos = random() % rope_wchar_count(r);
+      test(rope_wchar_to_char(r, wchar_pos) == rope_wchar_to_char(plain, wchar_pos));
+#endif
+#if ROPE_HASH
+      size_t num = random() % (len - pos + 1);
+      test(rope_range_hash(r, pos, num) == rope_range_hash(plain, pos, num));
+#endif
+    }
+    rope_free(plain);
+#if ROPE_ANCHORS
+    test(rope_anchor_pos(r, anchor) == anchor_pos);
+#endif
+
+    // Long deletes take out whole compressed nodes.
+    size_t pos = random() % len;
+    size_t num = MIN(len - pos, 2000);
+    rope_del(r, pos, num);
+    str_del(str, pos, num);
+    random_edits(r, str, 40000, 50);
+    check_with_free(r, (char *)str->mem, r->free);
+#if ROPE_ANCHORS
+    rope_anchor_set(r, anchor, anchor_pos);
+#endif
+
+    if (round % 5 == 0) {
+      // Copies and relayouts keep compressed nodes compressed.
+      rope *copy = rope_copy(r);
+      test(copy->num_compressed == r->num_compressed);
+      check_with_free(copy, (char *)str->mem, copy->free);
+      rope_free(copy);
+      compressed = r->num_compressed;
+      rope_relayout(r, round % 10 == 0);
+      test(r->num_compressed == compressed);
+      check_with_free(r, (char *)str->mem, r->free);
+    }
+  }
+
+  // Comparisons read compressed nodes without decompressing them.
+  rope_compress(r);
+  size_t compressed = r->num_compressed;
+  test(compressed > 0);
+  rope *plain = rope_new_with_utf8(str->mem);
+  test(rope_equal(r, plain));
+  test(rope_compare(plain, r) == 0);
+  test(rope_equal_buf(r, str->mem, strlen((char *)str->mem)));
+  test(r->num_compressed == compressed);
+  rope_insert(plain, 0, (uint8_t *)"a");
+  test(rope_compare(r, plain) != 0);
+  rope_free(plain);
+
+  // ROPE_FOREACH decompresses everything.
+  count_nodes(r);
+  test(r->num_compressed == 0);
+  rope_compress(r);
+  rope_decompress(r);
+  test(r->num_compressed == 0);
+  check(r, (char *)str->mem);
+
+  // Random text doesn't compress, so it's just repacked.
+  rope_free(r);
+  uint8_t text[4001];
+  random_ascii_string(text, sizeof(text));
+  r = rope_new_with_utf8(text);
+  rope_compress(r);
+  test(r->num_compressed == 0);
+  check(r, (char *)text);
+  rope_free(r);
+
+  // Long runs of literals and long matches have their lengths spread over several bytes.
+  // The head node is never compressed, so the runs start past it.
+  memset(&text[1400], 'x', 2600);
+  r = rope_new_with_utf8(text);
+  rope_compress(r);
+  test(r->num_compressed > 0);
+  check(r, (char *)text);
+  rope_free(r);
+  str_destroy(str);
+
+#if ROPE_ARENA
+  int start_regions = alloced_regions;
+  r = rope_new_arena2(_alloc, realloc, _free);
+  str = str_create();
+  insert_words(r, str, 30000);
+  random_edits(r, str, 20000, 1000);
+  rope_compress(r);
+  test(r->num_compressed > 0);
+  random_edits(r, str, 20000, 1000);
+  check_with_free(r, (char *)str->mem, _free);
+  rope_free(r);
+  str_destroy(str);
+  test(alloced_regions == start_regions);
+#endif
+
+#if ROPE_CONFIG
+  // Ropes with bigger nodes than ROPE_NODE_MAX_SIZE are compared through a buffer from their
+  // allocator.
+  rope_config config = {0, 4 * ROPE_NODE_MAX_SIZE, 0};
+  r = rope_new_with_config(&config);
+  str = str_create();
+  insert_words(r, str, 30000);
+  random_edits(r, str, 20000, 200);
+  rope_compress(r);
+  compressed = r->num_compressed;
+  test(compressed > 0);
+  plain = rope_new_with_utf8(str->mem);
+  test(rope_equal(r, plain));
+  test(rope_equal_buf(r, str->mem, strlen((char *)str->mem)));
+  test(r->num_compressed == compressed);
+  check(r, (char *)str->mem);
+  rope_free(r);
+  rope_free(plain);
+  str_destroy(str);
+#endif
+#else
+  printf("Skipping compression tests - ROPE_COMPRESS disabled.\n");
+#endif
+}
+
+#if ROPE_FILE_IO && !ROPE_BTREE
+// Write len bytes to a new temporary file, and return a descriptor to read them back from. The
+// file's name is copied into path.
+static int temp_file(const uint8_t *data, size_t len, char *path) {
+  strcpy(path, "/tmp/librope_test_XXXXXX");
+  int fd = mkstemp(path);
+  test(fd >= 0);
+  test(write(fd, data, len) == (ssize_t)len);
+  test(lseek(fd, 0, SEEK_SET) == 0);
+  return fd;
+}
+
+// Read data into r through a temporary file, and check it ends up as expected.
+static void check_read_fd(rope *r, const uint8_t *data, size_t len, ROPE_RESULT result,
+    const char *expected) {
+  char path[32];
+  int fd = temp_file(data, len, path);
+  test(rope_read_fd(r, fd) == result);
+  close(fd);
+  unlink(path);
+  check(r, (char *)expected);
+}
+#endif
+
+static void test_read_fd() {
+#if ROPE_FILE_IO && !ROPE_BTREE
+  rope *r = rope_new();
+  check_read_fd(r, (uint8_t *)"", 0, ROPE_OK, "");
+  check_read_fd(r, (uint8_t *)"hi δ", 5, ROPE_OK, "hi δ");
+  // A short read isn't left holding a whole node's worth of room.
+  test(r->head.nexts[0].node->capacity <= ROPE_NODE_STR_SIZE);
+  // Reads append to what's there.
+  check_read_fd(r, (uint8_t *)" there", 6, ROPE_OK, "hi δ there");
+
+  // Bad text leaves the rope alone, wherever it turns up.
+  check_read_fd(r, (uint8_t *)"\xe0\xb0", 2, ROPE_INVALID_UTF8, "hi δ there");
+  check_read_fd(r, (uint8_t *)"abc\xe2\x82", 5, ROPE_INVALID_UTF8, "hi δ there");
+  check_read_fd(r, (uint8_t *)"a\0b", 3, ROPE_INVALID_UTF8, "hi δ there");
+  test(rope_read_fd(r, -1) == ROPE_IO_ERROR);
+  test(errno == EBADF);
+  check(r, "hi δ there");
+
+  // A big file, with characters split across lots of reads and nodes.
+  size_t len = 300000;
+  uint8_t *text = malloc(len + 1);
+  random_unicode_string(text, len + 1);
+  len = strlen((char *)text);
+  _string *str = str_create();
+  str_insert(str, 0, (uint8_t *)"hi δ there");
+  str_insert(str, str_num_chars(str), text);
+#if ROPE_ANCHORS
+  rope_anchor *left = rope_anchor_new(r, 100, ROPE_ANCHOR_LEFT);
+  rope_anchor *right = rope_anchor_new(r, 100, ROPE_ANCHOR_RIGHT);
+#endif
+  check_read_fd(r, text, len, ROPE_OK, (char *)str->mem);
+  test(rope_char_count(r) == str_num_chars(str));
+  // Nodes come out within a few bytes of the biggest a node can be.
+  test(count_nodes(r) <= len / (ROPE_NODE_MAX_SIZE - 10) + 3);
+#if ROPE_ANCHORS
+  test(rope_anchor_pos(r, left) == 10);
+  test(rope_anchor_pos(r, right) == rope_char_count(r));
+#endif
+#if ROPE_HASH
+  rope *r2 = rope_new_with_utf8(str->mem);
+  test(rope_hash(r) == rope_hash(r2));
+  rope_free(r2);
+#endif
+
+  // A bad byte a long way in takes out everything read before it.
+  uint8_t replaced = text[len - 10];
+  text[len - 10] = 0xff;
+  check_read_fd(r, text, len, ROPE_INVALID_UTF8, (char *)str->mem);
+  text[len - 10] = replaced;
+  rope_free(r);
+
+#if ROPE_CONFIG
+  // Tiny nodes split almost every character.
+  rope_config config = {8, 10, 0};
+  r = rope_new_with_config(&config);
+  str_del(str, 0, str_num_chars(str));
+  str_insert(str, 0, text);
+  check_read_fd(r, text, len, ROPE_OK, (char *)str->mem);
+  rope_free(r);
+  config.node_max_size = 8;
+  r = rope_new_with_config(&config);
+  test(rope_read_fd(r, 0) == ROPE_IO_ERROR);
+  test(errno == EINVAL);
+  rope_free(r);
+#endif
+  str_destroy(str);
+
+  char path[32];
+  close(temp_file((uint8_t *)"file contents ↻", 17, path));
+  r = rope_load_file(path);
+  check(r, "file contents ↻");
+  rope_free(r);
+  unlink(path);
+  test(rope_load_file(path) == NULL);
+  test(errno == ENOENT);
+  close(temp_file((uint8_t *)"\xff", 1, path));
+  test(rope_load_file(path) == NULL);
+  test(errno == EILSEQ);
+  unlink(path);
+  free(text);
+#else
+  printf("Skipping file reading tests - ROPE_FILE_IO disabled.\n");
+#endif
+}
+
+static void test_write_fd() {
+#if ROPE_FILE_IO && !ROPE_BTREE
+  rope *r = rope_new();
+  struct iovec iov[8];
+  size_t chars = 1;
+  test(rope_to_iovec(r, 0, 0, iov, 8, &chars) == 0);
+  test(chars == 0);
+
+  // Ranges past the end are clamped.
+  rope_insert(r, 0, (uint8_t *)"abc");
+  test(rope_to_iovec(r, 2, 5, iov, 8, &chars) == 1);
+  test(chars == 1 && iov[0].iov_len == 1 && *(char *)iov[0].iov_base == 'c');
+  test(rope_to_iovec(r, 10, 5, iov, 8, &chars) == 0);
+  test(chars == 0);
+  rope_del(r, 0, 3);
+
+  // A rope with lots of small nodes, some with unicode split over them.
+  uint8_t str[100];
+  for (int i = 0; i < 1000; i++) {
+    random_unicode_string(str, 1 + random() % sizeof(str));
+    rope_insert(r, random() % (rope_char_count(r) + 1), str);
+  }
+  uint8_t *contents = rope_create_cstr(r);
+  uint8_t *joined = malloc(rope_byte_count(r));
+
+  for (int i = 0; i < 1000; i++) {
+    size_t len = rope_char_count(r);
+    size_t pos = random() % (len + 1);
+    size_t num = random() % (len - pos + 1);
+    size_t max = 1 + random() % 8;
+
+    // Take the range a few nodes at a time, and check the pieces join up into it.
+    size_t done = 0, joined_bytes = 0;
+    while (done < num) {
+      size_t filled = rope_to_iovec(r, pos + done, num - done, iov, max, &chars);
+      test(filled > 0 && filled <= max);
+      test(chars > 0 && chars <= num - done);
+      for (size_t j = 0; j < filled; j++) {
+        test(iov[j].iov_len > 0);
+        memcpy(&joined[joined_bytes], iov[j].iov_base, iov[j].iov_len);
+        joined_bytes += iov[j].iov_len;
+      }
+      done += chars;
+    }
+    size_t start = rope_char_to_byte(r, pos);
+    test(joined_bytes == rope_char_to_byte(r, pos + num) - start);
+    test(memcmp(joined, &contents[start], joined_bytes) == 0);
+  }
+  free(joined);
+
+  char path[32];
+  int fd = temp_file((uint8_t *)"", 0, path);
+  test(rope_write_fd(r, fd) == ROPE_OK);
+  close(fd);
+  rope *r2 = rope_load_file(path);
+  check(r2, (char *)contents);
+  rope_free(r2);
+  unlink(path);
+  free(contents);
+
+  test(rope_write_fd(r, -1) == ROPE_IO_ERROR);
+  test(errno == EBADF);
+  rope_free(r);
+#else
+  printf("Skipping file writing tests - ROPE_FILE_IO disabled.\n");
+#endif
+}
+
+static void test_hash() {
+#if ROPE_HASH && !ROPE_BTREE
+  rope *r = rope_new();
+  test(rope_hash(r) == 0);
+  test(rope_range_hash(r, 0, 10) == 0);
+  rope_insert(r, 0, (uint8_t *)"hi δ there");
+  test(rope_hash(r) != 0);
+  test(rope_range_hash(r, 0, 100) == rope_hash(r));
+  test(rope_range_hash(r, 3, 0) == 0);
+  rope *other = rope_new_with_utf8((uint8_t *)"hi δ therf");
+  test(rope_hash(r) != rope_hash(other));
+  rope_free(other);
+  rope_free(r);
+
+  // The hashes only depend on the contents, not the edits which produced them.
+  _string *str = str_create();
+  r = rope_new();
+  uint8_t strbuffer[500];
+  for (int i = 0; i < 1000; i++) {
+    size_t len = str_num_chars(str);
+    if (len == 0 || rand_float() < 0.6f) {
+      random_unicode_string(strbuffer, 1 + random() % (rand_float() < 0.9f ? 20 : 500));
+      size_t pos = random() % (len + 1);
+      rope_insert(r, pos, strbuffer);
+      str_insert(str, pos, strbuffer);
+    } else {
+      size_t pos = random() % len;
+      size_t dellen = random() % 50;
+      dellen = MIN(len - pos, dellen);
+      rope_del(r, pos, dellen);
+      str_del(str, pos, dellen);
+    }
+
+    if (i % 50 == 0) {
+      len = str_num_chars(str);
+      other = rope_new_with_utf8(str->mem);
+      test(rope_hash(r) == rope_hash(other));
+
+      size_t pos = random() % (len + 1);
+      size_t num = random() % (len - pos + 1);
+      rope_del(other, pos + num, len);
+      rope_del(other, 0, pos);
+      test(rope_range_hash(r, pos, num) == rope_hash(other));
+      rope_free(other);
+    }
+  }
+  _rope_check(r);
+
+  rope_free(r);
+  str_destroy(str);
+#else
+  printf("Skipping hash tests - ROPE_HASH disabled.\n");
+#endif
+}
+
+#if !ROPE_BTREE
+static int sign(int x) {
+  return (x > 0) - (x < 0);
+}
+
+static void check_compare(rope *a, rope *b) {
+  uint8_t *sa = rope_create_cstr(a), *sb = rope_create_cstr(b);
+  int expected = sign(strcmp((char *)sa, (char *)sb));
+  test(sign(rope_compare(a, b)) == expected);
+  test(sign(rope_compare(b, a)) == -expected);
+  test(rope_equal(a, b) == (expected == 0));
+  test(sign(rope_compare_buf(a, sb, strlen((char *)sb))) == expected);
+  test(rope_equal_buf(a, sb, strlen((char *)sb)) == (expected == 0));
+  free(sa);
+  free(sb);
+}
+#endif
+
+static void test_compare() {
+#if !ROPE_BTREE
+  rope *a = rope_new(), *b = rope_new();
+  check_compare(a, b);
+  test(rope_equal(a, a));
+
+  // Same contents split into nodes differently.
+  rope_insert(a, 0, (uint8_t *)"hi there δ friend");
+  const char *parts[] = {"hi", " th", "ere δ", " f", "riend"};
+  for (int i = 0; i < 5; i++) {
+    rope_insert_external(b, rope_char_count(b), (uint8_t *)parts[i], strlen(parts[i]));
+  }
+  check_compare(a, b);
+  test(rope_equal(a, b));
+
+  rope_del(b, 16, 1);
+  check_compare(a, b);
+  rope_insert(b, 16, (uint8_t *)"e");
+  check_compare(a, b);
+  rope_del(b, 16, 1);
+  rope_insert(b, 16, (uint8_t *)"𐆔");
+  check_compare(a, b);
+
+  rope *c = rope_copy(b);
+  check_compare(b, c);
+  test(rope_equal(b, c));
+  rope_free(c);
+  rope_free(a);
+  rope_free(b);
+
+  // Random ropes with the same contents in differently sized nodes, then with small differences.
+  uint8_t *str = malloc(20001);
+  for (int i = 0; i < 100; i++) {
+    random_unicode_string(str, 1 + random() % 20000);
+    size_t len = strlen((char *)str);
+    a = rope_new_with_utf8(str);
+    b = rope_new();
+    for (size_t p = 0, end; p < len; p = end) {
+      end = p + 1 + random() % 300;
+      end = MIN(len, end);
+      while ((str[end] & 0xc0) == 0x80) end++;
+      rope_insert_external(b, rope_char_count(b), &str[p], end - p);
+    }
+    check_compare(a, b);
+
+    size_t pos = random() % (rope_char_count(a) + 1);
+    if (i % 2) {
+      rope_insert(a, pos, (uint8_t *)UCHARS[random() % (sizeof(UCHARS) / sizeof(UCHARS[0]))]);
+    } else {
+      rope_del(a, pos, 1);
+    }
+    check_compare(a, b);
+    rope_free(a);
+    rope_free(b);
+  }
+  free(str);
+#else
+  printf("Skipping comparison tests - not supported by the B+-tree.\n");
+#endif
+}
+
+#if !ROPE_BTREE
+// Advance str by num utf8 characters.
+static uint8_t *skip_chars(uint8_t *str, size_t num) {
+  for (; num; num--) {
+    do str++; while ((*str & 0xc0) == 0x80);
+  }
+  return str;
+}
+
+// Check that applying the diff of a and b to a turns it into b.
+static void check_diff(rope *a, rope *b) {
+  rope_diff_edit *edits;
+  size_t num_edits = rope_diff(a, b, &edits);
+  test((num_edits == 0) == rope_equal(a, b));
+  test((edits == NULL) == (num_edits == 0));
+
+  rope *r = rope_copy(a);
+#if ROPE_WCHAR
+  rope *w = rope_copy(a);
+#endif
+  uint8_t *b_str = rope_create_cstr(b);
+  uint8_t *b_pos = b_str;
+  size_t prev_end = 0;
+  for (size_t i = 0; i < num_edits; i++) {
+    rope_diff_edit *e = &edits[i];
+    test(e->del_chars || e->ins_chars);
+    test(i == 0 || e->pos > prev_end);
+
+    // The inserted text comes from b at the same position.
+    b_pos = skip_chars(b_pos, e->pos - prev_end);
+    uint8_t *b_end = skip_chars(b_pos, e->ins_chars);
+    uint8_t saved = *b_end;
+    *b_end = '\0';
+
+    rope_del(r, e->pos, e->del_chars);
+    rope_insert(r, e->pos, b_pos);
+#if ROPE_WCHAR
+    size_t len;
+    rope_del_at_wchar(w, e->wchar_pos, e->del_wchars, &len);
+    test(len == e->del_chars);
+    rope_insert_at_wchar(w, e->wchar_pos, b_pos);
+    test(wchar_size_count(b_pos) == e->ins_wchars);
+#endif
+    *b_end = saved;
+    b_pos = b_end;
+    prev_end = e->pos + e->ins_chars;
+  }
+  free(b_str);
+  test(rope_equal(r, b));
+  rope_free(r);
+#if ROPE_WCHAR
+  test(rope_equal(w, b));
+  rope_free(w);
+#endif
+  free(edits);
+}
+#endif
+
+static void test_diff() {
+#if !ROPE_BTREE
+  rope *a = rope_new_with_utf8((uint8_t *)"the quick brown fox");
+  rope *b = rope_new_with_utf8((uint8_t *)"the quick brown fox");
+  check_diff(a, b);
+  rope_del(b, 4, 6);
+  rope_insert(b, 10, (uint8_t *)"δ𐆔");
+  check_diff(a, b);
+  check_diff(b, a);
+
+  rope_diff_edit *edits;
+  test(rope_diff(a, b, &edits) == 2);
+  test(edits[0].pos == 4 && edits[0].del_chars == 6 && edits[0].ins_chars == 0);
+  test(edits[1].pos == 10 && edits[1].del_chars == 0 && edits[1].ins_chars == 2);
+  free(edits);
+  rope_free(a);
+  rope_free(b);
+
+  // Random edits to random documents. Some are too big for a character by character diff.
+  uint8_t strbuffer[100];
+  for (int i = 0; i < 200; i++) {
+    size_t doc_size = i % 20 ? 5000 : 50000;
+    uint8_t *doc = malloc(doc_size);
+    random_unicode_string(doc, doc_size);
+    a = rope_new_with_utf8(doc);
+    b = rope_new_with_utf8(doc);
+    int num_edits = random() % (i % 10 ? 10 : 2000);
+    for (int e = 0; e < num_edits; e++) {
+      size_t len = rope_char_count(b);
+      size_t pos = random() % (len + 1);
+      if (random() % 2) {
+        random_unicode_string(strbuffer, 1 + random() % 20);
+        rope_insert(b, pos, strbuffer);
+      } else {
+        rope_del(b, pos, random() % 20);
+      }
+    }
+    check_diff(a, b);
+    rope_free(a);
+    rope_free(b);
+    free(doc);
+  }
+#else
+  printf("Skipping diff tests - not supported by the B+-tree.\n");
+#endif
+}
+
+static void test_custom_allocator() {
+  // Its really hard to test that malloc is never called, but I can make sure
+  // custom frees match custom allocs.
+  rope *r = rope_new2(_alloc, realloc, _free);
+  for (int i = 0; i < 100; i++) {
+    rope_insert(r, random() % (rope_char_count(r) + 1),
+        (uint8_t *)"Whoa super happy fun times!\n");
+  }
+
+  rope_free(r);
+
+  test(alloced_regions == 0);
+}
+
+static void test_copy() {
+  // Copy an empty string.
+  rope *r1 = rope_new();
+  rope *r2 = rope_copy(r1);
+  check(r2, "");
+  rope_free(r2);
+  
+  // Insert some text (less than one node worth)
+  rope_insert(r1, 0, (uint8_t *)"Eureka!");
+  r2 = rope_copy(r1);
+  check(r2, "Eureka!");
+  
+  rope_free(r1);
+  rope_free(r2);
+}
+
+static void test_append() {
+  rope *r = rope_new();
+  test(rope_append(r, (uint8_t *)"") == ROPE_OK);
+  check(r, "");
+  test(rope_append(r, (uint8_t *)"hi") == ROPE_OK);
+  test(rope_append(r, (uint8_t *)" there δ") == ROPE_OK);
+  check(r, "hi there δ");
+  test(rope_append(r, (uint8_t *)"\xe0\xb0") == ROPE_INVALID_UTF8);
+  check(r, "hi there δ");
+
+  // Runs of appends, with other edits in between which can change where the end is.
+  _string *str = str_create();
+  str_insert(str, 0, (uint8_t *)"hi there δ");
+  uint8_t strbuffer[1001];
+  for (int i = 0; i < 2000; i++) {
+    size_t len = str_num_chars(str);
+    // Mostly small appends, with the odd one big enough to need several nodes.
+    random_unicode_string(strbuffer, 1 + (i % 100 ? random() % 20 : random() % 1000));
+    rope_append(r, strbuffer);
+    str_insert(str, len, strbuffer);
+    if (i % 50 == 0) check(r, (char *)str->mem);
+
+    if (i % 10 == 0) {
+      // Delete from the end, which can free the last nodes.
+      size_t num = random() % 200;
+      num = MIN(str_num_chars(str), num);
+      rope_del(r, str_num_chars(str) - num, num);
+      str_del(str, str_num_chars(str) - num, num);
+    } else if (i % 10 == 5) {
+      size_t pos = random() % (str_num_chars(str) + 1);
+      rope_insert(r, pos, strbuffer);
+      str_insert(str, pos, strbuffer);
+    }
+  }
+  check(r, (char *)str->mem);
+
+  // Appends to copies don't change the original.
+  rope *r2 = rope_copy(r);
+  rope_append(r2, (uint8_t *)"copy");
+  check(r, (char *)str->mem);
+  str_insert(str, str_num_chars(str), (uint8_t *)"copy");
+  check(r2, (char *)str->mem);
+  rope_free(r2);
+
+  rope_free(r);
+  str_destroy(str);
+
+  // Anything appending allocates is freed with the rope.
+  int start_regions = alloced_regions;
+  r = rope_new2(_alloc, realloc, _free);
+  for (int i = 0; i < 100; i++) {
+    rope_append(r, (uint8_t *)"Whoa super happy fun times!\n");
+  }
+  rope_free(r);
+  test(alloced_regions == start_regions);
+
+#if ROPE_HASH && !ROPE_BTREE
+  r = rope_new();
+  r2 = rope_new();
+  for (int i = 0; i < 500; i++) {
+    rope_append(r, (uint8_t *)"Appending text. ");
+    rope_insert(r2, rope_char_count(r2), (uint8_t *)"Appending text. ");
+  }
+  test(rope_hash(r) == rope_hash(r2));
+  rope_free(r);
+  rope_free(r2);
+#endif
+}
+
+static void test_random_edits() {
+  // This string should always have the same content as the rope.
+  _string *str = str_create();
+  rope *r = rope_new();
+  
+  const size_t max_stringsize = 1000;
+  uint8_t strbuffer[max_stringsize + 1];
+  
+  for (int i = 0; i < 1000; i++) {
+    // First, some sanity checks.
+    check(r, (char *)str->mem);
+    
+    rope *r2 = rope_copy(r);
+    check(r2, (char *)str->mem);
+    rope_free(r2);
+    
+//    printf("String contains '%s'\n", str->mem);
+    test(rope_byte_count(r) == str->len);
+    size_t len = strlen_utf8(str->mem);
+    test(rope_char_count(r) == len);
+    test(str_num_chars(str) == len);
+    
+    if (len == 0 || rand_float() < 0.5f) {
+      // Insert.
+      random_unicode_string(strbuffer, 1 + random() % max_stringsize);
+      size_t pos = random() % (len + 1);
+      
+//      printf("inserting %s at %zd\n", strbuffer, pos);
+      rope_insert(r, pos, strbuffer);
+      str_insert(str, pos, strbuffer);
+    } else {
+      // Delete
+      size_t pos = random() % len;
+      
+      size_t dellen = random() % 10;
+      dellen = MIN(len - pos, dellen);
+      
+//      printf("deleting %zd chars at %zd\n", dellen, pos);
+      rope_del(r, pos, dellen);
+      str_del(str, pos, dellen);
+    }
+  }
+  
+  rope_free(r);
+  str_destroy(str);
+}
+
+static void test_random_wchar_edits() {
+#if ROPE_WCHAR
+  // This string should always have the same content as the rope.
+  // Both are stored using UTF-8, but we'll make edits using the wchar functions.
+  _string *str = str_create();
+  rope *r = rope_new();
+  
+  const size_t max_stringsize = 1000;
+  uint8_t strbuffer[max_stringsize + 1];
+  
+  for (int i = 0; i < 1000; i++) {
+    check(r, (char *)str->mem);
+    
+//    printf("String contains '%s'\n", str->mem);
+    test(rope_byte_count(r) == str->len);
+    size_t len = strlen_utf8(str->mem);
+    test(rope_char_count(r) == len);
+    test(str_num_chars(str) == len);
+    test(rope_wchar_count(r) == wchar_size_count(str->mem));
+    
+    if (len == 0 || rand_float() < 0.5f) {
+      // Insert.
+      random_unicode_string(strbuffer, 1 + random() % max_stringsize);
+      size_t pos = random() % (len + 1);
+      
+      // We need to convert pos to the wchar offset. There's a private function in rope.c for this
+      // but ...
+      size_t wchar_pos = count_wchars_in_utf8(str->mem, pos);
+      
+//      printf("inserting '%s' at %zd\n", strbuffer, pos);
+      rope_insert_at_wchar(r, wchar_pos, strbuffer);
+      str_insert(str, pos, strbuffer);
+    } else {
+      // Delete
+      size_t pos = random() % len;
+      
+      size_t dellen = random() % 10;
+      dellen = MIN(len - pos, dellen);
+      
+      size_t wchar_pos = count_wchars_in_utf8(str->mem, pos);
+      size_t wchar_len = count_wchars_in_utf8(str->mem, pos + dellen) - wchar_pos;
+//      printf("deleting %zd (%zd) chars at %zd (%zd)\n", dellen, wchar_len, pos, wchar_pos);
+      rope_del_at_wchar(r, wchar_pos, wchar_len, NULL);
+      str_del(str, pos, dellen);
+    }
+  }
+  
+  rope_free(r);
+  str_destroy(str);
+#endif
+}
+
+
+#if ROPE_CONCURRENT && !ROPE_BTREE
+// The writer only ever inserts and deletes whole copies of this block, at block boundaries. So
+// any consistent snapshot of the rope is the block repeated some number of times.
+static const char CONCURRENT_BLOCK[] = "012345678δ";
+#define CONCURRENT_BLOCK_CHARS 10
+#define CONCURRENT_BLOCK_BYTES (sizeof(CONCURRENT_BLOCK) - 1)
+
+typedef struct {
+  rope *r;
+  volatile int done;
+  long snapshots;
+} concurrent_state;
+
+static int is_repeated_block(const uint8_t *str, size_t len, size_t block_offset) {
+  for (size_t i = 0; i < len; i++) {
+    if (str[i] != (uint8_t)CONCURRENT_BLOCK[(block_offset + i) % CONCURRENT_BLOCK_BYTES]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void *concurrent_reader(void *arg) {
+  concurrent_state *state = (concurrent_state *)arg;
+  rope_reader *reader = rope_reader_new(state->r);
+  test(reader != NULL);
+  uint8_t buf[64];
+  long snapshots = 0;
+
+  while (!__atomic_load_n(&state->done, __ATOMIC_ACQUIRE)) {
+    size_t len;
+    uint8_t *str = rope_reader_create_cstr(reader, &len);
+    test(len % CONCURRENT_BLOCK_BYTES == 0);
+    test(strlen((char *)str) == len);
+    test(is_repeated_block(str, len, 0));
+    state->r->free(str);
+
+    // And a window starting part way through a block, which ends wherever buf fills up.
+    size_t chars;
+    size_t num_chars = rope_reader_char_count(reader);
+    size_t pos = num_chars ? random() % num_chars : 0;
+    size_t block_offset = pos % CONCURRENT_BLOCK_CHARS;
+    size_t bytes = rope_reader_read(reader, pos, 100, buf, sizeof(buf), &chars);
+    test(chars <= 100 && bytes <= sizeof(buf));
+    test(is_repeated_block(buf, bytes, block_offset));
+    snapshots++;
+  }
+
+  rope_reader_free(reader);
+  __atomic_fetch_add(&state->snapshots, snapshots, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void test_concurrent_readers() {
+  // The writer mixes small inserts, big inserts which grow and split nodes, external spans which
+  // get trimmed and split, and deletes which free nodes out from under the readers.
+  const int num_blocks = 100;
+  uint8_t *blocks = malloc(num_blocks * CONCURRENT_BLOCK_BYTES + 1);
+  for (int i = 0; i < num_blocks; i++) {
+    memcpy(&blocks[i * CONCURRENT_BLOCK_BYTES], CONCURRENT_BLOCK, CONCURRENT_BLOCK_BYTES);
+  }
+  blocks[num_blocks * CONCURRENT_BLOCK_BYTES] = '\0';
+  uint8_t *owned = malloc(num_blocks * CONCURRENT_BLOCK_BYTES + 1);
+
+  concurrent_state state = { rope_new(), 0, 0 };
+  const int num_readers = 4;
+  pthread_t readers[num_readers];
+  for (int i = 0; i < num_readers; i++) {
+    pthread_create(&readers[i], NULL, concurrent_reader, &state);
+  }
+
+  rope *r = state.r;
+  for (int i = 0; i < 100000; i++) {
+    size_t len = rope_char_count(r) / CONCURRENT_BLOCK_CHARS;
+    size_t pos = (random() % (len + 1)) * CONCURRENT_BLOCK_CHARS;
+    size_t count = 1 + random() % (random() % 10 ? 2 : num_blocks);
+    float action = rand_float();
+    if (len < 1000 && action < 0.4f) {
+      rope_insert(r, pos, (uint8_t *)CONCURRENT_BLOCK);
+    } else if (len < 1000 && action < 0.5f) {
+      rope_insert_external(r, pos, blocks, count * CONCURRENT_BLOCK_BYTES);
+    } else if (len < 1000 && action < 0.6f) {
+      // Not blocks itself - external nodes reference it.
+      memcpy(owned, blocks, count * CONCURRENT_BLOCK_BYTES);
+      owned[count * CONCURRENT_BLOCK_BYTES] = '\0';
+      rope_insert(r, pos, owned);
+    } else {
+      rope_del(r, pos, count * CONCURRENT_BLOCK_CHARS);
+    }
+  }
+
+  __atomic_store_n(&state.done, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < num_readers; i++) {
+    pthread_join(readers[i], NULL);
+  }
+  _rope_check(r);
+  uint8_t *str = rope_create_cstr(r);
+  test(is_repeated_block(str, rope_byte_count(r), 0));
+  free(str);
+  printf("Concurrent readers took %ld snapshots\n", state.snapshots);
+
+  rope_free(r);
+  free(blocks);
+  free(owned);
+}
+#else
+static void test_concurrent_readers() {
+  printf("Skipping concurrent reader tests - ROPE_CONCURRENT disabled.\n");
+}
+#endif
+
 
 void test_all() {
   printf("Running tests...\n");
@@ -449,9 +2222,31 @@ void test_all() {
   test_really_long_ascii_string();
   test_custom_allocator();
   test_copy();
+  test_append();
+  test_external();
+  test_node_capacity();
+  test_write_cstr_parallel();
+  test_find_all();
+  test_utf16();
+  test_insert_utf16();
+  test_positions();
+  test_anchors();
+  test_stats();
+  test_config();
+  test_node_cache();
+  test_arena();
+  test_relayout();
+  test_compress();
+  test_read_fd();
+  test_write_fd();
+  test_hash();
+  test_compare();
+  test_diff();
   printf("Normal tests passed. Running randomizers...\n");
   test_random_edits();
   test_random_wchar_edits();
+  test_random_external_edits();
+  test_concurrent_readers();
   printf("Done!\n");
 }
 